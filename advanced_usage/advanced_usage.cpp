@@ -1,6 +1,7 @@
 #include <thread_comm.h>
 #include <thread>
 #include <vector>
+#include <iterator>
 
 const int number_of_messages_base_unit = 100000;
 
@@ -22,25 +23,18 @@ void producer_thread_main(thread_comm::channel<int> & c) {
 		auto msg = std::make_unique<int>(i);
 		c << msg;
 	}
-
-	std::unique_ptr<int> msg;
-	int final_msg_per_thread = number_of_workers/number_of_producers;
-	for (int i = 0 ; i < final_msg_per_thread ; ++i) {
-		c << msg;
-	}
 }
 
 void worker_thread_main(thread_comm::channel<int> & c) {
+	// The workers' endpoint goes straight to the right queues,
+	// without looking the thread's roles up for every message.
+	auto worker = c.worker_end();
 	std::unique_ptr<int> msg;
 
-	while (true) {
-		msg << c;
-
-		if (!msg) {
-			break;
-		}
-
-		c << msg;
+	// Reading fails once the producers are done and the channel
+	// has been drained.
+	while (worker.read(msg)) {
+		worker << msg;
 	}
 }
 
@@ -48,18 +42,17 @@ void collector_thread_main(thread_comm::channel<int> & c) {
 	c.become_a_read_owner();
 	c.become_a_non_writer();
 
-	std::unique_ptr<int> msg;
-
-	int counter = 0;
-	const int number_of_messages_per_collector =
-			total_number_of_messages / number_of_collectors;
-
-	while (true) {
-		msg << c;
-
-		if (++counter == number_of_messages_per_collector) {
-			break;
-		}
+	// Collectors drain the results in batches, which costs a single
+	// lock acquisition per batch instead of one per message.
+	const std::size_t batch_size = 256;
+	std::vector<std::unique_ptr<int>> batch;
+	batch.reserve(batch_size);
+
+	// Collectors don't need to know how many messages they will
+	// receive. read_bulk returns zero once the workers are done and
+	// the channel has been drained.
+	while (c.read_bulk(std::back_inserter(batch), batch_size) > 0) {
+		batch.clear();
 	}
 }
 
@@ -90,10 +83,17 @@ int main() {
 		producers[i].join();
 	}
 
+	// All of the messages are sent, the workers can stop once they
+	// have processed what's left.
+	c.close_to_workers();
+
 	for (int i = 0 ; i < number_of_workers ; ++i) {
 		workers[i].join();
 	}
 
+	// Likewise for the collectors.
+	c.close_to_owners();
+
 	for (int i = 0 ; i < number_of_collectors ; ++i) {
 		collectors[i].join();
 	}
@@ -0,0 +1,50 @@
+// Helpers that the benchmarks share.
+
+#ifndef THREAD_COMM_BENCH_UTIL_H
+#define THREAD_COMM_BENCH_UTIL_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdlib>
+
+// Splits a comma separated command line value, e.g. "1,2,4".
+inline std::vector<std::string> split(const std::string & list) {
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+
+	return items;
+}
+
+inline std::vector<int> split_ints(const std::string & list) {
+	std::vector<int> items;
+	for (auto & item : split(list)) {
+		items.push_back(std::atoi(item.c_str()));
+	}
+	return items;
+}
+
+// Runs f repetitions times (at least once) and returns the best of
+// its results, better(a, b) telling whether a beats b. Other processes
+// only ever make a run slower, so the best run is the closest to what
+// the code itself can do.
+template <typename F, typename Better>
+inline auto best_of(const int repetitions, F f, Better better) {
+	auto best = f();
+	for (int r = 1 ; r < repetitions ; ++r) {
+		auto current = f();
+		if (better(current, best)) {
+			best = current;
+		}
+	}
+	return best;
+}
+
+#endif
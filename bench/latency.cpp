@@ -0,0 +1,383 @@
+// Tail latency benchmarks for thread_comm. The averages of the throughput
+// benchmark hide the stalls, so this one records every message into a
+// log-linear (HDR style) histogram and reports the percentiles.
+//
+// The modes are:
+// - queue: a producer writes into a circular_queue at a fixed rate, and a
+//   consumer reads from it.
+// - channel: an owner writes into a channel at a fixed rate, a worker
+//   sends every message back, and a collector thread (also an owner)
+//   reads them.
+// - pingpong: the owner writes a message and waits for the worker to
+//   send it back before the next one, like simple_usage_1.cpp, paced at
+//   a fixed rate.
+//
+// Coordinated omission: a sender that falls behind sends late, and then
+// its late messages don't show the time they spent waiting to be sent.
+// In the queue and channel modes each message carries the time it was
+// scheduled to be sent, rather than the time it actually was, so the
+// waiting is part of its latency. The pingpong mode can't do that, as
+// the owner never has more than one message in flight, so it records
+// each round trip with the expected interval, and the histogram fills in
+// the samples that the stall swallowed. Both modes also report the
+// uncorrected numbers, to show how much the correction matters.
+//
+// Usage: ./latency [options]
+//   --modes queue,channel,pingpong   (default: all of them)
+//   --rates 10000,100000             (messages per second, default: 10000,100000)
+//   --queue-sizes 1,64               (default: 1,64)
+//   --messages 100000                (default: 100000)
+//   --format csv|json                (default: csv)
+// All the latencies are in nanoseconds.
+
+#include <thread_comm.h>
+#include "bench_util.h"
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+typedef std::chrono::steady_clock bench_clock;
+
+// A log-linear histogram: the values under sub_buckets get a bucket
+// each, and every power of two range above that is split into
+// sub_buckets / 2 linear buckets. A value is reported as the top of its
+// bucket, so it comes out at most 1/(sub_buckets / 2) too high, whatever
+// its magnitude, which is under 0.8% with 8 bits.
+class histogram {
+private:
+	static constexpr int sub_bucket_bits = 8;
+	static constexpr int sub_buckets = 1 << sub_bucket_bits;
+	static constexpr int ranges = 64 - sub_bucket_bits;
+
+	std::vector<std::uint64_t> counts;
+	std::uint64_t total;
+	std::uint64_t max_value;
+	double sum;
+
+	static int bucket_of(const std::uint64_t value) {
+		if (value < sub_buckets) {
+			return static_cast<int>(value);
+		}
+
+		const int range = 64 - __builtin_clzll(value) - sub_bucket_bits;
+		const int sub = static_cast<int>(value >> range) - sub_buckets / 2;
+
+		return (range + 1) * sub_buckets / 2 + sub;
+	}
+
+	// The highest value that falls into the given bucket.
+	static std::uint64_t value_of(const int bucket) {
+		if (bucket < sub_buckets) {
+			return bucket;
+		}
+
+		const int range = bucket / (sub_buckets / 2) - 1;
+		const std::uint64_t sub = bucket % (sub_buckets / 2) + sub_buckets / 2;
+
+		return ((sub + 1) << range) - 1;
+	}
+
+public:
+	histogram() : counts((ranges + 1) * sub_buckets / 2 + sub_buckets, 0),
+			total(0), max_value(0), sum(0) {
+	}
+
+	void record(const std::uint64_t value) {
+		++counts[bucket_of(value)];
+		++total;
+		max_value = std::max(max_value, value);
+		sum += value;
+	}
+
+	// Records a value that was measured once every expected_interval,
+	// and adds the values that the measurements we missed while waiting
+	// for this one would have seen.
+	void record_corrected(const std::uint64_t value,
+			const std::uint64_t expected_interval) {
+		record(value);
+
+		if (expected_interval == 0) {
+			return;
+		}
+
+		for (std::uint64_t missed = value - std::min(value, expected_interval);
+				missed >= expected_interval ; missed -= expected_interval) {
+			record(missed);
+		}
+	}
+
+	std::uint64_t percentile(const double p) const {
+		const std::uint64_t wanted = static_cast<std::uint64_t>(
+				p / 100.0 * total + 0.5);
+		std::uint64_t seen = 0;
+
+		for (std::size_t i = 0 ; i < counts.size() ; ++i) {
+			seen += counts[i];
+			if (seen >= std::max<std::uint64_t>(wanted, 1)) {
+				return std::min(value_of(static_cast<int>(i)), max_value);
+			}
+		}
+
+		return max_value;
+	}
+
+	std::uint64_t count() const {
+		return total;
+	}
+
+	std::uint64_t max() const {
+		return max_value;
+	}
+
+	double mean() const {
+		return total ? sum / total : 0;
+	}
+};
+
+typedef struct stamp_s {
+	bench_clock::time_point scheduled;
+	bench_clock::time_point sent;
+} stamp;
+
+typedef struct config_s {
+	std::string mode;
+	int rate;
+	int queue_size;
+	int messages;
+} config;
+
+static std::uint64_t nsecs(const bench_clock::duration d) {
+	return static_cast<std::uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+// Waits until the given time. Sleeping is too coarse for the short
+// intervals, so the last stretch is spent yielding.
+static void pace_until(const bench_clock::time_point t) {
+	if (t - bench_clock::now() > std::chrono::microseconds(200)) {
+		std::this_thread::sleep_until(t - std::chrono::microseconds(100));
+	}
+
+	while (bench_clock::now() < t) {
+		std::this_thread::yield();
+	}
+}
+
+static void record(const stamp & s, histogram & corrected, histogram & raw) {
+	const auto now = bench_clock::now();
+	corrected.record(nsecs(now - s.scheduled));
+	raw.record(nsecs(now - s.sent));
+}
+
+// Writes the messages at the configured rate, stamping each one with its
+// schedule.
+template <typename Writer>
+static void produce(const config & cfg, Writer && write) {
+	const auto interval = std::chrono::nanoseconds(1000000000LL / cfg.rate);
+	const auto start = bench_clock::now();
+
+	for (int i = 0 ; i < cfg.messages ; ++i) {
+		const auto scheduled = start + i * interval;
+		pace_until(scheduled);
+
+		auto msg = std::make_unique<stamp>();
+		msg->scheduled = scheduled;
+		msg->sent = bench_clock::now();
+		write(msg);
+	}
+}
+
+static void run_queue(const config & cfg, histogram & corrected,
+		histogram & raw) {
+	thread_comm::circular_queue<stamp> q(cfg.queue_size);
+
+	std::thread consumer([&] () {
+		std::unique_ptr<stamp> msg;
+		while (q.read(msg)) {
+			record(*msg, corrected, raw);
+		}
+	});
+
+	produce(cfg, [&q] (std::unique_ptr<stamp> & msg) {
+		q.write(msg);
+	});
+
+	q.close();
+	consumer.join();
+}
+
+static void run_channel(const config & cfg, histogram & corrected,
+		histogram & raw) {
+	thread_comm::channel<stamp> c(cfg.queue_size, cfg.queue_size);
+
+	std::thread worker([&c] () {
+		auto end = c.worker_end();
+		std::unique_ptr<stamp> msg;
+		while (end.read(msg)) {
+			end.write(msg);
+		}
+	});
+
+	std::thread collector([&] () {
+		c.become_a_read_owner();
+		c.become_a_non_writer();
+
+		std::unique_ptr<stamp> msg;
+		while (c.read(msg)) {
+			record(*msg, corrected, raw);
+		}
+	});
+
+	produce(cfg, [&c] (std::unique_ptr<stamp> & msg) {
+		c.write(msg);
+	});
+
+	c.close_to_workers();
+	worker.join();
+	c.close_to_owners();
+	collector.join();
+}
+
+static void run_pingpong(const config & cfg, histogram & corrected,
+		histogram & raw) {
+	thread_comm::channel<stamp> c(cfg.queue_size, cfg.queue_size);
+
+	std::thread worker([&c] () {
+		auto end = c.worker_end();
+		std::unique_ptr<stamp> msg;
+		while (end.read(msg)) {
+			end.write(msg);
+		}
+	});
+
+	const auto interval = std::chrono::nanoseconds(1000000000LL / cfg.rate);
+	auto next = bench_clock::now();
+
+	for (int i = 0 ; i < cfg.messages ; ++i) {
+		pace_until(next);
+
+		auto msg = std::make_unique<stamp>();
+		msg->scheduled = msg->sent = bench_clock::now();
+		c.write(msg);
+		c.read(msg);
+
+		const std::uint64_t rtt = nsecs(bench_clock::now() - msg->sent);
+		corrected.record_corrected(rtt, nsecs(interval));
+		raw.record(rtt);
+
+		// A round trip that overran its slot pushes the next one back,
+		// the same way a closed loop client would.
+		next = std::max(next + interval, bench_clock::now());
+	}
+
+	c.close_to_workers();
+	worker.join();
+}
+
+static const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+
+static void print_csv_header() {
+	std::cout << "mode,correction,rate,queue_size,samples,mean,p50,p90,p99,"
+			"p99.9,p99.99,max" << std::endl;
+}
+
+static void print_csv(const config & cfg, const char * correction,
+		const histogram & h) {
+	std::cout << cfg.mode << "," << correction << "," << cfg.rate << ","
+			<< cfg.queue_size << "," << h.count() << ","
+			<< static_cast<std::uint64_t>(h.mean());
+	for (double p : percentiles) {
+		std::cout << "," << h.percentile(p);
+	}
+	std::cout << "," << h.max() << std::endl;
+}
+
+static void print_json(const config & cfg, const char * correction,
+		const histogram & h, const bool first) {
+	std::cout << (first ? "  " : ", ") << "{\"mode\": \"" << cfg.mode
+			<< "\", \"correction\": \"" << correction
+			<< "\", \"rate\": " << cfg.rate
+			<< ", \"queue_size\": " << cfg.queue_size
+			<< ", \"samples\": " << h.count()
+			<< ", \"mean\": " << static_cast<std::uint64_t>(h.mean());
+	for (double p : percentiles) {
+		std::cout << ", \"p" << p << "\": " << h.percentile(p);
+	}
+	std::cout << ", \"max\": " << h.max() << "}" << std::endl;
+}
+
+int main(int argc, char * argv[]) {
+	std::vector<std::string> modes = {"queue", "channel", "pingpong"};
+	std::vector<int> rates = {10000, 100000};
+	std::vector<int> queue_sizes = {1, 64};
+	int messages = 100000;
+	std::string format = "csv";
+
+	for (int i = 1 ; i + 1 < argc ; i += 2) {
+		const std::string option = argv[i];
+		const std::string value = argv[i + 1];
+
+		if (option == "--modes") {
+			modes = split(value);
+		} else if (option == "--rates") {
+			rates = split_ints(value);
+		} else if (option == "--queue-sizes") {
+			queue_sizes = split_ints(value);
+		} else if (option == "--messages") {
+			messages = std::atoi(value.c_str());
+		} else if (option == "--format") {
+			format = value;
+		} else {
+			std::cerr << "Unknown option: " << option << std::endl;
+			return 1;
+		}
+	}
+
+	if (format == "json") {
+		std::cout << "[" << std::endl;
+	} else {
+		print_csv_header();
+	}
+
+	bool first = true;
+	for (auto & mode : modes) {
+		for (int rate : rates) {
+			for (int queue_size : queue_sizes) {
+				const config cfg{mode, rate, queue_size, messages};
+				histogram corrected;
+				histogram raw;
+
+				if (mode == "queue") {
+					run_queue(cfg, corrected, raw);
+				} else if (mode == "channel") {
+					run_channel(cfg, corrected, raw);
+				} else if (mode == "pingpong") {
+					run_pingpong(cfg, corrected, raw);
+				} else {
+					std::cerr << "Unknown mode: " << mode << std::endl;
+					return 1;
+				}
+
+				if (format == "json") {
+					print_json(cfg, "corrected", corrected, first);
+					print_json(cfg, "raw", raw, false);
+				} else {
+					print_csv(cfg, "corrected", corrected);
+					print_csv(cfg, "raw", raw);
+				}
+				first = false;
+			}
+		}
+	}
+
+	if (format == "json") {
+		std::cout << "]" << std::endl;
+	}
+
+	return 0;
+}
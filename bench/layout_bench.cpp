@@ -0,0 +1,90 @@
+// A micro benchmark for the memory layout of circular_queue. It pushes
+// messages through a single queue with a given number of producers and
+// consumers, and prints the throughput of each configuration as a CSV
+// line. The messages are allocated up front, so the numbers reflect the
+// queue itself rather than the allocator.
+//
+// Usage: ./layout_bench [messages] [repetitions]
+
+#include <thread_comm.h>
+#include "bench_util.h"
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+static double run(const int producers, const int consumers,
+		const int queue_size, const int messages) {
+	thread_comm::circular_queue<int> cq(queue_size);
+
+	// Every producer sends the same number of messages, and so does
+	// every consumer.
+	const int per_producer = messages / producers;
+	const int per_consumer = (per_producer * producers) / consumers;
+
+	std::vector<std::vector<std::unique_ptr<int>>> inputs(producers);
+	for (auto & input : inputs) {
+		for (int i = 0 ; i < per_producer ; ++i) {
+			input.push_back(std::make_unique<int>(i));
+		}
+	}
+
+	std::vector<std::thread> threads;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int c = 0 ; c < consumers ; ++c) {
+		threads.emplace_back([&cq, per_consumer] () {
+			std::unique_ptr<int> msg;
+			for (int i = 0 ; i < per_consumer ; ++i) {
+				msg << cq;
+			}
+		});
+	}
+
+	for (int p = 0 ; p < producers ; ++p) {
+		threads.emplace_back([&cq, &inputs, p] () {
+			for (auto & msg : inputs[p]) {
+				cq << msg;
+			}
+		});
+	}
+
+	for (auto & t : threads) {
+		t.join();
+	}
+
+	const std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+	return per_consumer * consumers / elapsed.count();
+}
+
+int main(int argc, char * argv[]) {
+	const int messages = argc > 1 ? std::atoi(argv[1]) : 1000000;
+	const int repetitions = argc > 2 ? std::atoi(argv[2]) : 5;
+
+	const int configurations[][3] = {
+		// producers, consumers, queue size
+		{1, 1, 1024},
+		{1, 1, 1000},
+		{4, 4, 1024},
+		{4, 4, 1000},
+	};
+
+	std::cout << "producers,consumers,queue_size,messages,msgs_per_sec"
+			<< std::endl;
+
+	for (auto & c : configurations) {
+		const double best = best_of(repetitions, [&c, messages] () {
+			return run(c[0], c[1], c[2], messages);
+		}, [] (const double a, const double b) { return a > b; });
+
+		std::cout << c[0] << "," << c[1] << "," << c[2] << ","
+				<< messages << "," << static_cast<long long>(best)
+				<< std::endl;
+	}
+
+	return 0;
+}
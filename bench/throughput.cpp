@@ -0,0 +1,359 @@
+// Throughput benchmarks for thread_comm. Every run pushes a number of
+// messages through one of the topologies below, and reports the number
+// of messages delivered per second:
+// - spsc, mpsc, spmc, mpmc: producers and consumers around a single
+//   queue, with 1 or N producers and 1 or N consumers.
+// - pipeline: the producer -> worker -> collector topology of
+//   advanced_usage.cpp over a channel, with N producers, 2N workers
+//   and N collectors.
+// The runs sweep the thread counts, the queue sizes and the payload
+// sizes given on the command line. Producers allocate a message per
+// send, as a real application would, so the numbers include the cost
+// of the allocator.
+//
+// Usage: ./throughput [options]
+//   --topologies spsc,mpsc,spmc,mpmc,pipeline  (default: all of them)
+//   --backend circular,mpmc,sharded,spsc       (default: circular)
+//   --threads 1,2,4                            (default: 1,2,4)
+//   --queue-sizes 64,1024                      (default: 64,1024)
+//   --payloads 8,64,256,1024                   (default: 8,64,1024)
+//   --messages 200000                          (default: 200000)
+//   --repetitions 3                            (default: 3)
+//   --format csv|json                          (default: csv)
+// For the pipeline, every queue size is used both as read_q_size and
+// as write_q_size, in all combinations. Each topology is run on every
+// backend given, except for spsc_queue, which only has room for a
+// single producer and a single consumer and so only runs spsc.
+
+#include <thread_comm.h>
+#include "bench_util.h"
+#include <thread>
+#include <vector>
+#include <array>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+
+template <std::size_t N>
+struct payload {
+	std::array<char, N> bytes;
+};
+
+typedef struct config_s {
+	std::string topology;
+	std::string backend;
+	int producers;
+	int workers;
+	int consumers;
+	int read_q_size;
+	int write_q_size;
+	std::size_t payload_bytes;
+	int messages;
+} config;
+
+typedef struct result_s {
+	config cfg;
+	int delivered;
+	double seconds;
+} result;
+
+// Splits the messages evenly between the threads; the remainder is
+// dropped so that every thread gets the same share.
+static int share(const int messages, const int threads) {
+	return messages / threads;
+}
+
+template <typename Queue, typename P>
+static result run_queue(const config & cfg) {
+	Queue q(cfg.write_q_size);
+
+	const int per_producer = share(cfg.messages, cfg.producers);
+	std::vector<std::thread> producers;
+	std::vector<std::thread> consumers;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int c = 0 ; c < cfg.consumers ; ++c) {
+		consumers.emplace_back([&q] () {
+			std::unique_ptr<P> msg;
+			while (q.read(msg)) {
+			}
+		});
+	}
+
+	for (int p = 0 ; p < cfg.producers ; ++p) {
+		producers.emplace_back([&q, per_producer] () {
+			for (int i = 0 ; i < per_producer ; ++i) {
+				auto msg = std::make_unique<P>();
+				msg->bytes[0] = static_cast<char>(i);
+				q.write(msg);
+			}
+		});
+	}
+
+	for (auto & t : producers) {
+		t.join();
+	}
+
+	q.close();
+
+	for (auto & t : consumers) {
+		t.join();
+	}
+
+	const std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+	return result{cfg, per_producer * cfg.producers, elapsed.count()};
+}
+
+template <template <typename> class Queue, typename P>
+static result run_pipeline(const config & cfg) {
+	thread_comm::channel<P, Queue> c(cfg.read_q_size, cfg.write_q_size);
+	c.become_a_non_reader();
+	c.become_a_non_writer();
+
+	const int per_producer = share(cfg.messages, cfg.producers);
+	std::vector<std::thread> producers;
+	std::vector<std::thread> workers;
+	std::vector<std::thread> collectors;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0 ; i < cfg.consumers ; ++i) {
+		collectors.emplace_back([&c] () {
+			c.become_a_read_owner();
+			c.become_a_non_writer();
+
+			std::unique_ptr<P> msg;
+			while (c.read(msg)) {
+			}
+		});
+	}
+
+	for (int i = 0 ; i < cfg.workers ; ++i) {
+		workers.emplace_back([&c] () {
+			auto worker = c.worker_end();
+			std::unique_ptr<P> msg;
+			while (worker.read(msg)) {
+				worker.write(msg);
+			}
+		});
+	}
+
+	for (int i = 0 ; i < cfg.producers ; ++i) {
+		producers.emplace_back([&c, per_producer] () {
+			c.become_a_write_owner();
+			c.become_a_non_reader();
+
+			for (int j = 0 ; j < per_producer ; ++j) {
+				auto msg = std::make_unique<P>();
+				msg->bytes[0] = static_cast<char>(j);
+				c.write(msg);
+			}
+		});
+	}
+
+	for (auto & t : producers) {
+		t.join();
+	}
+
+	c.close_to_workers();
+
+	for (auto & t : workers) {
+		t.join();
+	}
+
+	c.close_to_owners();
+
+	for (auto & t : collectors) {
+		t.join();
+	}
+
+	const std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+	return result{cfg, per_producer * cfg.producers, elapsed.count()};
+}
+
+template <typename P>
+static result run(const config & cfg) {
+	if (cfg.topology == "pipeline") {
+		if (cfg.backend == "mpmc") {
+			return run_pipeline<thread_comm::mpmc_queue, P>(cfg);
+		} else if (cfg.backend == "sharded") {
+			return run_pipeline<thread_comm::sharded_queue, P>(cfg);
+		}
+		return run_pipeline<thread_comm::circular_queue, P>(cfg);
+	}
+
+	if (cfg.backend == "spsc") {
+		return run_queue<thread_comm::spsc_queue<P>, P>(cfg);
+	} else if (cfg.backend == "mpmc") {
+		return run_queue<thread_comm::mpmc_queue<P>, P>(cfg);
+	} else if (cfg.backend == "sharded") {
+		return run_queue<thread_comm::sharded_queue<P>, P>(cfg);
+	}
+	return run_queue<thread_comm::circular_queue<P>, P>(cfg);
+}
+
+static result dispatch(const config & cfg) {
+	switch (cfg.payload_bytes) {
+	case 8:
+		return run<payload<8>>(cfg);
+	case 64:
+		return run<payload<64>>(cfg);
+	case 256:
+		return run<payload<256>>(cfg);
+	case 1024:
+		return run<payload<1024>>(cfg);
+	case 4096:
+		return run<payload<4096>>(cfg);
+	default:
+		std::cerr << "Unsupported payload size: " << cfg.payload_bytes
+				<< " (use 8, 64, 256, 1024 or 4096)" << std::endl;
+		std::exit(1);
+	}
+}
+
+static void print_csv_header() {
+	std::cout << "topology,backend,producers,workers,consumers,read_q_size,"
+			"write_q_size,payload_bytes,messages,seconds,msgs_per_sec"
+			<< std::endl;
+}
+
+static void print_csv(const result & r) {
+	const config & c = r.cfg;
+	std::cout << c.topology << "," << c.backend << "," << c.producers << ","
+			<< c.workers << "," << c.consumers << "," << c.read_q_size << ","
+			<< c.write_q_size << "," << c.payload_bytes << "," << r.delivered
+			<< "," << r.seconds << ","
+			<< static_cast<long long>(r.delivered / r.seconds) << std::endl;
+}
+
+static void print_json(const result & r, const bool first) {
+	const config & c = r.cfg;
+	std::cout << (first ? "  " : ", ") << "{\"topology\": \"" << c.topology
+			<< "\", \"backend\": \"" << c.backend
+			<< "\", \"producers\": " << c.producers
+			<< ", \"workers\": " << c.workers
+			<< ", \"consumers\": " << c.consumers
+			<< ", \"read_q_size\": " << c.read_q_size
+			<< ", \"write_q_size\": " << c.write_q_size
+			<< ", \"payload_bytes\": " << c.payload_bytes
+			<< ", \"messages\": " << r.delivered
+			<< ", \"seconds\": " << r.seconds
+			<< ", \"msgs_per_sec\": "
+			<< static_cast<long long>(r.delivered / r.seconds) << "}"
+			<< std::endl;
+}
+
+int main(int argc, char * argv[]) {
+	std::vector<std::string> topologies = {
+		"spsc", "mpsc", "spmc", "mpmc", "pipeline"
+	};
+	std::vector<std::string> backends = {"circular"};
+	std::vector<int> threads = {1, 2, 4};
+	std::vector<int> queue_sizes = {64, 1024};
+	std::vector<int> payloads = {8, 64, 1024};
+	int messages = 200000;
+	int repetitions = 3;
+	std::string format = "csv";
+
+	for (int i = 1 ; i + 1 < argc ; i += 2) {
+		const std::string option = argv[i];
+		const std::string value = argv[i + 1];
+
+		if (option == "--topologies") {
+			topologies = split(value);
+		} else if (option == "--backend") {
+			backends = split(value);
+		} else if (option == "--threads") {
+			threads = split_ints(value);
+		} else if (option == "--queue-sizes") {
+			queue_sizes = split_ints(value);
+		} else if (option == "--payloads") {
+			payloads = split_ints(value);
+		} else if (option == "--messages") {
+			messages = std::atoi(value.c_str());
+		} else if (option == "--repetitions") {
+			repetitions = std::atoi(value.c_str());
+		} else if (option == "--format") {
+			format = value;
+		} else {
+			std::cerr << "Unknown option: " << option << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<config> configs;
+
+	for (auto & backend : backends) {
+		for (auto & topology : topologies) {
+			if (backend == "spsc" && topology != "spsc") {
+				continue;
+			}
+
+			for (int n : threads) {
+				// The single-producer or single-consumer topologies don't
+				// need to be run for every thread count on that side.
+				const int producers = (topology == "spsc" ||
+						topology == "spmc") ? 1 : n;
+				const int consumers = (topology == "spsc" ||
+						topology == "mpsc") ? 1 : n;
+				const int workers = topology == "pipeline" ? 2*n : 0;
+
+				if (topology == "spsc" && n != threads.front()) {
+					continue;
+				}
+
+				for (int read_q_size : queue_sizes) {
+					for (int write_q_size : queue_sizes) {
+						if (topology != "pipeline" && read_q_size != write_q_size) {
+							continue;
+						}
+
+						for (int p : payloads) {
+							configs.push_back(config{topology, backend, producers,
+									workers, consumers,
+									topology == "pipeline" ? read_q_size : 0,
+									write_q_size, static_cast<std::size_t>(p),
+									messages});
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (format == "json") {
+		std::cout << "[" << std::endl;
+	} else {
+		print_csv_header();
+	}
+
+	bool first = true;
+	for (auto & cfg : configs) {
+		const result best = best_of(repetitions, [&cfg] () {
+			return dispatch(cfg);
+		}, [] (const result & a, const result & b) {
+			return a.seconds < b.seconds;
+		});
+
+		if (format == "json") {
+			print_json(best, first);
+		} else {
+			print_csv(best);
+		}
+		first = false;
+	}
+
+	if (format == "json") {
+		std::cout << "]" << std::endl;
+	}
+
+	return 0;
+}
@@ -32,7 +32,45 @@ SOFTWARE.
 #include <condition_variable>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
+#include <cstdint>
 #include <chrono>
+#include <atomic>
+#include <optional>
+#include <new>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <future>
+#include <type_traits>
+#include <deque>
+#include <map>
+#include <string>
+
+// The coroutine support (async_read() and friends) needs C++20. It's
+// left out for the C++17 users.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define THREAD_COMM_COROUTINES 1
+#endif
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+// shared_memory_queue needs robust process-shared mutexes, which only
+// linux has.
+#define THREAD_COMM_SHARED_MEMORY 1
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 // Namespace thread_comm implements two simple class templates
 // that can be used for communication between threads. The first
@@ -48,403 +86,6688 @@ SOFTWARE.
 // reusable communication medium between threads. A channel can
 // have multiple producers and consumers on both ends. It can
 // even support having separate read and write owners.
+// For the hot paths where exactly one thread writes and exactly
+// one thread reads, spsc_queue offers the same interface as
+// circular_queue without taking a mutex per message, and mpmc_queue
+// does the same for any number of producers and consumers. The
+// latter can also be used as the backing queue of a channel.
+// value_queue is a circular_queue that stores the messages
+// themselves in its slots instead of unique pointers to them, and
+// segmented_queue is an unbounded (or softly bounded) queue that
+// grows and shrinks with its load, and priority_circular_queue keeps
+// a ring per priority level so urgent messages skip the backlog.
+// broadcast_ring delivers every message to all of its subscribers.
+// sharded_queue spreads its messages over several circular_queues, to
+// take the pressure off a single lock.
+// partitioned_channel keeps the messages of every key in order while
+// its workers run in parallel, and ordered_channel hands the results of
+// its workers to the collectors in the order of their messages.
+// pipeline builds the threads and queues of a multi-stage pipeline
+// from source(f) | stage(g, parallelism) | sink(h).
+// shared_memory_queue is a circular queue between processes, in a
+// POSIX shared memory region.
+// work_stealing_pool runs tasks on worker threads with work stealing
+// deques, so that the workers don't all fight over a single queue.
+// An object_pool lets the consumers hand the messages back to the
+// producers, so that they don't have to be allocated for every send.
+// A thread that needs to wait on several circular queues and channels
+// at once can use a selector, which works like golang's select.
 namespace thread_comm {
-template <typename T>
-class circular_queue {
-private:
-	typedef struct timeout_data_s {
-		std::chrono::system_clock::duration duration;
-		bool timed_out;
+namespace detail {
+// Keeping the fields that are written by different threads this far
+// apart prevents them from sharing a cache line.
+constexpr std::size_t cache_line_size = 64;
 
-		timeout_data_s(const std::chrono::system_clock::duration _duration =
-						std::chrono::system_clock::duration(0)):
-					duration(_duration),
-					timed_out(false)
-		{}
-	} timeout_data;
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
 
-	std::size_t size;
+// A parking_lot lets the lock-free queues put a waiting thread to
+// sleep, while keeping the mutex off the fast path. The notifying
+// side only touches the mutex when it can see that somebody is
+// actually parked. The seq_cst fences on both sides make sure that
+// either the parking thread sees the new state through its
+// predicate, or the notifying thread sees the parked thread.
+class parking_lot {
+private:
+	std::mutex protector;
+	std::condition_variable cond;
+	std::atomic<std::size_t> waiters;
 
-	std::size_t read_index;
-	std::size_t write_index;
-	std::size_t count;
+public:
+	parking_lot() : waiters(0) {}
 
-	// Although I was tempted to use a shared_mutex (rw_lock) for this,
-	// especially for the msg_count function, the answer below convinced
-	// me otherwise:
-	// https://stackoverflow.com/questions/34930855/condition-variable-and-shared-mutex
-	// Quoting from the answer directly:
-	// Class condition_variable provides a condition variable that can only wait
-	// on an object of type unique_lock<mutex>, allowing maximum efficiency on
-	// some platforms.
-	std::unique_ptr<std::mutex> protector;
-	std::unique_ptr<std::condition_variable> read_cond;
-	std::unique_ptr<std::condition_variable> write_cond;
+	template <typename Predicate>
+	void park(Predicate ready) {
+		std::unique_lock<std::mutex> ulock(protector);
+		waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cond.wait(ulock, ready);
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
 
-	std::vector<std::unique_ptr<T>> data;
+	template <typename Predicate>
+	bool park_until(const std::chrono::steady_clock::time_point deadline,
+			Predicate ready) {
+		std::unique_lock<std::mutex> ulock(protector);
+		waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool result = cond.wait_until(ulock, deadline, ready);
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+		return result;
+	}
 
-	void _write(std::unique_ptr<T> & message,
-			std::unique_lock<std::mutex> & ulock,
-			timeout_data *td = nullptr) {
-		if (!td) {
-			write_cond->wait(ulock, [this] { return count < size; });
-		} else {
-			if (!write_cond->wait_for(ulock, td->duration,
-					[this] { return count < size; }
-			)) {
-				td->timed_out = true;
-				return;
-			}
+	void unpark_one() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) != 0) {
+			std::lock_guard<std::mutex> guard(protector);
+			cond.notify_one();
 		}
+	}
 
-		data[write_index++] = std::move(message);
-
-		if (write_index == size) {
-			write_index = 0;
+	void unpark_all() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) != 0) {
+			std::lock_guard<std::mutex> guard(protector);
+			cond.notify_all();
 		}
+	}
+}; // parking_lot
 
-		++count;
+// A select_waiter is what a selector subscribes to the queues it
+// waits on. Queues signal it whenever their state changes, so that
+// the selector can go and check its cases again.
+class select_waiter {
+private:
+	std::mutex protector;
+	std::condition_variable cond;
+	bool signaled;
+
+public:
+	select_waiter() : signaled(false) {}
 
-		read_cond->notify_one();
+	void signal() {
+		std::lock_guard<std::mutex> guard(protector);
+		signaled = true;
+		cond.notify_one();
 	}
 
-	std::unique_ptr<T> _read(std::unique_lock<std::mutex> & ulock,
-			timeout_data *td = nullptr) {
-		std::unique_ptr<T> m;
-		if (!td) {
-			read_cond->wait(ulock, [this] { return count > 0; });
-		} else {
-			if (!read_cond->wait_for(ulock, td->duration,
-					[this] { return count > 0; })) {
-				td->timed_out = true;
-				return nullptr;
-			}
+	void reset() {
+		std::lock_guard<std::mutex> guard(protector);
+		signaled = false;
+	}
+
+	void wait() {
+		std::unique_lock<std::mutex> ulock(protector);
+		cond.wait(ulock, [this] { return signaled; });
+		signaled = false;
+	}
+
+	bool wait_until(const std::chrono::steady_clock::time_point deadline) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!cond.wait_until(ulock, deadline, [this] { return signaled; })) {
+			return false;
 		}
+		signaled = false;
+		return true;
+	}
+}; // select_waiter
 
-		m = std::move(data[read_index++]);
+// A readiness_fd is a file descriptor that stays readable while some
+// condition holds, so that it can be watched by epoll/poll/select. It
+// is an eventfd on linux, and a pipe on other unix systems. set() and
+// clear() only make a system call when the state actually changes, so
+// a burst of writes into a queue costs at most one write(2).
+// It isn't thread-safe, its owner must serialize the calls.
+class readiness_fd {
+private:
+	int read_end;
+	int write_end;
+	bool signaled;
 
-		if (read_index == size) {
-			read_index = 0;
+public:
+	readiness_fd() :
+		read_end(-1),
+		write_end(-1),
+		signaled(false) {
+#if defined(__linux__)
+		read_end = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		write_end = read_end;
+#elif defined(__unix__) || defined(__APPLE__)
+		int fds[2];
+		if (pipe(fds) == 0) {
+			for (int fd : fds) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+			}
+			read_end = fds[0];
+			write_end = fds[1];
 		}
+#endif
+	}
 
-		--count;
+	~readiness_fd() {
+#if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+		if (read_end >= 0) {
+			::close(read_end);
+		}
+		if (write_end >= 0 && write_end != read_end) {
+			::close(write_end);
+		}
+#endif
+	}
 
-		write_cond->notify_one();
+	readiness_fd(const readiness_fd &) = delete;
+	readiness_fd & operator=(const readiness_fd &) = delete;
 
-		return m;
+	// The descriptor to watch, or -1 if it couldn't be created.
+	int fd() const {
+		return read_end;
 	}
 
-public:
-	circular_queue(int _size = 1) :
-		size(_size),
-		read_index(0),
-		write_index(0),
-		count(0) {
-		if (size == 0) {
-			std::cerr << "thread_comm::circular_queue - size can not be zero"
-					<< std::endl;
-			std::abort();
+	void update(const bool ready) {
+		if (read_end < 0 || ready == signaled) {
+			return;
 		}
 
-		protector = std::make_unique<std::mutex>();
-		read_cond = std::make_unique<std::condition_variable>();
-		write_cond = std::make_unique<std::condition_variable>();
+#if defined(__linux__)
+		if (ready) {
+			eventfd_write(write_end, 1);
+		} else {
+			eventfd_t value;
+			eventfd_read(read_end, &value);
+		}
+#elif defined(__unix__) || defined(__APPLE__)
+		char byte = 0;
+		if (ready) {
+			ssize_t r = ::write(write_end, &byte, 1);
+			(void)r;
+		} else {
+			ssize_t r = ::read(read_end, &byte, 1);
+			(void)r;
+		}
+#endif
 
-		data = std::vector<std::unique_ptr<T>>(size);
+		signaled = ready;
 	}
+}; // readiness_fd
+} // namespace detail
 
-	circular_queue<T>& operator=(circular_queue<T> && cq) {
-		size = cq.size;
-		read_index = cq.read_index;
-		write_index = cq.write_index;
-		count = cq.count;
+class selector;
 
-		protector = std::move(cq.protector);
-		read_cond = std::move(cq.read_cond);
-		write_cond = std::move(cq.write_cond);
+// The wait strategy of a circular_queue tells what a blocked reader or
+// writer does before it goes to sleep on a condition variable:
+// - block: goes to sleep right away. This is the default, and it
+//   doesn't waste any cpu cycles.
+// - spin: busy-spins (with a cpu pause hint) until the queue becomes
+//   ready, and never goes to sleep unless another thread beats it to
+//   the message (or the slot). It gives the lowest wake up latency,
+//   and it's meant for threads pinned to their own cores.
+// - spin_then_yield: spins for a short while, then yields the cpu for
+//   a while, then goes to sleep.
+// - adaptive: spins for a while and then goes to sleep. How long it
+//   spins is tuned on the fly based on how long the recent waits took,
+//   so that it spins just long enough for the typical wait.
+// When a waiter doesn't go to sleep, the other side doesn't have to
+// wake it up, which saves both of them the system calls. The timed
+// operations only spin until their deadline.
+enum class wait_strategy {
+	block,
+	spin,
+	spin_then_yield,
+	adaptive
+};
 
-		data = std::move(cq.data);
+// The statistics of a circular_queue, which are only collected when
+// THREAD_COMM_METRICS is defined before thread_comm.h is included.
+// Otherwise the instrumentation compiles away, and all of these stay
+// zero.
+typedef struct queue_stats_s {
+	std::uint64_t messages_in;
+	std::uint64_t messages_out;
+	// The writes and the reads that had to go to sleep on the condition
+	// variables, and the total time they slept for.
+	std::uint64_t blocked_writes;
+	std::uint64_t blocked_reads;
+	std::chrono::nanoseconds write_wait_time;
+	std::chrono::nanoseconds read_wait_time;
+	std::uint64_t timed_out_writes;
+	std::uint64_t timed_out_reads;
+	// The try_ operations that didn't transfer anything.
+	std::uint64_t failed_try_writes;
+	std::uint64_t failed_try_reads;
+	// The largest number of messages the queue has held at once.
+	std::size_t high_water_mark;
+} queue_stats;
 
-		return *this;
-	}
+namespace detail {
+#ifdef THREAD_COMM_METRICS
+// A counter that is incremented by many threads at once without the
+// threads fighting over a single cache line: every thread adds to one
+// of the shards, and reading the counter adds the shards up.
+class sharded_counter {
+private:
+	static constexpr int shard_count = 8;
+
+	typedef struct alignas(cache_line_size) shard_s {
+		std::atomic<std::uint64_t> value{0};
+	} shard;
+
+	shard shards[shard_count];
 
-	void write(std::unique_ptr<T> & message) {
-		std::unique_lock<std::mutex> ulock(*protector);
-		_write(message, ulock);
+	static int shard_index() {
+		static thread_local const int index = static_cast<int>(
+				std::hash<std::thread::id>()(std::this_thread::get_id()) %
+				shard_count);
+		return index;
 	}
 
-	std::unique_ptr<T> read() {
-		std::unique_lock<std::mutex> ulock(*protector);
-		return _read(ulock);
+public:
+	void add(const std::uint64_t n = 1) {
+		shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
 	}
 
-	bool timed_write(std::unique_ptr<T> & message,
-			const std::chrono::system_clock::duration duration) {
-		timeout_data td(duration);
+	std::uint64_t load() const {
+		std::uint64_t total = 0;
+		for (auto & s : shards) {
+			total += s.value.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+}; // sharded_counter
 
-		std::unique_lock<std::mutex> ulock(*protector);
-		_write(message, ulock, &td);
+// The counters of a circular_queue. Most of them are only updated
+// under the lock of the queue, which already serializes their writers,
+// so they are plain atomics that are only there for the readers of
+// the statistics. The try_ failures are counted without the lock, so
+// they are sharded.
+class queue_metrics {
+private:
+	std::atomic<std::uint64_t> messages_in{0};
+	std::atomic<std::uint64_t> messages_out{0};
+	std::atomic<std::uint64_t> blocked_writes{0};
+	std::atomic<std::uint64_t> blocked_reads{0};
+	std::atomic<std::uint64_t> write_wait_ns{0};
+	std::atomic<std::uint64_t> read_wait_ns{0};
+	std::atomic<std::uint64_t> timed_out_writes{0};
+	std::atomic<std::uint64_t> timed_out_reads{0};
+	std::atomic<std::size_t> high_water_mark{0};
+	sharded_counter failed_try_writes;
+	sharded_counter failed_try_reads;
 
-		return !td.timed_out;
+	template <typename U>
+	static void bump(std::atomic<U> & counter, const U n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
 	}
 
-	std::unique_ptr<T> timed_read(
-			const std::chrono::system_clock::duration duration,
-			bool & timed_out) {
-		timeout_data td(duration);
+	static std::uint64_t since(const std::chrono::steady_clock::time_point t) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - t).count();
+	}
 
-		std::unique_lock<std::mutex> ulock(*protector);
-		auto m = _read(ulock, &td);
-		timed_out = td.timed_out;
+public:
+	typedef std::chrono::steady_clock::time_point wait_start;
 
-		return m;
+	static wait_start start_wait() {
+		return std::chrono::steady_clock::now();
 	}
 
-	bool try_writing(std::unique_ptr<T> & message) {
-		std::unique_lock<std::mutex> ulock(*protector);
-		if (count < size) {
-			_write(message, ulock);
-			return true;
+	// The ones below are called under the lock of the queue.
+	void wrote(const std::uint64_t n, const std::size_t count) {
+		bump(messages_in, n);
+		if (count > high_water_mark.load(std::memory_order_relaxed)) {
+			high_water_mark.store(count, std::memory_order_relaxed);
 		}
-		return false;
 	}
 
-	std::unique_ptr<T> try_reading() {
-		std::unique_lock<std::mutex> ulock(*protector);
-		if (count > 0) {
-			return _read(ulock);
-		}
-
-		return nullptr;
+	void read(const std::uint64_t n) {
+		bump(messages_out, n);
 	}
 
-	std::size_t msg_count() {
-		std::unique_lock<std::mutex> ulock(*protector);
-		return count;
+	void blocked_write(const wait_start start) {
+		bump<std::uint64_t>(blocked_writes, 1);
+		bump(write_wait_ns, since(start));
 	}
 
-	void operator<<(std::unique_ptr<T> & message) {
-		write(message);
+	void blocked_read(const wait_start start) {
+		bump<std::uint64_t>(blocked_reads, 1);
+		bump(read_wait_ns, since(start));
 	}
 
-	void operator>>(std::unique_ptr<T> & message) {
-		message = read();
+	void timed_out_write() {
+		bump<std::uint64_t>(timed_out_writes, 1);
 	}
-}; // circular_queue
 
-// global overloads for circular_queue - start
-template <typename T>
-void operator>>(std::unique_ptr<T> & message, circular_queue<T> & cq) {
-	cq.write(message);
-}
+	void timed_out_read() {
+		bump<std::uint64_t>(timed_out_reads, 1);
+	}
 
-template <typename T>
-void operator<<(std::unique_ptr<T> & message, circular_queue<T> & cq) {
-	message = cq.read();
-}
-// global overloads for circular_queue - end
+	// These two are called without the lock.
+	void failed_try_write() {
+		failed_try_writes.add();
+	}
 
-template <typename T>
-class channel {
-private:
-	class thr_safe_set {
-	private:
-		std::unordered_set<std::thread::id> owner_ids;
-		std::shared_mutex rw_mutex;
+	void failed_try_read() {
+		failed_try_reads.add();
+	}
 
-	public:
-		thr_safe_set() {} // For the empty sets
+	queue_stats snapshot() const {
+		queue_stats st;
+		st.messages_in = messages_in.load(std::memory_order_relaxed);
+		st.messages_out = messages_out.load(std::memory_order_relaxed);
+		st.blocked_writes = blocked_writes.load(std::memory_order_relaxed);
+		st.blocked_reads = blocked_reads.load(std::memory_order_relaxed);
+		st.write_wait_time = std::chrono::nanoseconds(
+				write_wait_ns.load(std::memory_order_relaxed));
+		st.read_wait_time = std::chrono::nanoseconds(
+				read_wait_ns.load(std::memory_order_relaxed));
+		st.timed_out_writes = timed_out_writes.load(std::memory_order_relaxed);
+		st.timed_out_reads = timed_out_reads.load(std::memory_order_relaxed);
+		st.failed_try_writes = failed_try_writes.load();
+		st.failed_try_reads = failed_try_reads.load();
+		st.high_water_mark = high_water_mark.load(std::memory_order_relaxed);
+		return st;
+	}
+}; // queue_metrics
+#else
+// Without THREAD_COMM_METRICS, the instrumentation is a set of empty
+// functions that the compiler throws away.
+class queue_metrics {
+public:
+	typedef struct wait_start_s {} wait_start;
 
-		thr_safe_set(const std::thread::id _id) {
-			owner_ids.insert(_id);
-		}
+	static wait_start start_wait() {
+		return wait_start();
+	}
 
-		bool present(const std::thread::id _id) {
-			std::shared_lock<std::shared_mutex> r_guard(rw_mutex);
-			return owner_ids.find(_id) != owner_ids.end();
-		}
+	void wrote(const std::uint64_t, const std::size_t) {}
+	void read(const std::uint64_t) {}
+	void blocked_write(const wait_start) {}
+	void blocked_read(const wait_start) {}
+	void timed_out_write() {}
+	void timed_out_read() {}
+	void failed_try_write() {}
+	void failed_try_read() {}
 
-		void add(const std::thread::id _id) {
-			std::lock_guard<std::shared_mutex> w_guard(rw_mutex);
-			owner_ids.insert(_id);
-		}
+	queue_stats snapshot() const {
+		return queue_stats();
+	}
+}; // queue_metrics
+#endif
+} // namespace detail
 
-		void remove(const std::thread::id _id) {
-			std::lock_guard<std::shared_mutex> w_guard(rw_mutex);
-			owner_ids.erase(_id);
-		}
-	}; // thr_safe_set
+#if defined(THREAD_COMM_COROUTINES)
+// The result of co_await'ing one of the async_ operations.
+enum class async_status {
+	ok,
+	closed,
+	timed_out
+};
 
-	thr_safe_set read_owners;
-	thr_safe_set write_owners;
+namespace detail {
+// A coroutine that is suspended on a queue. Whoever claims it first
+// (the queue, handing it a message or a slot, or the timer) completes
+// it, and resumes the coroutine through its executor.
+template <typename T>
+class async_waiter {
+private:
+	std::atomic<bool> claimed;
 
-	thr_safe_set non_readers;
-	thr_safe_set non_writers;
+public:
+	// The caller's message, which lives in the coroutine frame.
+	std::unique_ptr<T> * message;
+	async_status status;
+	std::function<void()> resume;
+	// The timer of a timed operation, which is cancelled when the queue
+	// completes the operation first. A timer_id of zero means none.
+	std::chrono::steady_clock::time_point deadline;
+	std::uint64_t timer_id;
 
-	circular_queue<T> worker_to_read_owner_queue;
-	circular_queue<T> write_owner_to_worker_queue;
+	async_waiter() : claimed(false), message(nullptr),
+			status(async_status::ok), timer_id(0) {}
 
-	void assert_read_allowance(const std::thread::id _id) {
-		if (non_readers.present(_id)) {
-			std::cerr << "A non-reader thread can not read anymore:"
-					<< _id << std::endl;
-			abort();
-		}
+	bool claim() {
+		return !claimed.exchange(true);
 	}
 
-	void assert_write_allowance(const std::thread::id _id) {
-		if (non_writers.present(_id)) {
-			std::cerr << "A non-writer thread can not write anymore:"
-					<< _id << std::endl;
-			abort();
-		}
+	void complete(const async_status _status) {
+		status = _status;
+		resume();
 	}
+}; // async_waiter
 
-public:
-	channel(int read_q_size = 1, int write_q_size = 0) :
-		read_owners(std::this_thread::get_id()),
-		write_owners(std::this_thread::get_id()),
-		worker_to_read_owner_queue(read_q_size),
-		write_owner_to_worker_queue(
-				write_q_size == 0 ? read_q_size:write_q_size)
-	{}
+// A single background thread that runs the callbacks of the timed
+// async_ operations at their deadlines. The operations that complete in
+// time cancel their callbacks, so that the timers don't pile up until
+// their deadlines.
+class timer_service {
+private:
+	typedef struct timer_s {
+		std::uint64_t id;
+		std::function<void()> f;
+	} timer;
 
-	channel<T> & operator=(channel<T> && c) {
-		read_owners = std::move(c.read_owners);
-		write_owners = std::move(c.write_owners);
-		non_readers = std::move(c.non_readers);
-		non_writers = std::move(c.non_writers);
-		write_owner_to_worker_queue = std::move(c.write_owner_to_worker_queue);
-		worker_to_read_owner_queue = std::move(c.worker_to_read_owner_queue);
+	std::mutex protector;
+	std::condition_variable cond;
+	std::multimap<std::chrono::steady_clock::time_point, timer> timers;
+	std::uint64_t last_id;
+	bool stopping;
+	std::thread thread;
 
-		return *this;
-	}
+	void _run() {
+		std::unique_lock<std::mutex> ulock(protector);
+		while (!stopping) {
+			if (timers.empty()) {
+				cond.wait(ulock);
+				continue;
+			}
 
-	std::unique_ptr<T> read() {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_read_allowance(_id);
+			auto first = timers.begin();
+			if (std::chrono::steady_clock::now() < first->first) {
+				cond.wait_until(ulock, first->first);
+				continue;
+			}
 
-		if (read_owners.present(_id)) {
-			return worker_to_read_owner_queue.read();
-		} else {
-			return write_owner_to_worker_queue.read();
+			auto f = std::move(first->second.f);
+			timers.erase(first);
+
+			ulock.unlock();
+			f();
+			ulock.lock();
 		}
 	}
 
-	void write(std::unique_ptr<T> & message) {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_write_allowance(_id);
+	timer_service() :
+		last_id(0),
+		stopping(false),
+		thread([this] { _run(); })
+	{}
 
-		if (write_owners.present(_id)) {
-			write_owner_to_worker_queue.write(message);
-		} else {
-			worker_to_read_owner_queue.write(message);
+public:
+	~timer_service() {
+		{
+			std::lock_guard<std::mutex> guard(protector);
+			stopping = true;
 		}
+		cond.notify_one();
+		thread.join();
 	}
 
-	void operator>>(std::unique_ptr<T> & message) {
-		message = read();
-	}
-
-	void operator<<(std::unique_ptr<T> & message) {
-		write(message);
+	static timer_service & instance() {
+		static timer_service service;
+		return service;
 	}
 
-	std::unique_ptr<T> try_reading() {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_read_allowance(_id);
-
-		if (read_owners.present(_id)) {
-			return worker_to_read_owner_queue.try_reading();
-		} else {
-			return write_owner_to_worker_queue.try_reading();
+	// Returns the id that cancel() takes, along with the deadline.
+	std::uint64_t schedule(const std::chrono::steady_clock::time_point deadline,
+			std::function<void()> f) {
+		std::lock_guard<std::mutex> guard(protector);
+		const bool earliest = timers.empty() || deadline < timers.begin()->first;
+		const std::uint64_t id = ++last_id;
+		timers.emplace(deadline, timer{id, std::move(f)});
+		if (earliest) {
+			cond.notify_one();
 		}
+		return id;
 	}
 
-	std::unique_ptr<T> timed_read(
-			const std::chrono::system_clock::duration duration,
-			bool & timed_out) {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_read_allowance(_id);
-
-		if (read_owners.present(_id)) {
-			return worker_to_read_owner_queue.timed_read(duration, timed_out);
-		} else {
-			return write_owner_to_worker_queue.timed_read(duration, timed_out);
+	// Does nothing if the callback has already been run.
+	void cancel(const std::chrono::steady_clock::time_point deadline,
+			const std::uint64_t id) {
+		std::function<void()> f;
+		{
+			std::lock_guard<std::mutex> guard(protector);
+			auto range = timers.equal_range(deadline);
+			for (auto it = range.first ; it != range.second ; ++it) {
+				if (it->second.id == id) {
+					f = std::move(it->second.f);
+					timers.erase(it);
+					break;
+				}
+			}
 		}
+		// f is destroyed here, out of the lock, along with whatever it
+		// holds on to.
 	}
 
-	std::size_t read_msg_count() {
-		if (read_owners.present(std::this_thread::get_id())) {
-			return worker_to_read_owner_queue.msg_count();
-		} else {
-			return write_owner_to_worker_queue.msg_count();
-		}
+	std::size_t pending() {
+		std::lock_guard<std::mutex> guard(protector);
+		return timers.size();
 	}
+}; // timer_service
+} // namespace detail
+#endif
 
-	bool try_writing(std::unique_ptr<T> & message) {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_write_allowance(_id);
-
-		if (write_owners.present(_id)) {
-			return write_owner_to_worker_queue.try_writing(message);
-		} else {
-			return worker_to_read_owner_queue.try_writing(message);
-		}
-	}
+template <typename T>
+class circular_queue {
+private:
+	friend class selector;
+
+	typedef struct timeout_data_s {
+		std::chrono::system_clock::duration duration;
+		bool timed_out;
+
+		timeout_data_s(const std::chrono::system_clock::duration _duration =
+						std::chrono::system_clock::duration(0)):
+					duration(_duration),
+					timed_out(false)
+		{}
+	} timeout_data;
+
+	// The fields are grouped by who touches them, and the groups that
+	// are written by different threads live on separate cache lines.
+	// First come the ones that hardly ever change.
+	std::size_t size;
+
+	// The ring has a power of two slots (at least size of them), so
+	// that an index can be mapped to its slot with a mask. The indices
+	// themselves just keep growing, and count still limits the number
+	// of messages to size.
+	std::size_t mask;
+
+	wait_strategy strategy;
+
+	std::vector<std::unique_ptr<T>> data;
+
+	// The selectors that are currently waiting on this queue.
+	std::vector<detail::select_waiter *> observers;
+
+	// These are only created when they are asked for. The first one
+	// is readable while there are messages to read, and the second
+	// one is readable while there is room to write into.
+	std::unique_ptr<detail::readiness_fd> read_ready;
+	std::unique_ptr<detail::readiness_fd> write_ready;
+
+	// Although I was tempted to use a shared_mutex (rw_lock) for this,
+	// especially for the msg_count function, the answer below convinced
+	// me otherwise:
+	// https://stackoverflow.com/questions/34930855/condition-variable-and-shared-mutex
+	// Quoting from the answer directly:
+	// Class condition_variable provides a condition variable that can only wait
+	// on an object of type unique_lock<mutex>, allowing maximum efficiency on
+	// some platforms.
+	alignas(detail::cache_line_size) std::mutex protector;
+
+	// Producer side
+	alignas(detail::cache_line_size) std::size_t write_index;
+	std::condition_variable write_cond;
+
+	// Consumer side
+	alignas(detail::cache_line_size) std::size_t read_index;
+	std::condition_variable read_cond;
+
+	// These are only modified under the lock, but the spinning waiters
+	// and the try_ operations peek at them without it, so they are kept
+	// away from the lock itself.
+	alignas(detail::cache_line_size) std::atomic<std::size_t> count;
+	std::atomic<bool> closed;
+	std::atomic<int> spin_budget;
+
+	alignas(detail::cache_line_size) detail::queue_metrics metrics;
+
+#if defined(THREAD_COMM_COROUTINES)
+	// The coroutines that are suspended on this queue, oldest first.
+	std::deque<std::shared_ptr<detail::async_waiter<T>>> async_readers;
+	std::deque<std::shared_ptr<detail::async_waiter<T>>> async_writers;
+	// The ones whose operations are done, to be resumed once the lock
+	// is released.
+	std::vector<std::shared_ptr<detail::async_waiter<T>>> async_done;
+#endif
+
+	static std::size_t slot_count(const std::size_t _size) {
+		std::size_t n = 1;
+		while (n < _size) {
+			n <<= 1;
+		}
+		return n;
+	}
+
+#if defined(THREAD_COMM_COROUTINES)
+	// Hands the messages to the suspended readers and the free slots to
+	// the suspended writers, for as long as one of them can go on. The
+	// ones that have timed out in the meantime are skipped. The served
+	// ones are only resumed by _resume_async(), out of the lock.
+	void _serve_async() {
+		bool progress = true;
+
+		while (progress) {
+			progress = false;
+
+			while (count > 0 && !async_readers.empty()) {
+				auto w = std::move(async_readers.front());
+				async_readers.pop_front();
+				if (!w->claim()) {
+					continue;
+				}
+
+				*w->message = std::move(data[read_index++ & mask]);
+				count.store(count.load(std::memory_order_relaxed) - 1,
+						std::memory_order_relaxed);
+				metrics.read(1);
+
+				w->status = async_status::ok;
+				async_done.push_back(std::move(w));
+				write_cond.notify_one();
+				progress = true;
+			}
+
+			while (count < size && !closed && !async_writers.empty()) {
+				auto w = std::move(async_writers.front());
+				async_writers.pop_front();
+				if (!w->claim()) {
+					continue;
+				}
+
+				data[write_index++ & mask] = std::move(*w->message);
+				count.store(count.load(std::memory_order_relaxed) + 1,
+						std::memory_order_relaxed);
+				metrics.wrote(1, count.load(std::memory_order_relaxed));
+
+				w->status = async_status::ok;
+				async_done.push_back(std::move(w));
+				read_cond.notify_one();
+				progress = true;
+			}
+		}
+
+		if (!closed) {
+			return;
+		}
+
+		// Whoever is still waiting is a reader of a drained queue, or
+		// a writer.
+		for (auto waiters : {&async_readers, &async_writers}) {
+			for (auto & w : *waiters) {
+				if (w->claim()) {
+					w->status = async_status::closed;
+					async_done.push_back(std::move(w));
+				}
+			}
+			waiters->clear();
+		}
+	}
+
+	// Resumes the coroutines that _serve_async() has served, with the
+	// lock released, so that the executors can run them right away if
+	// they like. The lock is taken again before returning.
+	void _resume_async(std::unique_lock<std::mutex> & ulock) {
+		if (async_done.empty()) {
+			return;
+		}
+
+		std::vector<std::shared_ptr<detail::async_waiter<T>>> done;
+		done.swap(async_done);
+		ulock.unlock();
+
+		for (auto & w : done) {
+			if (w->timer_id) {
+				detail::timer_service::instance().cancel(w->deadline, w->timer_id);
+			}
+			w->resume();
+		}
+
+		ulock.lock();
+	}
+
+	// Called by the timer of a timed async_ operation.
+	void _expire(const std::shared_ptr<detail::async_waiter<T>> & w,
+			const bool writer) {
+		if (!w->claim()) {
+			return;
+		}
+
+		{
+			std::unique_lock<std::mutex> ulock(protector);
+			auto & waiters = writer ? async_writers : async_readers;
+			auto it = std::find(waiters.begin(), waiters.end(), w);
+			if (it != waiters.end()) {
+				waiters.erase(it);
+			}
+		}
+
+		w->complete(async_status::timed_out);
+	}
+#endif
+
+	// Lets the suspended coroutines, the selectors and the readiness
+	// fds know that the state of the queue has changed. The coroutines
+	// are resumed with the lock released for a moment.
+	void _notify_observers(std::unique_lock<std::mutex> & ulock) {
+#if defined(THREAD_COMM_COROUTINES)
+		_serve_async();
+#endif
+
+		for (auto observer : observers) {
+			observer->signal();
+		}
+
+		if (read_ready) {
+			read_ready->update(count > 0 || closed);
+		}
+
+		if (write_ready) {
+			write_ready->update(count < size || closed);
+		}
+
+#if defined(THREAD_COMM_COROUTINES)
+		_resume_async(ulock);
+#else
+		(void)ulock;
+#endif
+	}
+
+	void add_observer(detail::select_waiter * observer) {
+		std::unique_lock<std::mutex> ulock(protector);
+		observers.push_back(observer);
+	}
+
+	void remove_observer(detail::select_waiter * observer) {
+		std::unique_lock<std::mutex> ulock(protector);
+		observers.erase(std::find(observers.begin(), observers.end(),
+				observer));
+	}
+
+	// Returns false when the queue is closed (or the wait timed out),
+	// in which case the message stays with the caller.
+	bool _write(std::unique_ptr<T> & message,
+			std::unique_lock<std::mutex> & ulock,
+			timeout_data *td = nullptr) {
+		auto writable = [this] { return count < size || closed; };
+
+		if (!writable()) {
+			const auto start = detail::queue_metrics::start_wait();
+			if (!td) {
+				write_cond.wait(ulock, writable);
+			} else if (!write_cond.wait_for(ulock, td->duration, writable)) {
+				metrics.blocked_write(start);
+				metrics.timed_out_write();
+				td->timed_out = true;
+				return false;
+			}
+			metrics.blocked_write(start);
+		}
+
+		if (closed) {
+			return false;
+		}
+
+		data[write_index++ & mask] = std::move(message);
+
+		count.store(count.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+		metrics.wrote(1, count.load(std::memory_order_relaxed));
+
+		read_cond.notify_one();
+		_notify_observers(ulock);
+
+		return true;
+	}
+
+	// Returns false when the queue is closed and drained (or the wait
+	// timed out).
+	bool _read(std::unique_ptr<T> & m,
+			std::unique_lock<std::mutex> & ulock,
+			timeout_data *td = nullptr) {
+		auto readable = [this] { return count > 0 || closed; };
+
+		if (!readable()) {
+			const auto start = detail::queue_metrics::start_wait();
+			if (!td) {
+				read_cond.wait(ulock, readable);
+			} else if (!read_cond.wait_for(ulock, td->duration, readable)) {
+				metrics.blocked_read(start);
+				metrics.timed_out_read();
+				td->timed_out = true;
+				return false;
+			}
+			metrics.blocked_read(start);
+		}
+
+		if (count == 0) {
+			return false;
+		}
+
+		m = std::move(data[read_index++ & mask]);
+
+		count.store(count.load(std::memory_order_relaxed) - 1,
+				std::memory_order_relaxed);
+		metrics.read(1);
+
+		write_cond.notify_one();
+		_notify_observers(ulock);
+
+		return true;
+	}
+
+	// Moves as many messages as fit into the queue, and wakes up
+	// the readers once for the whole batch.
+	template <typename InputIt>
+	std::size_t _write_bulk(InputIt first, InputIt last,
+			std::unique_lock<std::mutex> & ulock) {
+		std::size_t n = 0;
+
+		while (first != last && count < size && !closed) {
+			data[write_index++ & mask] = std::move(*first);
+			++first;
+
+			count.store(count.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+			++n;
+		}
+
+		metrics.wrote(n, count.load(std::memory_order_relaxed));
+
+		if (n == 1) {
+			read_cond.notify_one();
+		} else if (n > 1) {
+			read_cond.notify_all();
+		}
+
+		if (n > 0) {
+			_notify_observers(ulock);
+		}
+
+		return n;
+	}
+
+	template <typename OutputIt>
+	std::size_t _read_bulk(OutputIt out, const std::size_t max,
+			std::unique_lock<std::mutex> & ulock) {
+		std::size_t n = 0;
+
+		while (n < max && count > 0) {
+			*out = std::move(data[read_index++ & mask]);
+			++out;
+
+			count.store(count.load(std::memory_order_relaxed) - 1,
+					std::memory_order_relaxed);
+			++n;
+		}
+
+		metrics.read(n);
+
+		if (n == 1) {
+			write_cond.notify_one();
+		} else if (n > 1) {
+			write_cond.notify_all();
+		}
+
+		if (n > 0) {
+			_notify_observers(ulock);
+		}
+
+		return n;
+	}
+
+	bool _writable() {
+		return count.load(std::memory_order_relaxed) < size ||
+				closed.load(std::memory_order_relaxed);
+	}
+
+	bool _readable() {
+		return count.load(std::memory_order_relaxed) > 0 ||
+				closed.load(std::memory_order_relaxed);
+	}
+
+	// Waits for ready() without taking the lock, the way the wait
+	// strategy asks for. It returns once ready() holds, once it's time
+	// to block on the condition variables instead, or at the deadline.
+	// The caller then takes the lock and checks the state again, as
+	// another thread may have beaten it to the message (or the slot).
+	template <typename Predicate>
+	void _spin(Predicate ready,
+			const std::chrono::steady_clock::time_point * deadline = nullptr) {
+		// Reading the clock on every iteration would slow the spinning
+		// down, so it's only done once every deadline_check iterations.
+		constexpr int deadline_check = 64;
+		constexpr int spin_limit = 128;
+		constexpr int yield_limit = 64;
+		constexpr int min_budget = 16;
+		constexpr int max_budget = 16384;
+
+		auto expired = [deadline] () {
+			return deadline && std::chrono::steady_clock::now() >= *deadline;
+		};
+
+		switch (strategy) {
+		case wait_strategy::block:
+			return;
+		case wait_strategy::spin:
+			for (int i = 1 ; !ready() ; ++i) {
+				detail::cpu_relax();
+				if (i % deadline_check == 0 && expired()) {
+					return;
+				}
+			}
+			return;
+		case wait_strategy::spin_then_yield:
+			for (int i = 0 ; i < spin_limit ; ++i) {
+				if (ready()) {
+					return;
+				}
+				detail::cpu_relax();
+			}
+			for (int i = 0 ; i < yield_limit ; ++i) {
+				if (ready() || expired()) {
+					return;
+				}
+				std::this_thread::yield();
+			}
+			return;
+		case wait_strategy::adaptive: {
+			// The budget follows twice the number of iterations the
+			// recent successful spins took. When spinning doesn't pay
+			// off, the budget is halved.
+			const int budget = spin_budget.load(std::memory_order_relaxed);
+			for (int i = 1 ; i <= budget ; ++i) {
+				if (ready()) {
+					spin_budget.store(std::min(max_budget,
+							std::max(min_budget, (7*budget + 2*i) / 8 + 1)),
+							std::memory_order_relaxed);
+					return;
+				}
+				detail::cpu_relax();
+				if (i % deadline_check == 0 && expired()) {
+					return;
+				}
+			}
+			spin_budget.store(std::max(min_budget, budget / 2),
+					std::memory_order_relaxed);
+			return;
+		}
+		}
+	}
+
+	static std::chrono::system_clock::duration remaining(
+			const std::chrono::steady_clock::time_point deadline) {
+		return std::chrono::duration_cast<std::chrono::system_clock::duration>(
+				deadline - std::chrono::steady_clock::now());
+	}
+
+	// The selector cases use these two. A closed queue makes its cases
+	// fire, so that a selector doesn't wait on it forever.
+	bool _select_read(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count > 0) {
+			return _read(message, ulock);
+		}
+
+		message = nullptr;
+		return closed;
+	}
+
+	bool _select_write(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count < size || closed) {
+			_write(message, ulock);
+			return true;
+		}
+
+		return false;
+	}
+
+public:
+	circular_queue(int _size = 1,
+			wait_strategy _strategy = wait_strategy::block) :
+		size(_size),
+		mask(0),
+		strategy(_strategy),
+		write_index(0),
+		read_index(0),
+		count(0),
+		closed(false),
+		spin_budget(1024) {
+		if (size == 0) {
+			std::cerr << "thread_comm::circular_queue - size can not be zero"
+					<< std::endl;
+			std::abort();
+		}
+
+		data = std::vector<std::unique_ptr<T>>(slot_count(size));
+		mask = data.size() - 1;
+	}
+
+	// The mutex and the condition variables can't be moved, so this
+	// queue keeps using its own ones. Neither of the queues should be
+	// in use while one is being moved into the other.
+	circular_queue<T>& operator=(circular_queue<T> && cq) {
+		size = cq.size;
+		mask = cq.mask;
+		read_index = cq.read_index;
+		write_index = cq.write_index;
+		count = cq.count.load();
+		closed = cq.closed.load();
+		strategy = cq.strategy;
+		spin_budget = cq.spin_budget.load();
+
+		data = std::move(cq.data);
+		observers = std::move(cq.observers);
+		read_ready = std::move(cq.read_ready);
+		write_ready = std::move(cq.write_ready);
+
+		return *this;
+	}
+
+	// Closing a queue wakes up all of the blocked readers and writers.
+	// Writes fail (and keep their messages) once a queue is closed,
+	// whereas reads keep returning the messages that are still in the
+	// queue. After the queue is drained, reads report that the queue
+	// is closed instead of blocking.
+	void close() {
+		std::unique_lock<std::mutex> ulock(protector);
+		closed = true;
+
+		read_cond.notify_all();
+		write_cond.notify_all();
+		_notify_observers(ulock);
+	}
+
+	bool is_closed() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return closed;
+	}
+
+	// Returns false if the queue is closed.
+	bool write(std::unique_ptr<T> & message) {
+		_spin([this] { return _writable(); });
+
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, ulock);
+	}
+
+	// Returns nullptr if the queue is closed and drained.
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Returns false if the queue is closed and drained, which makes it
+	// possible to tell that from a null message.
+	bool read(std::unique_ptr<T> & message) {
+		_spin([this] { return _readable(); });
+
+		std::unique_lock<std::mutex> ulock(protector);
+		return _read(message, ulock);
+	}
+
+	// Returns false if the write timed out or the queue is closed.
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		const auto deadline = std::chrono::steady_clock::now() + duration;
+		_spin([this] { return _writable(); }, &deadline);
+
+		timeout_data td(remaining(deadline));
+
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, ulock, &td);
+	}
+
+	// Returns nullptr (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		const auto deadline = std::chrono::steady_clock::now() + duration;
+		_spin([this] { return _readable(); }, &deadline);
+
+		timeout_data td(remaining(deadline));
+		std::unique_ptr<T> m;
+
+		std::unique_lock<std::mutex> ulock(protector);
+		_read(m, ulock, &td);
+		timed_out = td.timed_out;
+
+		return m;
+	}
+
+	// The try_ operations peek at the state first, and don't touch
+	// the lock when they can tell that they would fail.
+	bool try_writing(std::unique_ptr<T> & message) {
+		if (count.load(std::memory_order_relaxed) >= size ||
+				closed.load(std::memory_order_relaxed)) {
+			metrics.failed_try_write();
+			return false;
+		}
+
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count < size && !closed) {
+			return _write(message, ulock);
+		}
+
+		ulock.unlock();
+		metrics.failed_try_write();
+		return false;
+	}
+
+	std::unique_ptr<T> try_reading() {
+		std::unique_ptr<T> m;
+		try_reading(m);
+		return m;
+	}
+
+	// Unlike the one above, this overload can tell an empty queue
+	// from a null message that has been sent on purpose.
+	bool try_reading(std::unique_ptr<T> & message) {
+		if (count.load(std::memory_order_relaxed) == 0) {
+			metrics.failed_try_read();
+			return false;
+		}
+
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count > 0) {
+			return _read(message, ulock);
+		}
+
+		ulock.unlock();
+		metrics.failed_try_read();
+		return false;
+	}
+
+	// The bulk operations transfer a batch of messages under a single
+	// lock acquisition and a single wake up, and return the number of
+	// messages transferred. write_bulk blocks until there is room for
+	// at least one message and then moves as many as fit, starting
+	// from first. read_bulk blocks until there is at least one message
+	// and then reads up to max messages into out. The try_ variants
+	// don't block, so they may return zero. On a closed queue,
+	// write_bulk returns zero, and so does read_bulk once the queue
+	// is drained.
+	template <typename InputIt>
+	std::size_t write_bulk(InputIt first, InputIt last) {
+		if (first == last) {
+			return 0;
+		}
+
+		_spin([this] { return _writable(); });
+
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!(count < size || closed)) {
+			const auto start = detail::queue_metrics::start_wait();
+			write_cond.wait(ulock, [this] { return count < size || closed; });
+			metrics.blocked_write(start);
+		}
+		return _write_bulk(first, last, ulock);
+	}
+
+	template <typename InputIt>
+	std::size_t try_write_bulk(InputIt first, InputIt last) {
+		std::unique_lock<std::mutex> ulock(protector);
+		const std::size_t n = _write_bulk(first, last, ulock);
+		if (n == 0 && first != last) {
+			metrics.failed_try_write();
+		}
+		return n;
+	}
+
+	template <typename OutputIt>
+	std::size_t read_bulk(OutputIt out, const std::size_t max) {
+		if (max == 0) {
+			return 0;
+		}
+
+		_spin([this] { return _readable(); });
+
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!(count > 0 || closed)) {
+			const auto start = detail::queue_metrics::start_wait();
+			read_cond.wait(ulock, [this] { return count > 0 || closed; });
+			metrics.blocked_read(start);
+		}
+		return _read_bulk(out, max, ulock);
+	}
+
+	template <typename OutputIt>
+	std::size_t try_read_bulk(OutputIt out, const std::size_t max) {
+		std::unique_lock<std::mutex> ulock(protector);
+		const std::size_t n = _read_bulk(out, max, ulock);
+		if (n == 0 && max > 0) {
+			metrics.failed_try_read();
+		}
+		return n;
+	}
+
+	// Native handles for event loops: read_ready_fd() returns a file
+	// descriptor that is readable while the queue has messages to read,
+	// and write_ready_fd() returns one that is readable while the queue
+	// has room to write into. Both of them also become readable once
+	// the queue is closed. They are created on the first call, owned by
+	// the queue and they should only be polled, not read or written.
+	// -1 is returned if the descriptor can't be created.
+	int read_ready_fd() {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!read_ready) {
+			read_ready = std::make_unique<detail::readiness_fd>();
+			read_ready->update(count > 0 || closed);
+		}
+		return read_ready->fd();
+	}
+
+	int write_ready_fd() {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!write_ready) {
+			write_ready = std::make_unique<detail::readiness_fd>();
+			write_ready->update(count < size || closed);
+		}
+		return write_ready->fd();
+	}
+
+#if defined(THREAD_COMM_COROUTINES)
+	// The awaitable of the async_ operations. See async_read().
+	template <typename Executor>
+	class async_operation {
+	private:
+		circular_queue<T> & q;
+		std::unique_ptr<T> & message;
+		Executor & executor;
+		const bool writer;
+		const bool timed;
+		const std::chrono::steady_clock::time_point deadline;
+		std::shared_ptr<detail::async_waiter<T>> waiter;
+		async_status status;
+
+	public:
+		async_operation(circular_queue<T> & _q, std::unique_ptr<T> & _message,
+				Executor & _executor, const bool _writer, const bool _timed,
+				const std::chrono::steady_clock::time_point _deadline) :
+			q(_q),
+			message(_message),
+			executor(_executor),
+			writer(_writer),
+			timed(_timed),
+			deadline(_deadline),
+			status(async_status::ok)
+		{}
+
+		bool await_ready() {
+			return false;
+		}
+
+		// Doesn't suspend when the operation can be done right away.
+		bool await_suspend(std::coroutine_handle<> h) {
+			std::unique_lock<std::mutex> ulock(q.protector);
+
+			if (writer && q.closed) {
+				status = async_status::closed;
+				return false;
+			} else if (writer && q.count < q.size) {
+				q._write(message, ulock);
+				return false;
+			} else if (!writer && q.count > 0) {
+				q._read(message, ulock);
+				return false;
+			} else if (!writer && q.closed) {
+				message = nullptr;
+				status = async_status::closed;
+				return false;
+			} else if (timed && std::chrono::steady_clock::now() >= deadline) {
+				status = async_status::timed_out;
+				return false;
+			}
+
+			waiter = std::make_shared<detail::async_waiter<T>>();
+			waiter->message = &message;
+
+			Executor * ex = &executor;
+			waiter->resume = [ex, h] { ex->post([h] { h.resume(); }); };
+
+			(writer ? q.async_writers : q.async_readers).push_back(waiter);
+
+			if (timed) {
+				circular_queue<T> * queue = &q;
+				auto w = waiter;
+				const bool is_writer = writer;
+				waiter->deadline = deadline;
+				waiter->timer_id = detail::timer_service::instance().schedule(
+						deadline, [queue, w, is_writer] {
+							queue->_expire(w, is_writer);
+						});
+			}
+
+			return true;
+		}
+
+		async_status await_resume() {
+			return waiter ? waiter->status : status;
+		}
+	}; // async_operation
+
+	// The coroutine counterparts of read(message) and write(message):
+	//     auto status = co_await q.async_read(message, executor);
+	// The coroutine is suspended while the queue is empty (or full), and
+	// once a message (or a slot) is available, it is handed over to the
+	// coroutine, which is resumed with executor.post(f). post() is
+	// called without the lock of the queue, so it may queue f (as a
+	// work_stealing_pool does) or run it right away. The message and
+	// the queue must outlive the suspended coroutine.
+	// The results are async_status::ok, or async_status::closed with the
+	// same meaning as a false from read() and write(). A failed write
+	// leaves the message with the caller.
+	template <typename Executor>
+	async_operation<Executor> async_read(std::unique_ptr<T> & message,
+			Executor & executor) {
+		return async_operation<Executor>(*this, message, executor, false,
+				false, std::chrono::steady_clock::time_point());
+	}
+
+	template <typename Executor>
+	async_operation<Executor> async_write(std::unique_ptr<T> & message,
+			Executor & executor) {
+		return async_operation<Executor>(*this, message, executor, true,
+				false, std::chrono::steady_clock::time_point());
+	}
+
+	// These can also result in async_status::timed_out. The deadlines
+	// are kept by a background thread that is started on first use.
+	template <typename Executor>
+	async_operation<Executor> async_timed_read(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration,
+			Executor & executor) {
+		return async_operation<Executor>(*this, message, executor, false,
+				true, std::chrono::steady_clock::now() + duration);
+	}
+
+	template <typename Executor>
+	async_operation<Executor> async_timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration,
+			Executor & executor) {
+		return async_operation<Executor>(*this, message, executor, true,
+				true, std::chrono::steady_clock::now() + duration);
+	}
+#endif
+
+	std::size_t msg_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return count;
+	}
+
+	// Doesn't take the lock, so the counters may lag a little behind
+	// the operations that are in progress. All zeros unless
+	// THREAD_COMM_METRICS is defined.
+	queue_stats statistics() const {
+		return metrics.snapshot();
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+}; // circular_queue
+
+// global overloads for circular_queue - start
+template <typename T>
+void operator>>(std::unique_ptr<T> & message, circular_queue<T> & cq) {
+	cq.write(message);
+}
+
+template <typename T>
+void operator<<(std::unique_ptr<T> & message, circular_queue<T> & cq) {
+	message = cq.read();
+}
+// global overloads for circular_queue - end
+
+// spsc_queue is a bounded, lock-free circular queue for exactly one
+// producer thread and exactly one consumer thread. It provides the
+// same interface as circular_queue, but the indices are atomics that
+// are published with release/acquire ordering, so a message costs no
+// mutex handoff. Each side keeps a cached copy of the other side's
+// index and only reloads it when the ring looks full (or empty),
+// which keeps the shared cache lines from bouncing on every message.
+// Blocking operations spin for a short while and then park the
+// thread, so an idle queue doesn't burn a core.
+// Using an spsc_queue from more than one producer or more than one
+// consumer at a time is undefined behaviour.
+template <typename T>
+class spsc_queue {
+private:
+	static constexpr int spin_limit = 128;
+
+	// One slot is kept empty to tell a full ring from an empty one.
+	const std::size_t capacity;
+	std::vector<std::unique_ptr<T>> data;
+
+	detail::parking_lot read_lot;
+	detail::parking_lot write_lot;
+
+	std::atomic<bool> closed;
+
+	// Producer side
+	alignas(detail::cache_line_size) std::atomic<std::size_t> write_index;
+	std::size_t cached_read_index;
+
+	// Consumer side
+	alignas(detail::cache_line_size) std::atomic<std::size_t> read_index;
+	std::size_t cached_write_index;
+
+	std::size_t next(const std::size_t index) const {
+		return index + 1 == capacity ? 0 : index + 1;
+	}
+
+	bool full() {
+		return next(write_index.load(std::memory_order_relaxed)) ==
+				read_index.load(std::memory_order_acquire);
+	}
+
+	bool empty() {
+		return read_index.load(std::memory_order_relaxed) ==
+				write_index.load(std::memory_order_acquire);
+	}
+
+	bool _try_write(std::unique_ptr<T> & message) {
+		const std::size_t w = write_index.load(std::memory_order_relaxed);
+		const std::size_t n = next(w);
+
+		if (n == cached_read_index) {
+			cached_read_index = read_index.load(std::memory_order_acquire);
+			if (n == cached_read_index) {
+				return false;
+			}
+		}
+
+		data[w] = std::move(message);
+		write_index.store(n, std::memory_order_release);
+
+		read_lot.unpark_one();
+
+		return true;
+	}
+
+	bool _try_read(std::unique_ptr<T> & message) {
+		const std::size_t r = read_index.load(std::memory_order_relaxed);
+
+		if (r == cached_write_index) {
+			cached_write_index = write_index.load(std::memory_order_acquire);
+			if (r == cached_write_index) {
+				return false;
+			}
+		}
+
+		message = std::move(data[r]);
+		read_index.store(next(r), std::memory_order_release);
+
+		write_lot.unpark_one();
+
+		return true;
+	}
+
+	bool _spin_write(std::unique_ptr<T> & message) {
+		for (int i = 0 ; i < spin_limit ; ++i) {
+			if (_try_write(message)) {
+				return true;
+			}
+			detail::cpu_relax();
+		}
+		return false;
+	}
+
+	bool _spin_read(std::unique_ptr<T> & message) {
+		for (int i = 0 ; i < spin_limit ; ++i) {
+			if (_try_read(message)) {
+				return true;
+			}
+			detail::cpu_relax();
+		}
+		return false;
+	}
+
+public:
+	spsc_queue(int _size = 1) :
+		capacity(static_cast<std::size_t>(_size) + 1),
+		closed(false),
+		write_index(0),
+		cached_read_index(0),
+		read_index(0),
+		cached_write_index(0) {
+		if (_size <= 0) {
+			std::cerr << "thread_comm::spsc_queue - size must be positive"
+					<< std::endl;
+			std::abort();
+		}
+
+		data = std::vector<std::unique_ptr<T>>(capacity);
+	}
+
+	spsc_queue(const spsc_queue<T> &) = delete;
+	spsc_queue<T>& operator=(const spsc_queue<T> &) = delete;
+
+	// See circular_queue::close(). As the writers don't take a lock,
+	// a write that races with close() may still land in the queue,
+	// so a queue should be closed after its writers are done with it.
+	void close() {
+		closed.store(true, std::memory_order_seq_cst);
+
+		read_lot.unpark_all();
+		write_lot.unpark_all();
+	}
+
+	bool is_closed() {
+		return closed.load(std::memory_order_acquire);
+	}
+
+	// Returns false if the queue is closed.
+	bool write(std::unique_ptr<T> & message) {
+		if (is_closed()) {
+			return false;
+		}
+
+		if (_spin_write(message)) {
+			return true;
+		}
+
+		while (!_try_write(message)) {
+			write_lot.park([this] { return !full() || is_closed(); });
+			if (is_closed()) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Returns false if the queue is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		if (_spin_read(message)) {
+			return true;
+		}
+
+		while (!_try_read(message)) {
+			if (is_closed()) {
+				// A last look for the messages that were written
+				// right before the queue was closed.
+				return _try_read(message);
+			}
+			read_lot.park([this] { return !empty() || is_closed(); });
+		}
+
+		return true;
+	}
+
+	// Returns nullptr if the queue is closed and drained.
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Returns false if the write timed out or the queue is closed.
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		const auto deadline = std::chrono::steady_clock::now() + duration;
+
+		if (is_closed()) {
+			return false;
+		}
+
+		if (_spin_write(message)) {
+			return true;
+		}
+
+		while (!_try_write(message)) {
+			if (!write_lot.park_until(deadline,
+					[this] { return !full() || is_closed(); }) ||
+					is_closed()) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Returns nullptr (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		const auto deadline = std::chrono::steady_clock::now() + duration;
+		std::unique_ptr<T> m;
+
+		timed_out = false;
+
+		if (_spin_read(m)) {
+			return m;
+		}
+
+		while (!_try_read(m)) {
+			if (is_closed()) {
+				_try_read(m);
+				return m;
+			}
+
+			if (!read_lot.park_until(deadline,
+					[this] { return !empty() || is_closed(); })) {
+				timed_out = true;
+				return nullptr;
+			}
+		}
+
+		return m;
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		if (is_closed()) {
+			return false;
+		}
+
+		return _try_write(message);
+	}
+
+	std::unique_ptr<T> try_reading() {
+		std::unique_ptr<T> m;
+		_try_read(m);
+		return m;
+	}
+
+	// Unlike the one above, this overload can tell an empty queue
+	// from a null message that has been sent on purpose.
+	bool try_reading(std::unique_ptr<T> & message) {
+		return _try_read(message);
+	}
+
+	std::size_t msg_count() {
+		const std::size_t w = write_index.load(std::memory_order_acquire);
+		const std::size_t r = read_index.load(std::memory_order_acquire);
+		return w >= r ? w - r : w + capacity - r;
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+}; // spsc_queue
+
+// global overloads for spsc_queue - start
+template <typename T>
+void operator>>(std::unique_ptr<T> & message, spsc_queue<T> & q) {
+	q.write(message);
+}
+
+template <typename T>
+void operator<<(std::unique_ptr<T> & message, spsc_queue<T> & q) {
+	message = q.read();
+}
+// global overloads for spsc_queue - end
+
+// mpmc_queue is a bounded, lock-free circular queue for any number
+// of producers and consumers. Every slot carries a turn number that
+// tells whose turn it is to use it: an even turn lets the producer
+// that claimed the matching write position fill it, and an odd turn
+// lets the consumer that claimed the matching read position empty
+// it. Producers and consumers only contend on their own position
+// counter, which lets throughput keep up as threads are added.
+// As with spsc_queue, blocking operations spin for a short while
+// and then park the thread.
+// The number of slots is rounded up to a power of two, so that a
+// position maps to its slot and turn with a mask and a shift, and
+// that is also the capacity of the queue.
+// It provides the same interface as circular_queue, so it can also
+// be plugged into a channel, e.g. channel<T, mpmc_queue>.
+template <typename T>
+class mpmc_queue {
+private:
+	static constexpr int spin_limit = 128;
+
+	typedef struct slot_s {
+		std::atomic<std::size_t> turn;
+		std::unique_ptr<T> message;
+
+		slot_s() : turn(0) {}
+	} slot;
+
+	std::size_t size;
+	std::size_t mask;
+	int shift;
+	std::unique_ptr<slot[]> slots;
+
+	detail::parking_lot read_lot;
+	detail::parking_lot write_lot;
+
+	std::atomic<bool> closed;
+
+	alignas(detail::cache_line_size) std::atomic<std::size_t> write_pos;
+	alignas(detail::cache_line_size) std::atomic<std::size_t> read_pos;
+
+	std::size_t turn(const std::size_t pos) const {
+		return pos >> shift;
+	}
+
+	std::size_t index(const std::size_t pos) const {
+		return pos & mask;
+	}
+
+	// read_pos has to be loaded first: a reader can't get past the
+	// write position, but it can get past an older snapshot of it, and
+	// the difference would wrap around and make a queue with free slots
+	// look full to a writer that is about to park.
+	bool full() {
+		const std::size_t r = read_pos.load(std::memory_order_acquire);
+		return write_pos.load(std::memory_order_acquire) - r >= size;
+	}
+
+	bool empty() {
+		return write_pos.load(std::memory_order_acquire) ==
+				read_pos.load(std::memory_order_acquire);
+	}
+
+	bool _try_write(std::unique_ptr<T> & message) {
+		std::size_t pos = write_pos.load(std::memory_order_acquire);
+
+		while (true) {
+			slot & s = slots[index(pos)];
+
+			if (s.turn.load(std::memory_order_acquire) == 2*turn(pos)) {
+				if (write_pos.compare_exchange_strong(pos, pos + 1)) {
+					s.message = std::move(message);
+					s.turn.store(2*turn(pos) + 1, std::memory_order_release);
+
+					read_lot.unpark_one();
+
+					return true;
+				}
+			} else {
+				const std::size_t prev_pos = pos;
+				pos = write_pos.load(std::memory_order_acquire);
+				if (pos == prev_pos) {
+					return false;
+				}
+			}
+		}
+	}
+
+	bool _try_read(std::unique_ptr<T> & message) {
+		std::size_t pos = read_pos.load(std::memory_order_acquire);
+
+		while (true) {
+			slot & s = slots[index(pos)];
+
+			if (s.turn.load(std::memory_order_acquire) == 2*turn(pos) + 1) {
+				if (read_pos.compare_exchange_strong(pos, pos + 1)) {
+					message = std::move(s.message);
+					s.turn.store(2*turn(pos) + 2, std::memory_order_release);
+
+					write_lot.unpark_one();
+
+					return true;
+				}
+			} else {
+				const std::size_t prev_pos = pos;
+				pos = read_pos.load(std::memory_order_acquire);
+				if (pos == prev_pos) {
+					return false;
+				}
+			}
+		}
+	}
+
+	bool _spin_write(std::unique_ptr<T> & message) {
+		for (int i = 0 ; i < spin_limit ; ++i) {
+			if (_try_write(message)) {
+				return true;
+			}
+			detail::cpu_relax();
+		}
+		return false;
+	}
+
+	bool _spin_read(std::unique_ptr<T> & message) {
+		for (int i = 0 ; i < spin_limit ; ++i) {
+			if (_try_read(message)) {
+				return true;
+			}
+			detail::cpu_relax();
+		}
+		return false;
+	}
+
+public:
+	mpmc_queue(int _size = 1) :
+		size(1),
+		mask(0),
+		shift(0),
+		closed(false),
+		write_pos(0),
+		read_pos(0) {
+		if (_size <= 0) {
+			std::cerr << "thread_comm::mpmc_queue - size must be positive"
+					<< std::endl;
+			std::abort();
+		}
+
+		while (size < static_cast<std::size_t>(_size)) {
+			size <<= 1;
+			++shift;
+		}
+		mask = size - 1;
+		slots = std::make_unique<slot[]>(size);
+	}
+
+	mpmc_queue(const mpmc_queue<T> &) = delete;
+	mpmc_queue<T>& operator=(const mpmc_queue<T> &) = delete;
+
+	// See circular_queue::close(). As the writers don't take a lock,
+	// a write that races with close() may still land in the queue,
+	// so a queue should be closed after its writers are done with it.
+	void close() {
+		closed.store(true, std::memory_order_seq_cst);
+
+		read_lot.unpark_all();
+		write_lot.unpark_all();
+	}
+
+	bool is_closed() {
+		return closed.load(std::memory_order_acquire);
+	}
+
+	// Returns false if the queue is closed.
+	bool write(std::unique_ptr<T> & message) {
+		if (is_closed()) {
+			return false;
+		}
+
+		if (_spin_write(message)) {
+			return true;
+		}
+
+		while (!_try_write(message)) {
+			write_lot.park([this] { return !full() || is_closed(); });
+			if (is_closed()) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Returns false if the queue is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		if (_spin_read(message)) {
+			return true;
+		}
+
+		while (!_try_read(message)) {
+			if (is_closed()) {
+				// A last look for the messages that were written
+				// right before the queue was closed.
+				return _try_read(message);
+			}
+			read_lot.park([this] { return !empty() || is_closed(); });
+		}
+
+		return true;
+	}
+
+	// Returns nullptr if the queue is closed and drained.
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Returns false if the write timed out or the queue is closed.
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		const auto deadline = std::chrono::steady_clock::now() + duration;
+
+		if (is_closed()) {
+			return false;
+		}
+
+		if (_spin_write(message)) {
+			return true;
+		}
+
+		while (!_try_write(message)) {
+			if (!write_lot.park_until(deadline,
+					[this] { return !full() || is_closed(); }) ||
+					is_closed()) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Returns nullptr (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		const auto deadline = std::chrono::steady_clock::now() + duration;
+		std::unique_ptr<T> m;
+
+		timed_out = false;
+
+		if (_spin_read(m)) {
+			return m;
+		}
+
+		while (!_try_read(m)) {
+			if (is_closed()) {
+				_try_read(m);
+				return m;
+			}
+
+			if (!read_lot.park_until(deadline,
+					[this] { return !empty() || is_closed(); })) {
+				timed_out = true;
+				return nullptr;
+			}
+		}
+
+		return m;
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		if (is_closed()) {
+			return false;
+		}
+
+		return _try_write(message);
+	}
+
+	std::unique_ptr<T> try_reading() {
+		std::unique_ptr<T> m;
+		_try_read(m);
+		return m;
+	}
+
+	// Unlike the one above, this overload can tell an empty queue
+	// from a null message that has been sent on purpose.
+	bool try_reading(std::unique_ptr<T> & message) {
+		return _try_read(message);
+	}
+
+	std::size_t msg_count() {
+		const std::size_t r = read_pos.load(std::memory_order_acquire);
+		const std::size_t w = write_pos.load(std::memory_order_acquire);
+		// The positions are read one after the other, so a reader
+		// may have moved past the write position we just observed.
+		return w > r ? w - r : 0;
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+}; // mpmc_queue
+
+// global overloads for mpmc_queue - start
+template <typename T>
+void operator>>(std::unique_ptr<T> & message, mpmc_queue<T> & q) {
+	q.write(message);
+}
+
+template <typename T>
+void operator<<(std::unique_ptr<T> & message, mpmc_queue<T> & q) {
+	message = q.read();
+}
+// global overloads for mpmc_queue - end
+
+// value_queue is the by-value counterpart of circular_queue. Its
+// slots hold the messages themselves, so sending a message doesn't
+// need a heap allocation on the producer side and a delete on the
+// consumer side. This pays off for small messages, where the
+// allocator round trip would cost more than the queue operation.
+// Messages are moved (or copied, for trivially copyable types) in
+// and out of the slots, and the read operations return an
+// std::optional<T> which is empty when there was nothing to read, or
+// when the queue is closed and drained.
+template <typename T>
+class value_queue {
+private:
+	static_assert(std::is_move_constructible<T>::value,
+			"thread_comm::value_queue - T must be move constructible");
+
+	typedef struct alignas(T) storage_s {
+		unsigned char bytes[sizeof(T)];
+	} storage;
+
+	const std::size_t size;
+
+	std::size_t read_index;
+	std::size_t write_index;
+	std::size_t count;
+	bool closed;
+
+	std::mutex protector;
+	std::condition_variable read_cond;
+	std::condition_variable write_cond;
+
+	// Only the slots in [read_index, read_index + count) hold
+	// constructed objects.
+	std::unique_ptr<storage[]> data;
+
+	T * slot(const std::size_t index) {
+		return std::launder(reinterpret_cast<T *>(data[index].bytes));
+	}
+
+	// Returns false if the wait timed out or the queue is closed.
+	bool _wait_for_space(std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr) {
+		auto ready = [this] { return count < size || closed; };
+
+		if (!duration) {
+			write_cond.wait(ulock, ready);
+		} else if (!write_cond.wait_for(ulock, *duration, ready)) {
+			return false;
+		}
+
+		return !closed;
+	}
+
+	// Returns false if the wait timed out. A closed and drained queue
+	// doesn't make its readers wait, but leaves them without a message.
+	bool _wait_for_message(std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr) {
+		auto ready = [this] { return count > 0 || closed; };
+
+		if (!duration) {
+			read_cond.wait(ulock, ready);
+			return true;
+		}
+
+		return read_cond.wait_for(ulock, *duration, ready);
+	}
+
+	template <typename... Args>
+	void _emplace(Args &&... args) {
+		new (data[write_index].bytes) T(std::forward<Args>(args)...);
+
+		if (++write_index == size) {
+			write_index = 0;
+		}
+
+		++count;
+
+		read_cond.notify_one();
+	}
+
+	T _take() {
+		T * p = slot(read_index);
+		T m(std::move(*p));
+		p->~T();
+
+		if (++read_index == size) {
+			read_index = 0;
+		}
+
+		--count;
+
+		write_cond.notify_one();
+
+		return m;
+	}
+
+public:
+	value_queue(int _size = 1) :
+		size(static_cast<std::size_t>(_size)),
+		read_index(0),
+		write_index(0),
+		count(0),
+		closed(false) {
+		if (_size <= 0) {
+			std::cerr << "thread_comm::value_queue - size must be positive"
+					<< std::endl;
+			std::abort();
+		}
+
+		data = std::make_unique<storage[]>(size);
+	}
+
+	~value_queue() {
+		while (count > 0) {
+			slot(read_index)->~T();
+			if (++read_index == size) {
+				read_index = 0;
+			}
+			--count;
+		}
+	}
+
+	value_queue(const value_queue<T> &) = delete;
+	value_queue<T>& operator=(const value_queue<T> &) = delete;
+
+	// See circular_queue::close().
+	void close() {
+		std::unique_lock<std::mutex> ulock(protector);
+		closed = true;
+
+		read_cond.notify_all();
+		write_cond.notify_all();
+	}
+
+	bool is_closed() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return closed;
+	}
+
+	// Returns false if the queue is closed.
+	template <typename... Args>
+	bool emplace_write(Args &&... args) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!_wait_for_space(ulock)) {
+			return false;
+		}
+
+		_emplace(std::forward<Args>(args)...);
+		return true;
+	}
+
+	bool write(T && message) {
+		return emplace_write(std::move(message));
+	}
+
+	bool write(const T & message) {
+		return emplace_write(message);
+	}
+
+	// Returns std::nullopt if the queue is closed and drained.
+	std::optional<T> read() {
+		std::unique_lock<std::mutex> ulock(protector);
+		_wait_for_message(ulock);
+		if (count == 0) {
+			return std::nullopt;
+		}
+
+		return _take();
+	}
+
+	// The message is only moved from when the write succeeds. Returns
+	// false if the write timed out or the queue is closed.
+	bool timed_write(T && message,
+			const std::chrono::system_clock::duration duration) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!_wait_for_space(ulock, &duration)) {
+			return false;
+		}
+
+		_emplace(std::move(message));
+		return true;
+	}
+
+	bool timed_write(const T & message,
+			const std::chrono::system_clock::duration duration) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (!_wait_for_space(ulock, &duration)) {
+			return false;
+		}
+
+		_emplace(message);
+		return true;
+	}
+
+	// Returns std::nullopt (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::optional<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		std::unique_lock<std::mutex> ulock(protector);
+		timed_out = !_wait_for_message(ulock, &duration);
+		if (timed_out || count == 0) {
+			return std::nullopt;
+		}
+
+		return _take();
+	}
+
+	// The message is only moved from when the write succeeds.
+	bool try_writing(T && message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count < size && !closed) {
+			_emplace(std::move(message));
+			return true;
+		}
+		return false;
+	}
+
+	bool try_writing(const T & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count < size && !closed) {
+			_emplace(message);
+			return true;
+		}
+		return false;
+	}
+
+	std::optional<T> try_reading() {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count > 0) {
+			return _take();
+		}
+
+		return std::nullopt;
+	}
+
+	std::size_t msg_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return count;
+	}
+}; // value_queue
+
+// segmented_queue is a queue without a fixed capacity. It's built from
+// a linked list of fixed-size segments: writers append new segments as
+// the queue grows, and the segments that readers have emptied are kept
+// on a free list to be reused. So a queue that is usually shallow but
+// sometimes very deep doesn't have to keep a huge ring allocated all
+// the time. The free list is trimmed back to what the recent peak
+// occupancy needs every trim_interval segment turnovers, down to a
+// single spare segment as soon as the queue is less than a quarter
+// full, and shrink_to_fit() releases all of the spare segments at
+// once.
+// A limit can be given to make the queue softly bounded: writers then
+// block (or fail, for the try_ and timed_ operations) while the queue
+// holds limit messages. A limit of zero means no limit, in which case
+// writes never block.
+// It provides the circular_queue interface (apart from the bulk
+// operations, the selectors and the readiness fds), so it can back a
+// channel as well, e.g. channel<T, segmented_queue>.
+template <typename T>
+class segmented_queue {
+private:
+	static constexpr std::size_t trim_interval = 16;
+
+	typedef struct segment_s {
+		std::unique_ptr<std::unique_ptr<T>[]> slots;
+		std::unique_ptr<segment_s> next;
+
+		segment_s(const std::size_t size) :
+			slots(std::make_unique<std::unique_ptr<T>[]>(size))
+		{}
+	} segment;
+
+	const std::size_t limit;
+	const std::size_t segment_size;
+
+	std::mutex protector;
+	std::condition_variable read_cond;
+	std::condition_variable write_cond;
+
+	// Readers take from the head segment, writers append to the tail
+	// segment. The head owns the rest of the list.
+	std::unique_ptr<segment> head;
+	segment * tail;
+	std::size_t read_index;
+	std::size_t write_index;
+	// The number of segments in the list.
+	std::size_t linked;
+
+	std::size_t count;
+	bool closed;
+
+	std::vector<std::unique_ptr<segment>> spares;
+	std::size_t peak;
+	std::size_t turnovers;
+
+	bool _has_room() {
+		return limit == 0 || count < limit;
+	}
+
+	std::unique_ptr<segment> _new_segment() {
+		if (spares.empty()) {
+			return std::make_unique<segment>(segment_size);
+		}
+
+		auto s = std::move(spares.back());
+		spares.pop_back();
+		return s;
+	}
+
+	void _retire_head() {
+		auto old = std::move(head);
+		head = std::move(old->next);
+		read_index = 0;
+		--linked;
+		spares.push_back(std::move(old));
+
+		// Keeping just enough spare segments for the peak occupancy
+		// of the recent past.
+		if (++turnovers == trim_interval) {
+			const std::size_t needed = (peak + segment_size - 1) / segment_size;
+			while (spares.size() > needed) {
+				spares.pop_back();
+			}
+
+			turnovers = 0;
+			peak = count;
+		}
+	}
+
+	bool _write(std::unique_ptr<T> & message,
+			std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr) {
+		auto ready = [this] { return _has_room() || closed; };
+
+		if (!duration) {
+			write_cond.wait(ulock, ready);
+		} else if (!write_cond.wait_for(ulock, *duration, ready)) {
+			return false;
+		}
+
+		if (closed) {
+			return false;
+		}
+
+		if (write_index == segment_size) {
+			tail->next = _new_segment();
+			tail = tail->next.get();
+			write_index = 0;
+			++linked;
+		}
+
+		tail->slots[write_index++] = std::move(message);
+
+		peak = std::max(peak, ++count);
+
+		read_cond.notify_one();
+
+		return true;
+	}
+
+	bool _read(std::unique_ptr<T> & message,
+			std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr,
+			bool * timed_out = nullptr) {
+		auto ready = [this] { return count > 0 || closed; };
+
+		if (!duration) {
+			read_cond.wait(ulock, ready);
+		} else if (!read_cond.wait_for(ulock, *duration, ready)) {
+			*timed_out = true;
+			return false;
+		}
+
+		if (count == 0) {
+			return false;
+		}
+
+		if (read_index == segment_size) {
+			_retire_head();
+		}
+
+		message = std::move(head->slots[read_index++]);
+		--count;
+
+		// After a burst the queue goes quiet without turning its
+		// segments over, so the free list is cut here as well.
+		if (spares.size() > 1 &&
+				count * 4 < (linked + spares.size()) * segment_size) {
+			spares.resize(1);
+			peak = count;
+			turnovers = 0;
+		}
+
+		if (limit != 0) {
+			write_cond.notify_one();
+		}
+
+		return true;
+	}
+
+public:
+	segmented_queue(int _limit = 0, int _segment_size = 64) :
+		limit(static_cast<std::size_t>(_limit)),
+		segment_size(static_cast<std::size_t>(_segment_size)),
+		read_index(0),
+		write_index(0),
+		linked(1),
+		count(0),
+		closed(false),
+		peak(0),
+		turnovers(0) {
+		if (_limit < 0 || _segment_size <= 0) {
+			std::cerr << "thread_comm::segmented_queue - limit can not be "
+					"negative, and segment size must be positive" << std::endl;
+			std::abort();
+		}
+
+		head = std::make_unique<segment>(segment_size);
+		tail = head.get();
+	}
+
+	~segmented_queue() {
+		// Unlinking the segments one by one, as destroying a long list
+		// recursively could overflow the stack.
+		while (head) {
+			head = std::move(head->next);
+		}
+	}
+
+	segmented_queue(const segmented_queue<T> &) = delete;
+	segmented_queue<T>& operator=(const segmented_queue<T> &) = delete;
+
+	// See circular_queue::close().
+	void close() {
+		std::unique_lock<std::mutex> ulock(protector);
+		closed = true;
+
+		read_cond.notify_all();
+		write_cond.notify_all();
+	}
+
+	bool is_closed() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return closed;
+	}
+
+	// Returns false if the queue is closed.
+	bool write(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, ulock);
+	}
+
+	// Returns nullptr if the queue is closed and drained.
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Returns false if the queue is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _read(message, ulock);
+	}
+
+	// Returns false if the write timed out or the queue is closed.
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, ulock, &duration);
+	}
+
+	// Returns nullptr (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		std::unique_ptr<T> m;
+		timed_out = false;
+
+		std::unique_lock<std::mutex> ulock(protector);
+		_read(m, ulock, &duration, &timed_out);
+
+		return m;
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (_has_room() && !closed) {
+			return _write(message, ulock);
+		}
+		return false;
+	}
+
+	std::unique_ptr<T> try_reading() {
+		std::unique_ptr<T> m;
+		try_reading(m);
+		return m;
+	}
+
+	bool try_reading(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count > 0) {
+			return _read(message, ulock);
+		}
+
+		return false;
+	}
+
+	std::size_t msg_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return count;
+	}
+
+	// The number of segments that are allocated, including the spare
+	// ones.
+	std::size_t segment_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		std::size_t n = spares.size();
+		for (segment * s = head.get() ; s ; s = s->next.get()) {
+			++n;
+		}
+		return n;
+	}
+
+	// Releases the spare segments back to the allocator.
+	void shrink_to_fit() {
+		std::unique_lock<std::mutex> ulock(protector);
+		spares.clear();
+		peak = count;
+		turnovers = 0;
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+}; // segmented_queue
+
+// global overloads for segmented_queue - start
+template <typename T>
+void operator>>(std::unique_ptr<T> & message, segmented_queue<T> & q) {
+	q.write(message);
+}
+
+template <typename T>
+void operator<<(std::unique_ptr<T> & message, segmented_queue<T> & q) {
+	message = q.read();
+}
+// global overloads for segmented_queue - end
+
+// How a sharded_queue picks the shard a thread writes into first:
+// - by_thread: every thread has a home shard, which it also reads from
+//   first, so the threads are spread over the shards.
+// - round_robin: every write of a thread goes to the next shard.
+enum class sharding {
+	by_thread,
+	round_robin
+};
+
+// sharded_queue spreads its messages over a number of circular_queue
+// shards, each with its own lock, so that many producers and consumers
+// don't all line up for the same mutex. A write goes to the shard the
+// sharding policy picks, or to the next shard with room if that one is
+// full. A read takes from the thread's home shard first, and then
+// looks at the others in turn. Only when all of the shards are empty
+// (or full, for the writers) does a thread block, on a parking_lot.
+// The capacity is split evenly over the shards (rounded up, and at
+// least one message per shard). There is no ordering between the
+// messages of different shards, and as a write may spill over into
+// another shard, not even the messages of a single producer are
+// guaranteed to stay in order.
+// It provides the circular_queue interface (apart from the bulk
+// operations, the selectors and the readiness fds), so it can back a
+// channel, see sharded_channel.
+template <typename T>
+class sharded_queue {
+private:
+	static constexpr int spin_limit = 128;
+
+	std::vector<std::unique_ptr<circular_queue<T>>> shards;
+	std::size_t capacity;
+	const wait_strategy strategy;
+	const sharding policy;
+
+	detail::parking_lot read_lot;
+	detail::parking_lot write_lot;
+
+	// A reader may take a message before its writer has counted it, so
+	// this can briefly go negative.
+	alignas(detail::cache_line_size) std::atomic<std::int64_t> count;
+	std::atomic<bool> closed;
+
+	static std::size_t default_shard_count() {
+		return std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+	}
+
+	// A small number that is unique to the calling thread.
+	static std::size_t thread_index() {
+		static std::atomic<std::size_t> next(0);
+		static thread_local const std::size_t index = next++;
+		return index;
+	}
+
+	std::size_t _home() {
+		return thread_index() % shards.size();
+	}
+
+	std::size_t _first_write_shard() {
+		if (policy == sharding::by_thread) {
+			return _home();
+		}
+
+		static thread_local std::size_t turn = 0;
+		return (thread_index() + turn++) % shards.size();
+	}
+
+	bool _try_write(std::unique_ptr<T> & message) {
+		const std::size_t n = shards.size();
+		const std::size_t first = _first_write_shard();
+
+		for (std::size_t i = 0 ; i < n ; ++i) {
+			if (shards[(first + i) % n]->try_writing(message)) {
+				count.fetch_add(1);
+				read_lot.unpark_one();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool _try_read(std::unique_ptr<T> & message) {
+		const std::size_t n = shards.size();
+		const std::size_t home = _home();
+
+		for (std::size_t i = 0 ; i < n ; ++i) {
+			if (shards[(home + i) % n]->try_reading(message)) {
+				count.fetch_sub(1);
+				write_lot.unpark_one();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Waits for ready(), spinning for a while first unless the wait
+	// strategy is block. Returns false at the deadline.
+	template <typename Predicate>
+	bool _wait(detail::parking_lot & lot, Predicate ready,
+			const std::chrono::steady_clock::time_point * deadline) {
+		if (strategy != wait_strategy::block) {
+			for (int i = 0 ; i < spin_limit ; ++i) {
+				if (ready()) {
+					return true;
+				}
+				detail::cpu_relax();
+			}
+		}
+
+		if (!deadline) {
+			lot.park(ready);
+			return true;
+		}
+
+		return lot.park_until(*deadline, ready);
+	}
+
+	bool _write(std::unique_ptr<T> & message,
+			const std::chrono::steady_clock::time_point * deadline = nullptr) {
+		while (!closed.load()) {
+			if (_try_write(message)) {
+				return true;
+			}
+
+			if (!_wait(write_lot, [this] {
+					return count.load() < static_cast<std::int64_t>(capacity) ||
+							closed.load();
+				}, deadline)) {
+				return false;
+			}
+		}
+
+		return false;
+	}
+
+	bool _read(std::unique_ptr<T> & message,
+			const std::chrono::steady_clock::time_point * deadline = nullptr,
+			bool * timed_out = nullptr) {
+		while (true) {
+			if (_try_read(message)) {
+				return true;
+			}
+
+			if (closed.load()) {
+				// All of the shards are closed by now, so one more look
+				// finds whatever made it into them.
+				return _try_read(message);
+			}
+
+			if (!_wait(read_lot, [this] {
+					return count.load() > 0 || closed.load();
+				}, deadline)) {
+				*timed_out = true;
+				return false;
+			}
+		}
+	}
+
+	void _init(const int size, const int shard_count) {
+		if (size <= 0 || shard_count < 0) {
+			std::cerr << "thread_comm::sharded_queue - size must be positive, "
+					"and shard count can not be negative" << std::endl;
+			std::abort();
+		}
+
+		const std::size_t n = shard_count == 0 ?
+				default_shard_count() : static_cast<std::size_t>(shard_count);
+		const std::size_t shard_size = std::max<std::size_t>(1,
+				(static_cast<std::size_t>(size) + n - 1) / n);
+
+		for (std::size_t i = 0 ; i < n ; ++i) {
+			shards.push_back(std::make_unique<circular_queue<T>>(
+					static_cast<int>(shard_size), strategy));
+		}
+
+		capacity = n * shard_size;
+	}
+
+public:
+	// A shard_count of zero picks one shard per hardware thread, up to 8.
+	sharded_queue(int size = 1, int shard_count = 0,
+			sharding _policy = sharding::by_thread) :
+		capacity(0),
+		strategy(wait_strategy::block),
+		policy(_policy),
+		count(0),
+		closed(false) {
+		_init(size, shard_count);
+	}
+
+	// For channel(read_q_size, write_q_size, strategy). Waiters spin for
+	// a while before they park unless the strategy is block.
+	sharded_queue(int size, wait_strategy _strategy) :
+		capacity(0),
+		strategy(_strategy),
+		policy(sharding::by_thread),
+		count(0),
+		closed(false) {
+		_init(size, 0);
+	}
+
+	sharded_queue(const sharded_queue<T> &) = delete;
+	sharded_queue<T>& operator=(const sharded_queue<T> &) = delete;
+
+	std::size_t shard_count() const {
+		return shards.size();
+	}
+
+	// See circular_queue::close(). The shards are closed first, so that
+	// no write can land in a shard after closed is seen.
+	void close() {
+		for (auto & shard : shards) {
+			shard->close();
+		}
+		closed.store(true);
+
+		read_lot.unpark_all();
+		write_lot.unpark_all();
+	}
+
+	bool is_closed() {
+		return closed.load();
+	}
+
+	// Returns false if the queue is closed.
+	bool write(std::unique_ptr<T> & message) {
+		return _write(message);
+	}
+
+	// Returns nullptr if the queue is closed and drained.
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Returns false if the queue is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		return _read(message);
+	}
+
+	// Returns false if the write timed out or the queue is closed.
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		const auto deadline = std::chrono::steady_clock::now() +
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+						duration);
+		return _write(message, &deadline);
+	}
+
+	// Returns nullptr (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		const auto deadline = std::chrono::steady_clock::now() +
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+						duration);
+		std::unique_ptr<T> m;
+		timed_out = false;
+		_read(m, &deadline, &timed_out);
+		return m;
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		return !closed.load() && _try_write(message);
+	}
+
+	std::unique_ptr<T> try_reading() {
+		std::unique_ptr<T> m;
+		try_reading(m);
+		return m;
+	}
+
+	bool try_reading(std::unique_ptr<T> & message) {
+		return _try_read(message);
+	}
+
+	std::size_t msg_count() {
+		return static_cast<std::size_t>(std::max<std::int64_t>(0, count.load()));
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+}; // sharded_queue
+
+// global overloads for sharded_queue - start
+template <typename T>
+void operator>>(std::unique_ptr<T> & message, sharded_queue<T> & q) {
+	q.write(message);
+}
+
+template <typename T>
+void operator<<(std::unique_ptr<T> & message, sharded_queue<T> & q) {
+	message = q.read();
+}
+// global overloads for sharded_queue - end
+
+// priority_circular_queue is a circular_queue with a few priority
+// levels, level 0 being the most urgent one. Every level has its own
+// ring of size slots, and a read always takes the oldest message of the
+// most urgent level that has any, so a control message doesn't wait
+// behind the backlog of the bulk levels, and a full bulk level doesn't
+// block the writers of the other levels either.
+// When a non-zero aging threshold is given, a level that has been
+// passed over that many times while it had messages gets served next,
+// so that the bulk levels can't be starved completely.
+// The writes without a level go to the least urgent level, so this
+// queue can also back a channel, see priority_channel.
+template <typename T>
+class priority_circular_queue {
+private:
+	typedef struct level_s {
+		std::vector<std::unique_ptr<T>> data;
+		std::size_t read_index;
+		std::size_t write_index;
+		std::size_t count;
+		// The reads that went to a more urgent level while this one
+		// had messages.
+		std::size_t skipped;
+		std::condition_variable write_cond;
+
+		level_s() : read_index(0), write_index(0), count(0), skipped(0) {}
+	} level;
+
+	const std::size_t size;
+	const std::size_t aging;
+
+	std::mutex protector;
+	std::condition_variable read_cond;
+	std::vector<level> levels;
+
+	std::size_t count;
+	bool closed;
+
+	level & _level(const int l) {
+		if (l < 0 || static_cast<std::size_t>(l) >= levels.size()) {
+			std::cerr << "thread_comm::priority_circular_queue - there is no "
+					"priority level " << l << std::endl;
+			std::abort();
+		}
+
+		return levels[l];
+	}
+
+	// The level to read from next. Must only be called when there is
+	// something to read.
+	level & _pick() {
+		level * chosen = nullptr;
+
+		for (auto & lv : levels) {
+			if (lv.count == 0) {
+				continue;
+			}
+
+			if (!chosen) {
+				chosen = &lv;
+			} else if (aging != 0 && ++lv.skipped >= aging) {
+				chosen = &lv;
+				break;
+			}
+		}
+
+		chosen->skipped = 0;
+		return *chosen;
+	}
+
+	bool _write(std::unique_ptr<T> & message, level & lv,
+			std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr) {
+		auto ready = [this, &lv] { return lv.count < size || closed; };
+
+		if (!duration) {
+			lv.write_cond.wait(ulock, ready);
+		} else if (!lv.write_cond.wait_for(ulock, *duration, ready)) {
+			return false;
+		}
+
+		if (closed) {
+			return false;
+		}
+
+		lv.data[lv.write_index] = std::move(message);
+		lv.write_index = (lv.write_index + 1) % size;
+		++lv.count;
+		++count;
+
+		read_cond.notify_one();
+
+		return true;
+	}
+
+	bool _read(std::unique_ptr<T> & message,
+			std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr,
+			bool * timed_out = nullptr) {
+		auto ready = [this] { return count > 0 || closed; };
+
+		if (!duration) {
+			read_cond.wait(ulock, ready);
+		} else if (!read_cond.wait_for(ulock, *duration, ready)) {
+			*timed_out = true;
+			return false;
+		}
+
+		if (count == 0) {
+			return false;
+		}
+
+		level & lv = _pick();
+		message = std::move(lv.data[lv.read_index]);
+		lv.read_index = (lv.read_index + 1) % size;
+		--lv.count;
+		--count;
+
+		lv.write_cond.notify_one();
+
+		return true;
+	}
+
+public:
+	priority_circular_queue(int _size = 1, int _levels = 2, int _aging = 0) :
+		size(static_cast<std::size_t>(_size)),
+		aging(static_cast<std::size_t>(_aging)),
+		levels(_levels > 0 ? _levels : 0),
+		count(0),
+		closed(false) {
+		if (_size <= 0 || _levels <= 0 || _aging < 0) {
+			std::cerr << "thread_comm::priority_circular_queue - size and "
+					"levels must be positive, and aging can not be negative"
+					<< std::endl;
+			std::abort();
+		}
+
+		for (auto & lv : levels) {
+			lv.data = std::vector<std::unique_ptr<T>>(size);
+		}
+	}
+
+	priority_circular_queue(const priority_circular_queue<T> &) = delete;
+	priority_circular_queue<T>& operator=(
+			const priority_circular_queue<T> &) = delete;
+
+	int level_count() const {
+		return static_cast<int>(levels.size());
+	}
+
+	// See circular_queue::close().
+	void close() {
+		std::unique_lock<std::mutex> ulock(protector);
+		closed = true;
+
+		read_cond.notify_all();
+		for (auto & lv : levels) {
+			lv.write_cond.notify_all();
+		}
+	}
+
+	bool is_closed() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return closed;
+	}
+
+	// Returns false if the queue is closed. Aborts if there is no such
+	// level.
+	bool write(std::unique_ptr<T> & message, const int l) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, _level(l), ulock);
+	}
+
+	// Writes into the least urgent level.
+	bool write(std::unique_ptr<T> & message) {
+		return write(message, level_count() - 1);
+	}
+
+	// Returns nullptr if the queue is closed and drained.
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Returns false if the queue is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _read(message, ulock);
+	}
+
+	// Returns false if the write timed out or the queue is closed.
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration, const int l) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, _level(l), ulock, &duration);
+	}
+
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		return timed_write(message, duration, level_count() - 1);
+	}
+
+	// Returns nullptr (with timed_out set to false) if the queue is
+	// closed and drained.
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		std::unique_ptr<T> m;
+		timed_out = false;
+
+		std::unique_lock<std::mutex> ulock(protector);
+		_read(m, ulock, &duration, &timed_out);
+
+		return m;
+	}
+
+	bool try_writing(std::unique_ptr<T> & message, const int l) {
+		std::unique_lock<std::mutex> ulock(protector);
+		level & lv = _level(l);
+		if (lv.count < size && !closed) {
+			return _write(message, lv, ulock);
+		}
+		return false;
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		return try_writing(message, level_count() - 1);
+	}
+
+	std::unique_ptr<T> try_reading() {
+		std::unique_ptr<T> m;
+		try_reading(m);
+		return m;
+	}
+
+	bool try_reading(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		if (count > 0) {
+			return _read(message, ulock);
+		}
+
+		return false;
+	}
+
+	std::size_t msg_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return count;
+	}
+
+	std::size_t msg_count(const int l) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _level(l).count;
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+}; // priority_circular_queue
+
+// global overloads for priority_circular_queue - start
+template <typename T>
+void operator>>(std::unique_ptr<T> & message, priority_circular_queue<T> & q) {
+	q.write(message);
+}
+
+template <typename T>
+void operator<<(std::unique_ptr<T> & message, priority_circular_queue<T> & q) {
+	message = q.read();
+}
+// global overloads for priority_circular_queue - end
+
+// What a broadcast_ring does with a subscriber that is a whole ring
+// behind the publisher:
+// - block: the publisher waits for it to catch up, so the slowest
+//   subscriber sets the pace.
+// - drop: the subscriber is dropped, its reads fail from then on.
+// - lap: the subscriber skips the messages that are about to be
+//   overwritten, and they are counted as lost for it.
+enum class broadcast_policy {
+	block,
+	drop,
+	lap
+};
+
+// broadcast_ring delivers every message it is given to all of its
+// subscribers, in the style of the disruptor: the messages are
+// published once into a ring of preallocated slots (by value, so T must
+// be default constructible and copy assignable), and every subscriber
+// walks the ring with its own cursor. Publishing a message doesn't
+// allocate, and neither does reading one with consume(), which lets
+// the subscriber look at the message in its slot without copying it.
+// Subscribers can join and leave at any time. A new subscriber only
+// sees the messages that are published after it joins.
+// Publishers are serialized by a mutex, and the publisher only looks
+// at the subscribers' cursors when the ring seems to be full, so with
+// enough room it touches nothing but its own cache lines. Waiting
+// subscribers and publishers are parked on parking_lots.
+template <typename T>
+class broadcast_ring {
+private:
+	static constexpr int spin_limit = 128;
+
+	typedef struct alignas(detail::cache_line_size) cursor_s {
+		// The sequence number of the next message to read.
+		std::atomic<std::uint64_t> next;
+		std::atomic<std::uint64_t> lost;
+		std::atomic<bool> dropped;
+		// Held by the subscriber while it reads a slot, and by the
+		// publisher while it laps or drops the subscriber, so that a
+		// slot is never overwritten while it's being read. It's only
+		// used by the drop and lap policies.
+		std::mutex protector;
+
+		cursor_s(const std::uint64_t _next) :
+			next(_next),
+			lost(0),
+			dropped(false)
+		{}
+	} cursor;
+
+	const std::size_t size;
+	const broadcast_policy policy;
+	std::size_t mask;
+	std::vector<T> slots;
+
+	detail::parking_lot read_lot;
+	detail::parking_lot write_lot;
+
+	std::mutex registry_lock;
+	std::vector<std::shared_ptr<cursor>> cursors;
+
+	// Publisher side
+	alignas(detail::cache_line_size) std::mutex publish_lock;
+	// The smallest cursor the last time the publisher checked. The
+	// ring is known to have room up to gating + size.
+	std::uint64_t gating;
+
+	// The number of published messages, which is also the sequence
+	// number of the next one.
+	alignas(detail::cache_line_size) std::atomic<std::uint64_t> published;
+	std::atomic<bool> closed;
+
+	// The smallest cursor of the subscribers that are still there, or
+	// limit if none of them is behind it.
+	std::uint64_t _min_cursor(const std::uint64_t limit) {
+		std::lock_guard<std::mutex> guard(registry_lock);
+		std::uint64_t m = limit;
+		for (auto & c : cursors) {
+			if (!c->dropped.load(std::memory_order_relaxed)) {
+				m = std::min(m, c->next.load(std::memory_order_acquire));
+			}
+		}
+		return m;
+	}
+
+	// Laps or drops the subscribers that would lose the slot of
+	// sequence number seq.
+	void _overrun(const std::uint64_t seq) {
+		std::lock_guard<std::mutex> guard(registry_lock);
+		const std::uint64_t oldest = seq - size + 1;
+
+		for (auto & c : cursors) {
+			std::lock_guard<std::mutex> cguard(c->protector);
+			const std::uint64_t next = c->next.load(std::memory_order_relaxed);
+
+			if (c->dropped.load(std::memory_order_relaxed) || next >= oldest) {
+				continue;
+			}
+
+			if (policy == broadcast_policy::drop) {
+				c->dropped.store(true, std::memory_order_relaxed);
+			} else {
+				c->lost.fetch_add(oldest - next, std::memory_order_relaxed);
+				c->next.store(oldest, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Makes room for sequence number seq. Returns false if the ring
+	// is closed, or if it's full and wait is false.
+	bool _claim(const std::uint64_t seq, const bool wait) {
+		if (seq < size || gating > seq - size) {
+			return true;
+		}
+
+		gating = _min_cursor(seq);
+		if (gating > seq - size) {
+			return true;
+		}
+
+		if (policy != broadcast_policy::block) {
+			_overrun(seq);
+			gating = _min_cursor(seq);
+			return true;
+		}
+
+		if (!wait) {
+			return false;
+		}
+
+		write_lot.park([this, seq] {
+			gating = _min_cursor(seq);
+			return gating > seq - size || closed.load();
+		});
+
+		return !closed.load();
+	}
+
+	template <typename U>
+	bool _publish(U && message, const bool wait) {
+		std::lock_guard<std::mutex> guard(publish_lock);
+		if (closed.load(std::memory_order_relaxed)) {
+			return false;
+		}
+
+		const std::uint64_t seq = published.load(std::memory_order_relaxed);
+		if (!_claim(seq, wait)) {
+			return false;
+		}
+
+		slots[seq & mask] = std::forward<U>(message);
+		published.store(seq + 1, std::memory_order_release);
+
+		read_lot.unpark_all();
+
+		return true;
+	}
+
+	void _leave(const std::shared_ptr<cursor> & c) {
+		{
+			std::lock_guard<std::mutex> guard(registry_lock);
+			cursors.erase(std::find(cursors.begin(), cursors.end(), c));
+		}
+
+		// A blocked publisher may have been waiting for this one.
+		write_lot.unpark_all();
+	}
+
+public:
+	// A subscriber of a broadcast_ring. It leaves the ring when it is
+	// destroyed (or when leave() is called), and it must not outlive
+	// the ring. A subscriber must only be used by one thread at a time.
+	class subscriber {
+	private:
+		friend class broadcast_ring<T>;
+
+		broadcast_ring<T> * ring;
+		std::shared_ptr<cursor> c;
+
+		subscriber(broadcast_ring<T> * _ring, std::shared_ptr<cursor> _c) :
+			ring(_ring),
+			c(std::move(_c))
+		{}
+
+		bool _readable() {
+			return ring->published.load(std::memory_order_acquire) >
+					c->next.load(std::memory_order_relaxed) ||
+					ring->closed.load() || c->dropped.load();
+		}
+
+		// Hands the next message to f, if there is one.
+		template <typename F>
+		bool _consume(F & f) {
+			std::unique_lock<std::mutex> ulock(c->protector, std::defer_lock);
+			if (ring->policy != broadcast_policy::block) {
+				ulock.lock();
+			}
+
+			if (c->dropped.load(std::memory_order_relaxed)) {
+				return false;
+			}
+
+			const std::uint64_t next = c->next.load(std::memory_order_relaxed);
+			if (ring->published.load(std::memory_order_acquire) == next) {
+				return false;
+			}
+
+			f(static_cast<const T &>(ring->slots[next & ring->mask]));
+			c->next.store(next + 1, std::memory_order_release);
+
+			if (ulock.owns_lock()) {
+				ulock.unlock();
+			}
+
+			ring->write_lot.unpark_all();
+
+			return true;
+		}
+
+		template <typename F>
+		bool _wait_and_consume(F & f,
+				const std::chrono::steady_clock::time_point * deadline,
+				bool * timed_out) {
+			for (int i = 0 ; ; ++i) {
+				if (_consume(f)) {
+					return true;
+				}
+
+				if (c->dropped.load() || ring->closed.load()) {
+					// The last messages may have been published just
+					// before the ring was closed.
+					return _consume(f);
+				}
+
+				if (i < spin_limit) {
+					detail::cpu_relax();
+				} else if (!deadline) {
+					ring->read_lot.park([this] { return _readable(); });
+				} else if (!ring->read_lot.park_until(*deadline,
+						[this] { return _readable(); })) {
+					*timed_out = true;
+					return false;
+				}
+			}
+		}
+
+	public:
+		subscriber(subscriber && other) :
+			ring(other.ring),
+			c(std::move(other.c))
+		{}
+
+		subscriber & operator=(subscriber && other) {
+			leave();
+			ring = other.ring;
+			c = std::move(other.c);
+			return *this;
+		}
+
+		subscriber(const subscriber &) = delete;
+		subscriber & operator=(const subscriber &) = delete;
+
+		~subscriber() {
+			leave();
+		}
+
+		void leave() {
+			if (c) {
+				ring->_leave(c);
+				c.reset();
+			}
+		}
+
+		// Calls f with the next message, without copying it out of the
+		// ring. Blocks until there is a message, and returns false once
+		// the ring is closed and this subscriber has read everything,
+		// or once the subscriber is dropped.
+		template <typename F>
+		bool consume(F && f) {
+			return _wait_and_consume(f, nullptr, nullptr);
+		}
+
+		// Returns an empty optional if the ring is closed and drained,
+		// or if the subscriber has been dropped.
+		std::optional<T> read() {
+			std::optional<T> m;
+			consume([&m] (const T & message) { m = message; });
+			return m;
+		}
+
+		std::optional<T> try_reading() {
+			std::optional<T> m;
+			auto f = [&m] (const T & message) { m = message; };
+			_consume(f);
+			return m;
+		}
+
+		std::optional<T> timed_read(
+				const std::chrono::system_clock::duration duration,
+				bool & timed_out) {
+			std::optional<T> m;
+			auto f = [&m] (const T & message) { m = message; };
+			const auto deadline = std::chrono::steady_clock::now() +
+					std::chrono::duration_cast<
+							std::chrono::steady_clock::duration>(duration);
+
+			timed_out = false;
+			_wait_and_consume(f, &deadline, &timed_out);
+
+			return m;
+		}
+
+		// The number of messages that have been published but not read
+		// by this subscriber yet.
+		std::size_t backlog() const {
+			return static_cast<std::size_t>(
+					ring->published.load(std::memory_order_acquire) -
+					c->next.load(std::memory_order_relaxed));
+		}
+
+		// The number of messages this subscriber has been lapped on.
+		std::uint64_t lost() const {
+			return c->lost.load(std::memory_order_relaxed);
+		}
+
+		bool is_dropped() const {
+			return c->dropped.load();
+		}
+	}; // subscriber
+
+	broadcast_ring(int _size = 1024,
+			broadcast_policy _policy = broadcast_policy::block) :
+		size(static_cast<std::size_t>(_size)),
+		policy(_policy),
+		mask(0),
+		gating(0),
+		published(0),
+		closed(false) {
+		if (_size <= 0) {
+			std::cerr << "thread_comm::broadcast_ring - size must be positive"
+					<< std::endl;
+			std::abort();
+		}
+
+		std::size_t n = 1;
+		while (n < size) {
+			n <<= 1;
+		}
+
+		slots = std::vector<T>(n);
+		mask = n - 1;
+	}
+
+	broadcast_ring(const broadcast_ring<T> &) = delete;
+	broadcast_ring<T>& operator=(const broadcast_ring<T> &) = delete;
+
+	subscriber subscribe() {
+		auto c = std::make_shared<cursor>(0);
+
+		// The publisher's gating sequence comes from _min_cursor(), under
+		// the registry lock, and it's never beyond the sequence number
+		// being published then. So reading published under the same
+		// lock keeps the new cursor from falling behind the gating
+		// sequence, without waiting for a publisher that is blocked on
+		// the slowest subscriber.
+		std::lock_guard<std::mutex> guard(registry_lock);
+		c->next.store(published.load(std::memory_order_acquire),
+				std::memory_order_relaxed);
+		cursors.push_back(c);
+
+		return subscriber(this, std::move(c));
+	}
+
+	std::size_t subscriber_count() {
+		std::lock_guard<std::mutex> guard(registry_lock);
+		return cursors.size();
+	}
+
+	// Returns false if the ring is closed. With the block policy, waits
+	// for the slowest subscriber to make room.
+	bool publish(const T & message) {
+		return _publish(message, true);
+	}
+
+	bool publish(T && message) {
+		return _publish(std::move(message), true);
+	}
+
+	// With the block policy, fails instead of waiting when the slowest
+	// subscriber is a whole ring behind.
+	bool try_publishing(const T & message) {
+		return _publish(message, false);
+	}
+
+	// The subscribers can still read the messages that were published
+	// before the ring was closed, after which their reads fail.
+	void close() {
+		closed.store(true);
+		read_lot.unpark_all();
+		write_lot.unpark_all();
+	}
+
+	bool is_closed() {
+		return closed.load();
+	}
+}; // broadcast_ring
+
+namespace detail {
+inline std::uint64_t next_pool_id() {
+	static std::atomic<std::uint64_t> id(0);
+	return ++id;
+}
+} // namespace detail
+
+// An object_pool keeps objects around for reuse, so that a pipeline
+// doesn't have to allocate a message on the producer side and free it
+// on the consumer side for every send. Producers acquire() messages
+// from the pool, and consumers recycle() them once they are done with
+// them. The messages are plain std::unique_ptr<T>s (with the default
+// deleter), so they can be sent over any queue or channel, and a
+// message that isn't recycled is simply deleted as usual.
+// Every thread keeps a small cache of objects for each pool it uses,
+// and the caches exchange objects with a shared free list in batches,
+// so the lock of the free list is only taken once per batch. The free
+// list is bounded: once it's full, recycled objects are deleted.
+// The optional reset function is called on every recycled object, to
+// bring it back to a reusable state.
+// When a thread exits, its caches go back to the free lists of their
+// pools, or are deleted if their pool no longer exists, so the threads
+// that come and go don't take any objects with them.
+template <typename T>
+class object_pool {
+public:
+	typedef struct stats_s {
+		// Acquisitions served from a cache or the free list.
+		std::uint64_t hits;
+		// Acquisitions that had to allocate a new object.
+		std::uint64_t misses;
+		std::uint64_t recycled;
+		// Recycled objects deleted because the free list was full.
+		std::uint64_t released;
+	} stats;
+
+private:
+	// A thread's cache for a pool. Only its own thread modifies it, but
+	// stats() reads its counters from other threads.
+	typedef struct local_cache_s {
+		std::vector<std::unique_ptr<T>> objects;
+		std::atomic<std::uint64_t> hits;
+		std::atomic<std::uint64_t> misses;
+		std::atomic<std::uint64_t> recycled;
+
+		local_cache_s() : hits(0), misses(0), recycled(0) {}
+
+		void count(std::atomic<std::uint64_t> & counter) {
+			counter.store(counter.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+		}
+	} local_cache;
+
+	// The part of the pool that the threads hold on to (weakly) with
+	// their caches, so that they can still find it when they exit.
+	typedef struct shared_state_s {
+		std::mutex protector;
+		std::vector<std::unique_ptr<T>> free_list;
+		std::vector<std::shared_ptr<local_cache>> caches;
+		std::size_t capacity;
+		std::uint64_t released;
+		// The counters of the caches that went away with their threads.
+		stats retired;
+
+		shared_state_s(const std::size_t _capacity) :
+			capacity(_capacity),
+			released(0),
+			retired{0, 0, 0, 0}
+		{}
+
+		// Moves up to n of the given objects to the free list, and deletes
+		// the ones that don't fit. Expects the lock to be held.
+		void give_back(std::vector<std::unique_ptr<T>> & objects,
+				const std::size_t n) {
+			const std::size_t room = capacity > free_list.size() ?
+					capacity - free_list.size() : 0;
+			const std::size_t moved = std::min(n, room);
+
+			std::move(objects.end() - moved, objects.end(),
+					std::back_inserter(free_list));
+			released += n - moved;
+			objects.resize(objects.size() - n);
+		}
+
+		void retire(const std::shared_ptr<local_cache> & c) {
+			std::lock_guard<std::mutex> guard(protector);
+			give_back(c->objects, c->objects.size());
+
+			retired.hits += c->hits.load(std::memory_order_relaxed);
+			retired.misses += c->misses.load(std::memory_order_relaxed);
+			retired.recycled += c->recycled.load(std::memory_order_relaxed);
+
+			auto it = std::find(caches.begin(), caches.end(), c);
+			if (it != caches.end()) {
+				*it = std::move(caches.back());
+				caches.pop_back();
+			}
+		}
+	} shared_state;
+
+	typedef struct cache_entry_s {
+		std::weak_ptr<shared_state> pool;
+		std::shared_ptr<local_cache> cache;
+	} cache_entry;
+
+	// The caches of a thread, by pool id.
+	typedef struct thread_caches_s {
+		std::unordered_map<std::uint64_t, cache_entry> entries;
+
+		~thread_caches_s() {
+			for (auto & e : entries) {
+				if (auto state = e.second.pool.lock()) {
+					state->retire(e.second.cache);
+				}
+			}
+		}
+	} thread_caches;
+
+	const std::uint64_t id;
+	const std::size_t local_capacity;
+
+	std::function<std::unique_ptr<T>()> factory;
+	std::function<void(T &)> reset;
+
+	std::shared_ptr<shared_state> state;
+
+	local_cache & cache() {
+		thread_local thread_caches caches_of_thread;
+
+		auto & entries = caches_of_thread.entries;
+		auto it = entries.find(id);
+		if (it != entries.end()) {
+			return *it->second.cache;
+		}
+
+		// Dropping the caches of the pools that are gone, while we are
+		// at it.
+		for (auto e = entries.begin() ; e != entries.end() ; ) {
+			e = e->second.pool.expired() ? entries.erase(e) : std::next(e);
+		}
+
+		auto c = std::make_shared<local_cache>();
+		c->objects.reserve(local_capacity);
+		entries[id] = cache_entry{state, c};
+
+		std::lock_guard<std::mutex> guard(state->protector);
+		state->caches.push_back(c);
+
+		return *c;
+	}
+
+public:
+	object_pool(std::function<std::unique_ptr<T>()> _factory =
+				[] { return std::make_unique<T>(); },
+			std::function<void(T &)> _reset = nullptr,
+			std::size_t _local_capacity = 64,
+			std::size_t _global_capacity = 4096) :
+		id(detail::next_pool_id()),
+		local_capacity(std::max<std::size_t>(_local_capacity, 2)),
+		factory(std::move(_factory)),
+		reset(std::move(_reset)),
+		state(std::make_shared<shared_state>(_global_capacity))
+	{}
+
+	object_pool(const object_pool<T> &) = delete;
+	object_pool<T>& operator=(const object_pool<T> &) = delete;
+
+	std::unique_ptr<T> acquire() {
+		local_cache & c = cache();
+
+		if (c.objects.empty()) {
+			// Refilling half of the cache from the free list.
+			std::lock_guard<std::mutex> guard(state->protector);
+			auto & free_list = state->free_list;
+			const std::size_t n = std::min(free_list.size(), local_capacity / 2);
+			std::move(free_list.end() - n, free_list.end(),
+					std::back_inserter(c.objects));
+			free_list.resize(free_list.size() - n);
+		}
+
+		if (c.objects.empty()) {
+			c.count(c.misses);
+			return factory();
+		}
+
+		c.count(c.hits);
+		auto object = std::move(c.objects.back());
+		c.objects.pop_back();
+
+		return object;
+	}
+
+	void recycle(std::unique_ptr<T> && object) {
+		if (!object) {
+			return;
+		}
+
+		if (reset) {
+			reset(*object);
+		}
+
+		local_cache & c = cache();
+		c.count(c.recycled);
+
+		if (c.objects.size() == local_capacity) {
+			// Handing half of the cache over to the free list, and
+			// deleting what doesn't fit in there.
+			std::lock_guard<std::mutex> guard(state->protector);
+			state->give_back(c.objects, local_capacity / 2);
+		}
+
+		c.objects.push_back(std::move(object));
+	}
+
+	// Overload for the messages that are still held in a variable, it
+	// leaves the variable null.
+	void recycle(std::unique_ptr<T> & object) {
+		recycle(std::unique_ptr<T>(std::move(object)));
+	}
+
+	// The counters are updated without any synchronization between the
+	// threads, so this is a snapshot that may lag a little behind.
+	stats statistics() {
+		std::lock_guard<std::mutex> guard(state->protector);
+		stats st = state->retired;
+
+		for (auto & c : state->caches) {
+			st.hits += c->hits.load(std::memory_order_relaxed);
+			st.misses += c->misses.load(std::memory_order_relaxed);
+			st.recycled += c->recycled.load(std::memory_order_relaxed);
+		}
+		st.released = state->released;
+
+		return st;
+	}
+}; // object_pool
+
+namespace detail {
+// The unit of work of a work_stealing_pool. The tasks are type-erased
+// with a virtual function rather than with std::function, so that
+// move-only callables (like std::packaged_task) can be tasks too.
+class task {
+public:
+	virtual ~task() {}
+	virtual void run() = 0;
+};
+
+template <typename F>
+class callable_task : public task {
+private:
+	F f;
+
+public:
+	callable_task(F && _f) : f(std::move(_f)) {}
+
+	void run() override {
+		f();
+	}
+};
+
+// A Chase-Lev work-stealing deque, following the C11 version of Le,
+// Pop, Cohen and Zappa Nardelli (PPoPP 2013). Its owner thread pushes
+// and pops at the bottom without any atomic read-modify-write, unless
+// it's racing for the last task, and the other threads steal from the
+// top with a compare-and-swap. The ring grows when it's full, and the
+// old rings are kept until the deque is destroyed, as a thief may
+// still be reading from them. It only stores the pointers, the tasks
+// are owned by whoever pops or steals them.
+class chase_lev_deque {
+private:
+	typedef struct ring_s {
+		const std::int64_t capacity;
+		std::unique_ptr<std::atomic<task *>[]> slots;
+
+		ring_s(const std::int64_t _capacity) :
+			capacity(_capacity),
+			slots(new std::atomic<task *>[_capacity])
+		{}
+
+		task * get(const std::int64_t i) {
+			return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+		}
+
+		void put(const std::int64_t i, task * t) {
+			slots[i & (capacity - 1)].store(t, std::memory_order_relaxed);
+		}
+	} ring;
+
+	alignas(cache_line_size) std::atomic<std::int64_t> top;
+	alignas(cache_line_size) std::atomic<std::int64_t> bottom;
+	std::atomic<ring *> current;
+	// Only touched by the owner.
+	std::vector<std::unique_ptr<ring>> rings;
+
+	ring * _grow(ring * r, const std::int64_t b, const std::int64_t t) {
+		auto bigger = std::make_unique<ring>(r->capacity * 2);
+		for (std::int64_t i = t ; i < b ; ++i) {
+			bigger->put(i, r->get(i));
+		}
+
+		ring * raw = bigger.get();
+		rings.push_back(std::move(bigger));
+		current.store(raw, std::memory_order_release);
+
+		return raw;
+	}
+
+public:
+	chase_lev_deque(const std::int64_t capacity = 256) :
+		top(0),
+		bottom(0) {
+		std::int64_t n = 1;
+		while (n < capacity) {
+			n <<= 1;
+		}
+
+		rings.push_back(std::make_unique<ring>(n));
+		current.store(rings.back().get(), std::memory_order_relaxed);
+	}
+
+	chase_lev_deque(const chase_lev_deque &) = delete;
+	chase_lev_deque & operator=(const chase_lev_deque &) = delete;
+
+	// Owner only.
+	void push(task * t) {
+		const std::int64_t b = bottom.load(std::memory_order_relaxed);
+		const std::int64_t tp = top.load(std::memory_order_acquire);
+		ring * r = current.load(std::memory_order_relaxed);
+
+		if (b - tp > r->capacity - 1) {
+			r = _grow(r, b, tp);
+		}
+
+		r->put(b, t);
+		// The paper uses a release fence followed by a relaxed store,
+		// which is the same thing, but the thread sanitizer only
+		// understands this form.
+		bottom.store(b + 1, std::memory_order_release);
+	}
+
+	// Owner only. Returns the most recently pushed task, or nullptr.
+	task * pop() {
+		const std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		ring * r = current.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		task * x = r->get(b);
+		if (t == b) {
+			// The last task: racing the thieves for it.
+			if (!top.compare_exchange_strong(t, t + 1,
+					std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				x = nullptr;
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		return x;
+	}
+
+	// Any thread. Returns the oldest task, or nullptr if the deque is
+	// empty or another thread won the race for it.
+	task * steal() {
+		std::int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const std::int64_t b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b) {
+			return nullptr;
+		}
+
+		task * x = current.load(std::memory_order_acquire)->get(t);
+		if (!top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			return nullptr;
+		}
+
+		return x;
+	}
+
+	bool empty() const {
+		return bottom.load(std::memory_order_relaxed) <=
+				top.load(std::memory_order_relaxed);
+	}
+}; // chase_lev_deque
+} // namespace detail
+
+// work_stealing_pool runs tasks on a fixed number of worker threads.
+// Every worker has its own Chase-Lev deque: the tasks that a worker
+// posts go to the bottom of its own deque, and it works through them
+// last in, first out, without sharing a lock with anybody. A worker
+// that runs out of tasks first looks at the shared injection queue
+// (a segmented_queue, where the tasks posted from the other threads
+// go) and then tries to steal the oldest task of randomly chosen
+// workers. Idle workers are parked on a parking_lot, and only get
+// woken up when there is something to do.
+// post() runs a callable and forgets about it, submit() returns a
+// std::future for its result. An exception escaping a posted task
+// terminates the program, whereas submit() stores it in the future.
+// shutdown() stops taking new tasks from outside the pool, waits for
+// all of the queued tasks to run (including the ones that the tasks
+// post while the pool is draining) and joins the workers. The
+// destructor calls it.
+class work_stealing_pool {
+private:
+	typedef struct alignas(detail::cache_line_size) worker_s {
+		detail::chase_lev_deque deque;
+		std::uint64_t seed;
+
+		worker_s(const std::uint64_t _seed) : seed(_seed) {}
+	} worker;
+
+	std::vector<std::unique_ptr<worker>> workers;
+	std::vector<std::thread> threads;
+
+	segmented_queue<detail::task> injection;
+
+	detail::parking_lot idle;
+
+	std::mutex shutdown_lock;
+
+	// The number of tasks that have been posted but not taken by a
+	// worker yet.
+	alignas(detail::cache_line_size) std::atomic<std::int64_t> queued;
+	std::atomic<bool> stopping;
+
+	// The pool and the worker the calling thread belongs to, if any.
+	static work_stealing_pool *& current_pool() {
+		static thread_local work_stealing_pool * pool = nullptr;
+		return pool;
+	}
+
+	static std::size_t & current_index() {
+		static thread_local std::size_t index = 0;
+		return index;
+	}
+
+	static std::uint64_t _next_random(std::uint64_t & state) {
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	bool _enqueue(std::unique_ptr<detail::task> t) {
+		if (current_pool() == this) {
+			// A task posting more work: it goes to the worker's own
+			// deque, even while the pool is shutting down.
+			queued.fetch_add(1, std::memory_order_relaxed);
+			workers[current_index()]->deque.push(t.release());
+		} else {
+			if (stopping.load()) {
+				return false;
+			}
+
+			queued.fetch_add(1, std::memory_order_relaxed);
+			if (!injection.write(t)) {
+				queued.fetch_sub(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		idle.unpark_one();
+
+		return true;
+	}
+
+	std::unique_ptr<detail::task> _find_task(const std::size_t index) {
+		worker & self = *workers[index];
+
+		if (detail::task * t = self.deque.pop()) {
+			return std::unique_ptr<detail::task>(t);
+		}
+
+		std::unique_ptr<detail::task> t;
+		if (injection.try_reading(t)) {
+			return t;
+		}
+
+		const std::size_t n = workers.size();
+		const std::size_t start = _next_random(self.seed) % n;
+		for (std::size_t i = 0 ; i < n ; ++i) {
+			const std::size_t victim = (start + i) % n;
+			if (victim == index) {
+				continue;
+			}
+
+			if (detail::task * stolen = workers[victim]->deque.steal()) {
+				return std::unique_ptr<detail::task>(stolen);
+			}
+		}
+
+		return nullptr;
+	}
+
+	void _run(const std::size_t index) {
+		current_pool() = this;
+		current_index() = index;
+
+		while (true) {
+			if (auto t = _find_task(index)) {
+				queued.fetch_sub(1, std::memory_order_relaxed);
+				t->run();
+				continue;
+			}
+
+			if (queued.load() > 0) {
+				// Somebody is about to publish the task, or another
+				// worker is racing us for it.
+				std::this_thread::yield();
+				continue;
+			}
+
+			if (stopping.load()) {
+				break;
+			}
+
+			idle.park([this] {
+				return queued.load() > 0 || stopping.load();
+			});
+		}
+
+		current_pool() = nullptr;
+	}
+
+public:
+	// A pool of hardware_concurrency() workers by default.
+	work_stealing_pool(int thread_count = 0) :
+		queued(0),
+		stopping(false) {
+		if (thread_count < 0) {
+			std::cerr << "thread_comm::work_stealing_pool - thread count can "
+					"not be negative" << std::endl;
+			std::abort();
+		}
+
+		if (thread_count == 0) {
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		for (int i = 0 ; i < thread_count ; ++i) {
+			workers.push_back(std::make_unique<worker>(
+					0x9e3779b97f4a7c15ULL * (i + 1)));
+		}
+
+		for (int i = 0 ; i < thread_count ; ++i) {
+			threads.emplace_back(&work_stealing_pool::_run, this, i);
+		}
+	}
+
+	~work_stealing_pool() {
+		shutdown();
+	}
+
+	work_stealing_pool(const work_stealing_pool &) = delete;
+	work_stealing_pool & operator=(const work_stealing_pool &) = delete;
+
+	// Returns false if the pool is shutting down (and the call doesn't
+	// come from one of its tasks), in which case f is dropped.
+	template <typename F>
+	bool post(F && f) {
+		typedef typename std::decay<F>::type callable;
+		return _enqueue(std::make_unique<detail::callable_task<callable>>(
+				callable(std::forward<F>(f))));
+	}
+
+	// The future is broken (it throws std::future_error) if the pool
+	// was shutting down.
+	template <typename F>
+	auto submit(F && f) -> std::future<typename std::invoke_result<
+			typename std::decay<F>::type>::type> {
+		typedef typename std::invoke_result<
+				typename std::decay<F>::type>::type result;
+
+		std::packaged_task<result()> pt(std::forward<F>(f));
+		auto future = pt.get_future();
+		post(std::move(pt));
+
+		return future;
+	}
+
+	std::size_t thread_count() const {
+		return workers.size();
+	}
+
+	// Whether the calling thread is one of the workers of this pool.
+	bool in_pool() const {
+		return current_pool() == this;
+	}
+
+	// Must not be called from one of the pool's tasks.
+	void shutdown() {
+		std::lock_guard<std::mutex> guard(shutdown_lock);
+		if (threads.empty()) {
+			return;
+		}
+
+		// Closing the injection queue first: a post() that gets its
+		// task in before that has already counted it as queued, so the
+		// workers wait for it before they leave.
+		injection.close();
+		stopping.store(true);
+		idle.unpark_all();
+
+		for (auto & t : threads) {
+			t.join();
+		}
+		threads.clear();
+	}
+}; // work_stealing_pool
+
+// A channel_endpoint binds a thread to one end of a channel. It reads
+// from one of the channel's queues and writes into the other one, both
+// of which are chosen once when the endpoint is created. So, unlike
+// the channel's own functions, its operations don't look the calling
+// thread up in the role sets, they go straight to the right queue.
+// channel::owner_end() and channel::worker_end() create the endpoints.
+// Endpoints don't know about the roles, so become_a_non_reader() and
+// friends have no effect on them. An endpoint must not outlive its
+// channel.
+template <typename T, template <typename> class Queue = circular_queue>
+class channel_endpoint {
+private:
+	friend class selector;
+
+	Queue<T> * in;
+	Queue<T> * out;
+
+	Queue<T> & reading_queue() {
+		return *in;
+	}
+
+	Queue<T> & writing_queue() {
+		return *out;
+	}
+
+public:
+	channel_endpoint(Queue<T> & _in, Queue<T> & _out) :
+		in(&_in),
+		out(&_out)
+	{}
+
+	std::unique_ptr<T> read() {
+		return in->read();
+	}
+
+	// Returns false if the queue to read from is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		return in->read(message);
+	}
+
+	// Returns false if the queue to write into is closed.
+	bool write(std::unique_ptr<T> & message) {
+		return out->write(message);
+	}
+
+	// Only for the queues with priority levels, e.g. priority_channel.
+	bool write(std::unique_ptr<T> & message, const int level) {
+		return out->write(message, level);
+	}
+
+	std::unique_ptr<T> try_reading() {
+		return in->try_reading();
+	}
+
+	bool try_reading(std::unique_ptr<T> & message) {
+		return in->try_reading(message);
+	}
+
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		return in->timed_read(duration, timed_out);
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		return out->try_writing(message);
+	}
+
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		return out->timed_write(message, duration);
+	}
+
+	template <typename InputIt>
+	std::size_t write_bulk(InputIt first, InputIt last) {
+		return out->write_bulk(first, last);
+	}
+
+	template <typename InputIt>
+	std::size_t try_write_bulk(InputIt first, InputIt last) {
+		return out->try_write_bulk(first, last);
+	}
+
+	template <typename OutputIt>
+	std::size_t read_bulk(OutputIt o, const std::size_t max) {
+		return in->read_bulk(o, max);
+	}
+
+	template <typename OutputIt>
+	std::size_t try_read_bulk(OutputIt o, const std::size_t max) {
+		return in->try_read_bulk(o, max);
+	}
+
+#if defined(THREAD_COMM_COROUTINES)
+	// See circular_queue::async_read(). As an endpoint doesn't depend on
+	// the thread that uses it, this is the way to use a channel from
+	// coroutines, which may be resumed on any thread.
+	template <typename Executor>
+	auto async_read(std::unique_ptr<T> & message, Executor & executor) {
+		return in->async_read(message, executor);
+	}
+
+	template <typename Executor>
+	auto async_write(std::unique_ptr<T> & message, Executor & executor) {
+		return out->async_write(message, executor);
+	}
+
+	template <typename Executor>
+	auto async_timed_read(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration,
+			Executor & executor) {
+		return in->async_timed_read(message, duration, executor);
+	}
+
+	template <typename Executor>
+	auto async_timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration,
+			Executor & executor) {
+		return out->async_timed_write(message, duration, executor);
+	}
+#endif
+
+	std::size_t read_msg_count() {
+		return in->msg_count();
+	}
+
+	std::size_t write_msg_count() {
+		return out->msg_count();
+	}
+
+	// Closes the queue this endpoint writes into.
+	void close() {
+		out->close();
+	}
+
+	// Whether the queue this endpoint reads from is closed.
+	bool is_closed() {
+		return in->is_closed();
+	}
+
+	int read_ready_fd() {
+		return in->read_ready_fd();
+	}
+
+	int write_ready_fd() {
+		return out->write_ready_fd();
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+}; // channel_endpoint
+
+// global overloads for channel_endpoint - start
+template <typename T, template <typename> class Queue>
+void operator>>(std::unique_ptr<T> & message, channel_endpoint<T, Queue> & e) {
+	e.write(message);
+}
+
+template <typename T, template <typename> class Queue>
+void operator<<(std::unique_ptr<T> & message, channel_endpoint<T, Queue> & e) {
+	message = e.read();
+}
+// global overloads for channel_endpoint - end
+
+// The Queue template parameter selects the queue type used for both
+// directions of a channel. It defaults to circular_queue, and it can
+// be any class template providing the circular_queue interface, such
+// as mpmc_queue.
+template <typename T, template <typename> class Queue = circular_queue>
+class channel {
+private:
+	friend class selector;
+
+	class thr_safe_set {
+	private:
+		std::unordered_set<std::thread::id> owner_ids;
+		std::shared_mutex rw_mutex;
+
+	public:
+		thr_safe_set() {} // For the empty sets
+
+		thr_safe_set(const std::thread::id _id) {
+			owner_ids.insert(_id);
+		}
+
+		bool present(const std::thread::id _id) {
+			std::shared_lock<std::shared_mutex> r_guard(rw_mutex);
+			return owner_ids.find(_id) != owner_ids.end();
+		}
+
+		void add(const std::thread::id _id) {
+			std::lock_guard<std::shared_mutex> w_guard(rw_mutex);
+			owner_ids.insert(_id);
+		}
+
+		void remove(const std::thread::id _id) {
+			std::lock_guard<std::shared_mutex> w_guard(rw_mutex);
+			owner_ids.erase(_id);
+		}
+	}; // thr_safe_set
+
+	thr_safe_set read_owners;
+	thr_safe_set write_owners;
+
+	thr_safe_set non_readers;
+	thr_safe_set non_writers;
+
+	Queue<T> worker_to_read_owner_queue;
+	Queue<T> write_owner_to_worker_queue;
+
+	void assert_read_allowance(const std::thread::id _id) {
+		if (non_readers.present(_id)) {
+			std::cerr << "A non-reader thread can not read anymore:"
+					<< _id << std::endl;
+			abort();
+		}
+	}
+
+	void assert_write_allowance(const std::thread::id _id) {
+		if (non_writers.present(_id)) {
+			std::cerr << "A non-writer thread can not write anymore:"
+					<< _id << std::endl;
+			abort();
+		}
+	}
+
+	// The queue the calling thread reads from.
+	Queue<T> & reading_queue() {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+
+		if (read_owners.present(_id)) {
+			return worker_to_read_owner_queue;
+		} else {
+			return write_owner_to_worker_queue;
+		}
+	}
+
+	// The queue the calling thread writes into.
+	Queue<T> & writing_queue() {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+
+		if (write_owners.present(_id)) {
+			return write_owner_to_worker_queue;
+		} else {
+			return worker_to_read_owner_queue;
+		}
+	}
+
+public:
+	channel(int read_q_size = 1, int write_q_size = 0) :
+		read_owners(std::this_thread::get_id()),
+		write_owners(std::this_thread::get_id()),
+		worker_to_read_owner_queue(read_q_size),
+		write_owner_to_worker_queue(
+				write_q_size == 0 ? read_q_size:write_q_size)
+	{}
+
+	// Sets the wait strategy of both of the queues of the channel.
+	channel(int read_q_size, int write_q_size, wait_strategy strategy) :
+		read_owners(std::this_thread::get_id()),
+		write_owners(std::this_thread::get_id()),
+		worker_to_read_owner_queue(read_q_size, strategy),
+		write_owner_to_worker_queue(
+				write_q_size == 0 ? read_q_size:write_q_size, strategy)
+	{}
+
+	typedef channel_endpoint<T, Queue> endpoint;
+
+	typedef struct stats_s {
+		// The queue the write owners write into and the workers read.
+		queue_stats to_workers;
+		// The queue the workers write into and the read owners read.
+		queue_stats to_owners;
+	} stats;
+
+	channel & operator=(channel && c) {
+		read_owners = std::move(c.read_owners);
+		write_owners = std::move(c.write_owners);
+		non_readers = std::move(c.non_readers);
+		non_writers = std::move(c.non_writers);
+		write_owner_to_worker_queue = std::move(c.write_owner_to_worker_queue);
+		worker_to_read_owner_queue = std::move(c.worker_to_read_owner_queue);
+
+		return *this;
+	}
+
+	std::unique_ptr<T> read() {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+
+		if (read_owners.present(_id)) {
+			return worker_to_read_owner_queue.read();
+		} else {
+			return write_owner_to_worker_queue.read();
+		}
+	}
+
+	// Returns false if the queue to read from is closed and drained.
+	bool read(std::unique_ptr<T> & message) {
+		return reading_queue().read(message);
+	}
+
+	// Returns false if the queue to write into is closed.
+	bool write(std::unique_ptr<T> & message) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+
+		if (write_owners.present(_id)) {
+			return write_owner_to_worker_queue.write(message);
+		} else {
+			return worker_to_read_owner_queue.write(message);
+		}
+	}
+
+	// Only for the queues with priority levels, e.g. priority_channel.
+	bool write(std::unique_ptr<T> & message, const int level) {
+		return writing_queue().write(message, level);
+	}
+
+	void operator>>(std::unique_ptr<T> & message) {
+		message = read();
+	}
+
+	void operator<<(std::unique_ptr<T> & message) {
+		write(message);
+	}
+
+	std::unique_ptr<T> try_reading() {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+
+		if (read_owners.present(_id)) {
+			return worker_to_read_owner_queue.try_reading();
+		} else {
+			return write_owner_to_worker_queue.try_reading();
+		}
+	}
+
+	bool try_reading(std::unique_ptr<T> & message) {
+		return reading_queue().try_reading(message);
+	}
+
+	std::unique_ptr<T> timed_read(
+			const std::chrono::system_clock::duration duration,
+			bool & timed_out) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+
+		if (read_owners.present(_id)) {
+			return worker_to_read_owner_queue.timed_read(duration, timed_out);
+		} else {
+			return write_owner_to_worker_queue.timed_read(duration, timed_out);
+		}
+	}
+
+	std::size_t read_msg_count() {
+		if (read_owners.present(std::this_thread::get_id())) {
+			return worker_to_read_owner_queue.msg_count();
+		} else {
+			return write_owner_to_worker_queue.msg_count();
+		}
+	}
+
+	bool try_writing(std::unique_ptr<T> & message) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+
+		if (write_owners.present(_id)) {
+			return write_owner_to_worker_queue.try_writing(message);
+		} else {
+			return worker_to_read_owner_queue.try_writing(message);
+		}
+	}
+
+	bool timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+
+		if (write_owners.present(_id)) {
+			return write_owner_to_worker_queue.timed_write(message, duration);
+		} else {
+			return worker_to_read_owner_queue.timed_write(message, duration);
+		}
+	}
+
+	template <typename InputIt>
+	std::size_t write_bulk(InputIt first, InputIt last) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+
+		if (write_owners.present(_id)) {
+			return write_owner_to_worker_queue.write_bulk(first, last);
+		} else {
+			return worker_to_read_owner_queue.write_bulk(first, last);
+		}
+	}
+
+	template <typename InputIt>
+	std::size_t try_write_bulk(InputIt first, InputIt last) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+
+		if (write_owners.present(_id)) {
+			return write_owner_to_worker_queue.try_write_bulk(first, last);
+		} else {
+			return worker_to_read_owner_queue.try_write_bulk(first, last);
+		}
+	}
+
+	template <typename OutputIt>
+	std::size_t read_bulk(OutputIt out, const std::size_t max) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+
+		if (read_owners.present(_id)) {
+			return worker_to_read_owner_queue.read_bulk(out, max);
+		} else {
+			return write_owner_to_worker_queue.read_bulk(out, max);
+		}
+	}
+
+	template <typename OutputIt>
+	std::size_t try_read_bulk(OutputIt out, const std::size_t max) {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+
+		if (read_owners.present(_id)) {
+			return worker_to_read_owner_queue.try_read_bulk(out, max);
+		} else {
+			return write_owner_to_worker_queue.try_read_bulk(out, max);
+		}
+	}
+
+#if defined(THREAD_COMM_COROUTINES)
+	// See circular_queue::async_read(). The queue is chosen by the roles
+	// of the thread that creates the awaitable, so a coroutine that may
+	// be resumed on another thread is better off with an endpoint.
+	template <typename Executor>
+	auto async_read(std::unique_ptr<T> & message, Executor & executor) {
+		return reading_queue().async_read(message, executor);
+	}
+
+	template <typename Executor>
+	auto async_write(std::unique_ptr<T> & message, Executor & executor) {
+		return writing_queue().async_write(message, executor);
+	}
+
+	template <typename Executor>
+	auto async_timed_read(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration,
+			Executor & executor) {
+		return reading_queue().async_timed_read(message, duration, executor);
+	}
+
+	template <typename Executor>
+	auto async_timed_write(std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration duration,
+			Executor & executor) {
+		return writing_queue().async_timed_write(message, duration, executor);
+	}
+#endif
+
+	std::size_t write_msg_count() {
+		if (write_owners.present(std::this_thread::get_id())) {
+			return write_owner_to_worker_queue.msg_count();
+		} else {
+			return worker_to_read_owner_queue.msg_count();
+		}
+	}
+
+	// The statistics of both of the queues, to tell which direction of
+	// a channel is starving or saturated. All zeros unless
+	// THREAD_COMM_METRICS is defined.
+	stats statistics() const {
+		return stats{write_owner_to_worker_queue.statistics(),
+				worker_to_read_owner_queue.statistics()};
+	}
+
+	// The endpoint of the owners: it writes to the workers and reads
+	// what the workers send back.
+	endpoint owner_end() {
+		return endpoint(worker_to_read_owner_queue,
+				write_owner_to_worker_queue);
+	}
+
+	// The endpoint of the workers: it reads what the owners write and
+	// writes back to them.
+	endpoint worker_end() {
+		return endpoint(write_owner_to_worker_queue,
+				worker_to_read_owner_queue);
+	}
+
+	// A channel can be closed one direction at a time, which allows a
+	// pipeline to shut down stage by stage: once the write owners are
+	// done, close_to_workers() lets the workers drain what's left and
+	// see the channel closed. Once the workers are done as well,
+	// close_to_owners() does the same for the read owners. These can be
+	// called by any thread regardless of its roles.
+	void close_to_workers() {
+		write_owner_to_worker_queue.close();
+	}
+
+	void close_to_owners() {
+		worker_to_read_owner_queue.close();
+	}
+
+	void close() {
+		close_to_workers();
+		close_to_owners();
+	}
+
+	// See circular_queue::read_ready_fd(). These return the descriptors
+	// of the queues the calling thread reads from and writes into.
+	int read_ready_fd() {
+		return reading_queue().read_ready_fd();
+	}
+
+	int write_ready_fd() {
+		return writing_queue().write_ready_fd();
+	}
+
+	// Whether the queue the calling thread reads from is closed.
+	bool is_closed() {
+		if (read_owners.present(std::this_thread::get_id())) {
+			return worker_to_read_owner_queue.is_closed();
+		} else {
+			return write_owner_to_worker_queue.is_closed();
+		}
+	}
+
+	void become_a_non_reader() {
+		read_owners.remove(std::this_thread::get_id());
+		non_readers.add(std::this_thread::get_id());
+	}
+
+	void become_a_non_writer() {
+		write_owners.remove(std::this_thread::get_id());
+		non_writers.add(std::this_thread::get_id());
+	}
+
+	void become_a_read_owner() {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_read_allowance(_id);
+		read_owners.add(_id);
+	}
+
+	void become_a_write_owner() {
+		const std::thread::id _id = std::this_thread::get_id();
+		assert_write_allowance(_id);
+		write_owners.add(_id);
+	}
+}; // channel
+
+// global overloads for channel - start
+template <typename T, template <typename> class Queue>
+void operator>>(std::unique_ptr<T> & message, channel<T, Queue> & c) {
+	c.write(message);
+}
+
+template <typename T, template <typename> class Queue>
+void operator<<(std::unique_ptr<T> & message, channel<T, Queue> & c) {
+	message = c.read();
+}
+// global overloads for channel - end
+
+// A channel whose both directions are lock-free mpmc_queues.
+template <typename T>
+using mpmc_channel = channel<T, mpmc_queue>;
+
+// A channel whose both directions are segmented_queues. Its queue sizes
+// are the limits of the segmented queues, so segmented_channel<T> c(0)
+// is unbounded in both directions.
+template <typename T>
+using segmented_channel = channel<T, segmented_queue>;
+
+// A channel whose both directions are priority_circular_queues with two
+// levels: 0 for the control messages and 1 for the data. write(msg)
+// sends data, and write(msg, 0) sends a control message that overtakes
+// the data backlog.
+template <typename T>
+using priority_channel = channel<T, priority_circular_queue>;
+
+// A channel whose both directions are sharded_queues, for the channels
+// with many workers on both sides. Its queue sizes are split over the
+// shards.
+template <typename T>
+using sharded_channel = channel<T, sharded_queue>;
+
+// partitioned_channel is a channel whose workers keep the messages of a
+// key in order. The messages are routed by the hash of their key into
+// a fixed number of partitions, and every partition belongs to exactly
+// one of the workers, so the messages of a key are all read by the same
+// worker, one at a time, in the order they were written. The workers
+// join() and leave at any time, and the partitions are rebalanced
+// between them each time, moving as few of them as possible.
+// A partition changes hands only at a read boundary: the worker that
+// read the last message of a partition is deemed to be handling it
+// until its next read (or until it leaves), and the new owner doesn't
+// get the next message of the partition before that.
+// The owners write with write() and read back what the workers write
+// with read(), as with a channel. The workers read and write through
+// the worker handles that join() returns, which must not outlive the
+// channel. Every partition holds up to partition_size messages, and a
+// writer only blocks while the partition of its message is full.
+template <typename T>
+class partitioned_channel {
+public:
+	typedef std::function<std::size_t(const T &)> key_hash;
+
+private:
+	static constexpr std::size_t nobody = static_cast<std::size_t>(-1);
+
+	typedef struct partition_s {
+		std::deque<std::unique_ptr<T>> messages;
+		std::size_t owner;
+		// Whether a worker is still handling the last message it read
+		// from this partition.
+		bool in_flight;
+
+		partition_s() : owner(nobody), in_flight(false) {}
+	} partition;
+
+	typedef struct worker_state_s {
+		std::condition_variable cond;
+		std::vector<std::size_t> partitions;
+		// Where the next read starts looking, so that the partitions of
+		// a worker take turns.
+		std::size_t next;
+		// The partition of the message the worker is handling.
+		std::size_t current;
+
+		worker_state_s() : next(0), current(nobody) {}
+	} worker_state;
+
+	const key_hash hash;
+	const std::size_t partition_size;
+
+	std::mutex protector;
+	std::condition_variable write_cond;
+	std::vector<partition> partitions;
+	// Keyed by the worker ids, which are never reused.
+	std::map<std::size_t, std::unique_ptr<worker_state>> workers;
+	std::size_t next_worker_id;
+	bool closed;
+
+	circular_queue<T> worker_to_owner_queue;
+
+	void _wake(const std::size_t p) {
+		partition & part = partitions[p];
+		if (part.owner != nobody && !part.in_flight && !part.messages.empty()) {
+			workers[part.owner]->cond.notify_one();
+		}
+	}
+
+	// The worker is done with the message it read last.
+	void _release(worker_state & w) {
+		if (w.current == nobody) {
+			return;
+		}
+
+		const std::size_t p = w.current;
+		partitions[p].in_flight = false;
+		w.current = nobody;
+
+		// The partition may have been handed over in the meantime.
+		_wake(p);
+	}
+
+	bool _take(worker_state & w, std::unique_ptr<T> & message) {
+		const std::size_t n = w.partitions.size();
+
+		for (std::size_t i = 0 ; i < n ; ++i) {
+			const std::size_t p = w.partitions[(w.next + i) % n];
+			partition & part = partitions[p];
+
+			if (part.in_flight || part.messages.empty()) {
+				continue;
+			}
+
+			if (part.messages.size() == partition_size) {
+				write_cond.notify_all();
+			}
+
+			message = std::move(part.messages.front());
+			part.messages.pop_front();
+			part.in_flight = true;
+
+			w.current = p;
+			w.next = (w.next + i + 1) % n;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	bool _drained(const worker_state & w) {
+		for (std::size_t p : w.partitions) {
+			if (!partitions[p].messages.empty()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Hands the partitions without an owner to the workers with the
+	// fewest partitions, and then moves partitions from the busiest
+	// workers to the idlest ones until they differ by at most one.
+	void _rebalance() {
+		if (workers.empty()) {
+			for (auto & part : partitions) {
+				part.owner = nobody;
+			}
+			return;
+		}
+
+		auto least = [this] () {
+			auto it = workers.begin();
+			for (auto i = workers.begin() ; i != workers.end() ; ++i) {
+				if (i->second->partitions.size() < it->second->partitions.size()) {
+					it = i;
+				}
+			}
+			return it;
+		};
+
+		auto most = [this] () {
+			auto it = workers.begin();
+			for (auto i = workers.begin() ; i != workers.end() ; ++i) {
+				if (i->second->partitions.size() > it->second->partitions.size()) {
+					it = i;
+				}
+			}
+			return it;
+		};
+
+		for (std::size_t p = 0 ; p < partitions.size() ; ++p) {
+			if (workers.find(partitions[p].owner) == workers.end()) {
+				auto to = least();
+				partitions[p].owner = to->first;
+				to->second->partitions.push_back(p);
+			}
+		}
+
+		while (true) {
+			auto from = most();
+			auto to = least();
+			if (from->second->partitions.size() <=
+					to->second->partitions.size() + 1) {
+				break;
+			}
+
+			const std::size_t p = from->second->partitions.back();
+			from->second->partitions.pop_back();
+			to->second->partitions.push_back(p);
+			partitions[p].owner = to->first;
+		}
+
+		for (std::size_t p = 0 ; p < partitions.size() ; ++p) {
+			_wake(p);
+		}
+	}
+
+	bool _write(std::unique_ptr<T> & message,
+			std::unique_lock<std::mutex> & ulock,
+			const std::chrono::system_clock::duration * duration = nullptr) {
+		if (!message) {
+			std::cerr << "thread_comm::partitioned_channel - a null message "
+					"has no key" << std::endl;
+			std::abort();
+		}
+
+		const std::size_t p = hash(*message) % partitions.size();
+		auto ready = [this, p] {
+			return partitions[p].messages.size() < partition_size || closed;
+		};
+
+		if (!duration) {
+			write_cond.wait(ulock, ready);
+		} else if (!write_cond.wait_for(ulock, *duration, ready)) {
+			return false;
+		}
+
+		if (closed) {
+			return false;
+		}
+
+		partitions[p].messages.push_back(std::move(message));
+		_wake(p);
+
+		return true;
+	}
+
+	bool _read(worker_state & w, std::unique_ptr<T> & message,
+			const std::chrono::system_clock::duration * duration = nullptr,
+			bool * timed_out = nullptr) {
+		std::unique_lock<std::mutex> ulock(protector);
+		_release(w);
+
+		const auto deadline = std::chrono::steady_clock::now() +
+				(duration ? *duration : std::chrono::system_clock::duration(0));
+
+		while (!_take(w, message)) {
+			if (closed && _drained(w)) {
+				return false;
+			}
+
+			if (!duration) {
+				w.cond.wait(ulock);
+			} else if (w.cond.wait_until(ulock, deadline) ==
+					std::cv_status::timeout) {
+				if (_take(w, message)) {
+					return true;
+				}
+				*timed_out = !(closed && _drained(w));
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool _try_reading(worker_state & w, std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		_release(w);
+		return _take(w, message);
+	}
+
+	void _leave(const std::size_t id) {
+		std::unique_lock<std::mutex> ulock(protector);
+		auto it = workers.find(id);
+		_release(*it->second);
+
+		for (std::size_t p : it->second->partitions) {
+			partitions[p].owner = nobody;
+		}
+
+		workers.erase(it);
+		_rebalance();
+	}
+
+	std::size_t _partition_count(const std::size_t id) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return workers[id]->partitions.size();
+	}
+
+public:
+	// The handle of a worker of a partitioned_channel. It leaves the
+	// channel when it's destroyed, or when leave() is called.
+	class worker {
+	private:
+		friend class partitioned_channel<T>;
+
+		partitioned_channel<T> * c;
+		std::size_t id;
+		worker_state * state;
+
+		worker(partitioned_channel<T> * _c, const std::size_t _id,
+				worker_state * _state) :
+			c(_c),
+			id(_id),
+			state(_state)
+		{}
+
+	public:
+		worker(worker && other) :
+			c(other.c),
+			id(other.id),
+			state(other.state) {
+			other.c = nullptr;
+		}
+
+		worker & operator=(worker && other) {
+			leave();
+			c = other.c;
+			id = other.id;
+			state = other.state;
+			other.c = nullptr;
+			return *this;
+		}
+
+		worker(const worker &) = delete;
+		worker & operator=(const worker &) = delete;
+
+		~worker() {
+			leave();
+		}
+
+		// The partitions of this worker go to the other workers, or wait
+		// for the next one to join if there are none.
+		void leave() {
+			if (c) {
+				c->_leave(id);
+				c = nullptr;
+			}
+		}
+
+		// Returns false if the channel is closed to the workers and this
+		// worker's partitions are drained.
+		bool read(std::unique_ptr<T> & message) {
+			return c->_read(*state, message);
+		}
+
+		std::unique_ptr<T> read() {
+			std::unique_ptr<T> m;
+			read(m);
+			return m;
+		}
+
+		std::unique_ptr<T> timed_read(
+				const std::chrono::system_clock::duration duration,
+				bool & timed_out) {
+			std::unique_ptr<T> m;
+			timed_out = false;
+			c->_read(*state, m, &duration, &timed_out);
+			return m;
+		}
+
+		bool try_reading(std::unique_ptr<T> & message) {
+			return c->_try_reading(*state, message);
+		}
+
+		// Sends a message back to the owners.
+		bool write(std::unique_ptr<T> & message) {
+			return c->worker_to_owner_queue.write(message);
+		}
+
+		std::size_t partition_count() {
+			return c->_partition_count(id);
+		}
+	}; // worker
+
+	partitioned_channel(key_hash _hash, int partition_count = 64,
+			int _partition_size = 64, int read_q_size = 64) :
+		hash(std::move(_hash)),
+		partition_size(static_cast<std::size_t>(_partition_size)),
+		partitions(partition_count > 0 ? partition_count : 0),
+		next_worker_id(0),
+		closed(false),
+		worker_to_owner_queue(read_q_size) {
+		if (partition_count <= 0 || _partition_size <= 0) {
+			std::cerr << "thread_comm::partitioned_channel - partition count "
+					"and partition size must be positive" << std::endl;
+			std::abort();
+		}
+	}
+
+	partitioned_channel(const partitioned_channel<T> &) = delete;
+	partitioned_channel<T>& operator=(const partitioned_channel<T> &) = delete;
+
+	worker join() {
+		std::unique_lock<std::mutex> ulock(protector);
+		const std::size_t id = next_worker_id++;
+		auto state = std::make_unique<worker_state>();
+		worker_state * raw = state.get();
+
+		workers.emplace(id, std::move(state));
+		_rebalance();
+
+		return worker(this, id, raw);
+	}
+
+	// Returns false if the channel is closed to the workers. A null
+	// message has no key, so writing one aborts.
+	bool write(std::unique_ptr<T> & message) {
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, ulock);
+	}
 
 	bool timed_write(std::unique_ptr<T> & message,
 			const std::chrono::system_clock::duration duration) {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_write_allowance(_id);
+		std::unique_lock<std::mutex> ulock(protector);
+		return _write(message, ulock, &duration);
+	}
+
+	// Reads what the workers have sent back.
+	bool read(std::unique_ptr<T> & message) {
+		return worker_to_owner_queue.read(message);
+	}
+
+	std::unique_ptr<T> read() {
+		return worker_to_owner_queue.read();
+	}
+
+	bool try_reading(std::unique_ptr<T> & message) {
+		return worker_to_owner_queue.try_reading(message);
+	}
+
+	// See channel::close_to_workers().
+	void close_to_workers() {
+		std::unique_lock<std::mutex> ulock(protector);
+		closed = true;
+
+		write_cond.notify_all();
+		for (auto & w : workers) {
+			w.second->cond.notify_all();
+		}
+	}
+
+	void close_to_owners() {
+		worker_to_owner_queue.close();
+	}
+
+	std::size_t partition_of(const T & message) const {
+		return hash(message) % partitions.size();
+	}
+
+	std::size_t worker_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return workers.size();
+	}
+
+	// The number of messages waiting for the workers.
+	std::size_t msg_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		std::size_t n = 0;
+		for (auto & part : partitions) {
+			n += part.messages.size();
+		}
+		return n;
+	}
+}; // partitioned_channel
+
+namespace detail {
+// A message on its way to the workers of an ordered_channel, with the
+// sequence number it got from its write owner.
+template <typename T>
+struct sequenced {
+	std::uint64_t seq;
+	std::unique_ptr<T> message;
+};
+} // namespace detail
+
+// ordered_channel is a channel for the producer -> worker -> collector
+// topology that hands the results to the collectors (the read owners)
+// in the order the producers (the write owners) wrote the messages,
+// however the workers race each other. Every message gets a sequence
+// number when it's written, the workers carry it through, and a reorder
+// window puts the results back in sequence before they are read.
+// The window holds window results at most: when the oldest message
+// still in the pipeline holds it up, the write owners block (or their
+// try_writing() fails) until that message comes out, so the reordering
+// never takes more memory than that.
+// Workers use the handles of worker_end(): a worker reads a message,
+// and writes its result back through the same handle. A worker that
+// doesn't have a result for a message (a filter, say) calls skip(), so
+// that the window doesn't wait for it. Reading the next message, or
+// destroying the handle, skips the current one as well.
+template <typename T>
+class ordered_channel {
+private:
+	typedef enum class slot_state_e {
+		empty,
+		filled,
+		skipped
+	} slot_state;
+
+	const std::size_t window;
+
+	circular_queue<detail::sequenced<T>> to_workers;
+
+	std::mutex protector;
+	std::condition_variable read_cond;
+	std::condition_variable window_cond;
+	std::vector<std::unique_ptr<T>> results;
+	std::vector<slot_state> states;
+	// The sequence number of the next message to write, and of the next
+	// result to read.
+	std::uint64_t next_in;
+	std::uint64_t next_out;
+	bool closed_to_workers;
+	bool closed_to_owners;
+
+	bool _window_full() {
+		return next_in >= next_out + window;
+	}
+
+	// A result that comes in after the readers gave up on it (closing
+	// the channel to the owners moves next_out past the missing ones)
+	// is dropped, since its slot may belong to a later message by now.
+	void _resolve(const std::uint64_t seq, std::unique_ptr<T> * result) {
+		std::unique_ptr<T> late;
+		std::unique_lock<std::mutex> ulock(protector);
+		const std::size_t i = seq % window;
+
+		if (seq < next_out) {
+			if (result) {
+				late = std::move(*result);
+			}
+			return;
+		}
+
+		if (result) {
+			results[i] = std::move(*result);
+			states[i] = slot_state::filled;
+		} else {
+			states[i] = slot_state::skipped;
+		}
+
+		if (seq == next_out) {
+			read_cond.notify_one();
+		}
+	}
+
+	bool _write(std::unique_ptr<T> & message, const bool wait) {
+		std::uint64_t seq;
+		{
+			std::unique_lock<std::mutex> ulock(protector);
+			auto ready = [this] { return !_window_full() || closed_to_workers; };
+
+			if (wait) {
+				window_cond.wait(ulock, ready);
+			} else if (!ready()) {
+				return false;
+			}
+
+			if (closed_to_workers) {
+				return false;
+			}
+
+			seq = next_in++;
+		}
+
+		auto s = std::make_unique<detail::sequenced<T>>();
+		s->seq = seq;
+		s->message = std::move(message);
+
+		if (!to_workers.write(s)) {
+			message = std::move(s->message);
+			_resolve(seq, nullptr);
+			return false;
+		}
+
+		return true;
+	}
+
+	// Moves past the skipped results and, once the channel is closed to
+	// the owners, past the ones that will never come.
+	bool _read(std::unique_ptr<T> & message, const bool wait) {
+		std::unique_lock<std::mutex> ulock(protector);
+
+		while (true) {
+			const std::size_t i = next_out % window;
+
+			if (states[i] == slot_state::filled && next_out < next_in) {
+				message = std::move(results[i]);
+				states[i] = slot_state::empty;
+				++next_out;
+				window_cond.notify_all();
+				return true;
+			}
+
+			if (states[i] == slot_state::skipped ||
+					(closed_to_owners && next_out < next_in)) {
+				states[i] = slot_state::empty;
+				++next_out;
+				window_cond.notify_all();
+				continue;
+			}
+
+			if (closed_to_owners || !wait) {
+				return false;
+			}
+
+			read_cond.wait(ulock);
+		}
+	}
+
+public:
+	// The handle a worker reads and writes through. It must not outlive
+	// its channel, and it must only be used by one thread at a time.
+	class worker {
+	private:
+		friend class ordered_channel<T>;
+
+		ordered_channel<T> * c;
+		std::optional<std::uint64_t> current;
+
+		worker(ordered_channel<T> * _c) : c(_c) {}
+
+	public:
+		worker(worker && other) :
+			c(other.c),
+			current(other.current) {
+			other.current.reset();
+		}
+
+		worker(const worker &) = delete;
+		worker & operator=(const worker &) = delete;
+
+		~worker() {
+			skip();
+		}
+
+		// Returns false if the channel is closed to the workers and
+		// drained.
+		bool read(std::unique_ptr<T> & message) {
+			skip();
+
+			std::unique_ptr<detail::sequenced<T>> s;
+			if (!c->to_workers.read(s)) {
+				return false;
+			}
+
+			current = s->seq;
+			message = std::move(s->message);
+			return true;
+		}
+
+		std::unique_ptr<T> read() {
+			std::unique_ptr<T> m;
+			read(m);
+			return m;
+		}
+
+		// The result of the message read last. Aborts if there is no
+		// such message.
+		void write(std::unique_ptr<T> & result) {
+			if (!current) {
+				std::cerr << "thread_comm::ordered_channel - a worker can only "
+						"write once for every message it reads" << std::endl;
+				std::abort();
+			}
+
+			c->_resolve(*current, &result);
+			current.reset();
+		}
+
+		// Lets the window go on without a result for the message read
+		// last.
+		void skip() {
+			if (current) {
+				c->_resolve(*current, nullptr);
+				current.reset();
+			}
+		}
+	}; // worker
+
+	// The queue to the workers holds write_q_size messages, or window
+	// messages if that is zero.
+	ordered_channel(int _window = 64, int write_q_size = 0) :
+		window(static_cast<std::size_t>(_window > 0 ? _window : 1)),
+		to_workers(write_q_size > 0 ? write_q_size : window),
+		results(window),
+		states(window, slot_state::empty),
+		next_in(0),
+		next_out(0),
+		closed_to_workers(false),
+		closed_to_owners(false) {
+		if (_window <= 0 || write_q_size < 0) {
+			std::cerr << "thread_comm::ordered_channel - window must be "
+					"positive, and the queue size can not be negative"
+					<< std::endl;
+			std::abort();
+		}
+	}
+
+	ordered_channel(const ordered_channel<T> &) = delete;
+	ordered_channel<T>& operator=(const ordered_channel<T> &) = delete;
+
+	worker worker_end() {
+		return worker(this);
+	}
+
+	// Blocks while the window is full. Returns false if the channel is
+	// closed to the workers, in which case the message stays with the
+	// caller.
+	bool write(std::unique_ptr<T> & message) {
+		return _write(message, true);
+	}
+
+	// Fails when the window is full.
+	bool try_writing(std::unique_ptr<T> & message) {
+		return _write(message, false);
+	}
+
+	// Returns the results in the order of their messages. Returns false
+	// once the channel is closed to the owners and drained.
+	bool read(std::unique_ptr<T> & message) {
+		return _read(message, true);
+	}
+
+	std::unique_ptr<T> read() {
+		std::unique_ptr<T> m;
+		read(m);
+		return m;
+	}
+
+	// Fails when the next result in order isn't there yet, even if later
+	// ones are.
+	bool try_reading(std::unique_ptr<T> & message) {
+		return _read(message, false);
+	}
+
+	// See channel::close_to_workers().
+	void close_to_workers() {
+		{
+			std::unique_lock<std::mutex> ulock(protector);
+			closed_to_workers = true;
+			window_cond.notify_all();
+		}
+		to_workers.close();
+	}
+
+	// The results that are still missing by now are given up on, and
+	// the readers get the rest in order.
+	void close_to_owners() {
+		std::unique_lock<std::mutex> ulock(protector);
+		closed_to_owners = true;
+		read_cond.notify_all();
+	}
+
+	// The number of results that are waiting in the window.
+	std::size_t msg_count() {
+		std::unique_lock<std::mutex> ulock(protector);
+		return static_cast<std::size_t>(std::count(states.begin(), states.end(),
+				slot_state::filled));
+	}
+}; // ordered_channel
+
+// The numbers a pipeline keeps for each of its stages. messages_out
+// counts what the stage passed on to the next one, so a stage that
+// filters shows less out than in, and busy_time is the time spent in
+// the stage's function on all of its threads together. input is the
+// statistics() of the queue in front of the stage, and stays empty
+// for the source and when THREAD_COMM_METRICS isn't defined, and for
+// the stages that are fused, which run on the threads of the stage
+// before them and have no queue of their own.
+typedef struct stage_stats_s {
+	std::string name;
+	int parallelism;
+	bool fused;
+	std::uint64_t messages_in;
+	std::uint64_t messages_out;
+	std::chrono::nanoseconds busy_time;
+	queue_stats input;
+} stage_stats;
+
+class pipeline;
+
+template <typename T>
+class pipeline_builder;
+
+namespace detail {
+typedef struct stage_counters_s {
+	std::string name;
+	int parallelism = 1;
+	bool fused = false;
+	std::atomic<std::uint64_t> messages_in{0};
+	std::atomic<std::uint64_t> messages_out{0};
+	std::atomic<std::int64_t> busy_nanoseconds{0};
+	std::function<queue_stats()> input;
+
+	void busy_since(const std::chrono::steady_clock::time_point start) {
+		busy_nanoseconds.fetch_add(std::chrono::duration_cast<
+				std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+				start).count(), std::memory_order_relaxed);
+	}
+
+	// Runs f on the message, and counts it.
+	template <typename F, typename M>
+	auto process(F & f, std::unique_ptr<M> & message) {
+		const auto start = std::chrono::steady_clock::now();
+		messages_in.fetch_add(1, std::memory_order_relaxed);
+
+		if constexpr (std::is_void_v<decltype(f(std::move(message)))>) {
+			f(std::move(message));
+			busy_since(start);
+		} else {
+			auto result = f(std::move(message));
+			busy_since(start);
+			if (result) {
+				messages_out.fetch_add(1, std::memory_order_relaxed);
+			}
+			return result;
+		}
+	}
+} stage_counters;
+
+// The threads of a segment run body, and the last one out runs done,
+// which closes the queue behind the segment.
+typedef struct pipeline_segment_s {
+	std::string name;
+	int parallelism;
+	std::function<void()> body;
+	std::function<void()> done;
+	std::atomic<int> running{0};
+} pipeline_segment;
+} // namespace detail
+
+template <typename F>
+class source_spec {
+private:
+	template <typename T>
+	friend class pipeline_builder;
+
+	F f;
+	std::string name;
+
+public:
+	source_spec(F _f) : f(std::move(_f)), name("source") {}
+
+	source_spec<F> && named(std::string _name) && {
+		name = std::move(_name);
+		return std::move(*this);
+	}
+};
+
+template <typename F>
+class stage_spec {
+private:
+	template <typename T>
+	friend class pipeline_builder;
+
+	F f;
+	int parallelism;
+	int queue_size;
+	std::string name;
+	std::optional<bool> fuse;
+
+public:
+	stage_spec(F _f, int _parallelism, int _queue_size) :
+		f(std::move(_f)),
+		parallelism(_parallelism),
+		queue_size(_queue_size) {
+		if (parallelism <= 0 || queue_size <= 0) {
+			std::cerr << "thread_comm::stage - parallelism and queue size must "
+					"be positive" << std::endl;
+			std::abort();
+		}
+	}
+
+	stage_spec<F> && named(std::string _name) && {
+		name = std::move(_name);
+		return std::move(*this);
+	}
+
+	// A fusible stage runs on the threads of the stage before it when
+	// both stages have the same parallelism, and fusible(false) keeps it
+	// on its own threads even when both have a single thread. A stage
+	// is never fused onto more threads than it asked for, since its f
+	// needn't be thread safe then.
+	stage_spec<F> && fusible(const bool _fuse = true) && {
+		fuse = _fuse;
+		return std::move(*this);
+	}
+};
+
+// The first stage of a pipeline. f takes no arguments and returns a
+// unique pointer to the next message, or nullptr when there are no
+// more. It runs on a single thread.
+template <typename F>
+source_spec<F> source(F f) {
+	return source_spec<F>(std::move(f));
+}
+
+// A stage that runs f on parallelism threads, with a queue of
+// queue_size messages in front of it. f takes a unique pointer to a
+// message and returns one to its result, or nullptr to drop it. It's
+// called by all of the stage's threads at once, so it must be thread
+// safe when parallelism is more than one.
+template <typename F>
+stage_spec<F> stage(F f, int parallelism = 1, int queue_size = 64) {
+	return stage_spec<F>(std::move(f), parallelism, queue_size);
+}
+
+// The last stage of a pipeline. Same as stage(), except that f returns
+// nothing.
+template <typename F>
+stage_spec<F> sink(F f, int parallelism = 1, int queue_size = 64) {
+	return stage_spec<F>(std::move(f), parallelism, queue_size);
+}
+
+// A pipeline is put together from a source, any number of stages and a
+// sink with operator|, for example
+//
+//	auto p = thread_comm::source(read_line)
+//			| thread_comm::stage(parse, 8)
+//			| thread_comm::sink(store);
+//	p.run();
+//
+// which creates the queues between the stages, a thread for the source,
+// eight for parse and one for store. Each stage closes the queue behind
+// it once its input is drained, so the pipeline shuts itself down when
+// the source runs out of messages.
+// A hop through a queue costs a lock, a wake up and often a context
+// switch, which is a waste between two stages that run on a thread
+// each anyway. Those stages, and the ones marked fusible() that have
+// the parallelism of the stage before them, are fused while the
+// pipeline is built: the stage is called directly, on the thread that
+// has just run the stage before it, so source(read_line) |
+// stage(parse) | sink(store) runs on a single thread.
+// pipeline_builder<T> is what the stages so far add up to, with T being
+// the type of the messages they put out.
+template <typename T>
+class pipeline_builder {
+private:
+	template <typename U>
+	friend class pipeline_builder;
+
+	friend class pipeline;
+
+	typedef std::function<bool(std::unique_ptr<T> &)> emitter;
+
+	std::vector<std::unique_ptr<detail::pipeline_segment>> segments;
+	std::vector<std::shared_ptr<detail::stage_counters>> stages;
+	std::shared_ptr<std::atomic<bool>> stopping;
+
+	// The last segment stays open until the stage after it is added,
+	// which decides where its messages go.
+	int open_parallelism;
+	std::string open_name;
+	std::function<std::function<void()>(emitter)> open;
+
+	pipeline_builder() {}
+
+	template <typename F>
+	bool _fuses(const stage_spec<F> & spec) const {
+		if (spec.parallelism != open_parallelism) {
+			return false;
+		}
+		return spec.fuse ? *spec.fuse : spec.parallelism == 1;
+	}
+
+	void _close_segment(emitter emit, std::function<void()> done) {
+		auto segment = std::make_unique<detail::pipeline_segment>();
+		segment->name = open_name;
+		segment->parallelism = open_parallelism;
+		segment->body = open(std::move(emit));
+		segment->done = std::move(done);
+		segments.push_back(std::move(segment));
+	}
+
+	std::shared_ptr<detail::stage_counters> _counters(const std::string & name,
+			const int parallelism) {
+		auto counters = std::make_shared<detail::stage_counters>();
+		counters->name = name.empty() ? "stage " + std::to_string(stages.size()) :
+				name;
+		counters->parallelism = parallelism;
+		return counters;
+	}
+
+	// Puts a queue after the open segment, and starts a new segment that
+	// reads from it.
+	// step runs the stage's function on a message.
+	template <typename U, typename F, typename Step>
+	pipeline_builder<U> _then(stage_spec<F> && spec, Step step) {
+		auto q = std::make_shared<circular_queue<T>>(spec.queue_size);
+		_close_segment([q] (std::unique_ptr<T> & message) {
+			return q->write(message);
+		}, [q] {
+			q->close();
+		});
+
+		auto counters = _counters(spec.name, spec.parallelism);
+		counters->input = [q] {
+			return q->statistics();
+		};
+
+		pipeline_builder<U> next;
+		next.segments = std::move(segments);
+		next.stages = std::move(stages);
+		next.stages.push_back(counters);
+		next.stopping = std::move(stopping);
+		next.open_parallelism = spec.parallelism;
+		next.open_name = counters->name;
+		next.open = [q, f = std::move(spec.f), counters, step]
+				(typename pipeline_builder<U>::emitter emit) mutable {
+			return [q, f, counters, step, emit] () mutable {
+				std::unique_ptr<T> message;
+				std::unique_ptr<U> result;
+
+				while (q->read(message)) {
+					step(result, f, *counters, message);
+					if (result && !emit(result)) {
+						// Nothing is going to read what's still coming, so
+						// the stages before this one are told to stop.
+						q->close();
+						break;
+					}
+				}
+			};
+		};
+		return next;
+	}
+
+	// Adds the stage to the open segment, which passes its messages
+	// straight to it.
+	template <typename U, typename F, typename Step>
+	pipeline_builder<U> _fuse(stage_spec<F> && spec, Step step) {
+		auto counters = _counters(spec.name, open_parallelism);
+		counters->fused = true;
+
+		pipeline_builder<U> next;
+		next.segments = std::move(segments);
+		next.stages = std::move(stages);
+		next.stages.push_back(counters);
+		next.stopping = std::move(stopping);
+		next.open_parallelism = open_parallelism;
+		next.open_name = open_name + " + " + counters->name;
+		next.open = [previous = std::move(open), f = std::move(spec.f), counters,
+				step] (typename pipeline_builder<U>::emitter emit) mutable {
+			return previous([f, counters, step, emit]
+					(std::unique_ptr<T> & message) mutable {
+				std::unique_ptr<U> result;
+				step(result, f, *counters, message);
+				return !result || emit(result);
+			});
+		};
+		return next;
+	}
+
+	template <typename U, typename F, typename Step>
+	pipeline_builder<U> _add(stage_spec<F> && spec, Step step) {
+		if (_fuses(spec)) {
+			return _fuse<U>(std::move(spec), step);
+		}
+		return _then<U>(std::move(spec), step);
+	}
+
+public:
+	template <typename F>
+	pipeline_builder(source_spec<F> && spec) :
+		stopping(std::make_shared<std::atomic<bool>>(false)),
+		open_parallelism(1) {
+		auto counters = _counters(spec.name, 1);
+		stages.push_back(counters);
+		open_name = counters->name;
+		auto stop = stopping;
+		open = [f = std::move(spec.f), counters, stop] (emitter emit) mutable {
+			return [f, counters, stop, emit] () mutable {
+				while (!stop->load(std::memory_order_relaxed)) {
+					const auto start = std::chrono::steady_clock::now();
+					std::unique_ptr<T> message = f();
+					counters->busy_since(start);
+
+					if (!message) {
+						break;
+					}
+
+					counters->messages_out.fetch_add(1, std::memory_order_relaxed);
+					if (!emit(message)) {
+						break;
+					}
+				}
+			};
+		};
+	}
+
+	pipeline_builder(pipeline_builder<T> &&) = default;
+	pipeline_builder<T>& operator=(pipeline_builder<T> &&) = default;
+
+	// Adds a stage, or the sink if f returns nothing.
+	template <typename F>
+	auto operator|(stage_spec<F> && spec) && {
+		typedef std::invoke_result_t<F &, std::unique_ptr<T>> result_type;
+
+		if constexpr (std::is_void_v<result_type>) {
+			return _sink(std::move(spec));
+		} else {
+			typedef typename result_type::element_type U;
+			return _add<U>(std::move(spec), [] (std::unique_ptr<U> & result,
+					F & f, detail::stage_counters & counters,
+					std::unique_ptr<T> & message) {
+				result = counters.process(f, message);
+			});
+		}
+	}
+
+private:
+	template <typename F>
+	pipeline _sink(stage_spec<F> && spec);
+}; // pipeline_builder
+
+template <typename F, typename G>
+auto operator|(source_spec<F> && first, stage_spec<G> && second) {
+	typedef typename std::invoke_result_t<F &>::element_type T;
+	return pipeline_builder<T>(std::move(first)) | std::move(second);
+}
+
+// A pipeline that is ready to run. The threads are started by start()
+// or run(), and the destructor stops and waits for them.
+class pipeline {
+private:
+	template <typename T>
+	friend class pipeline_builder;
+
+	std::vector<std::unique_ptr<detail::pipeline_segment>> segments;
+	std::vector<std::shared_ptr<detail::stage_counters>> stages;
+	std::shared_ptr<std::atomic<bool>> stopping;
+	std::vector<std::thread> threads;
+	bool started = false;
+
+	pipeline() {}
+
+public:
+	pipeline(pipeline &&) = default;
+
+	pipeline(const pipeline &) = delete;
+	pipeline& operator=(const pipeline &) = delete;
+
+	~pipeline() {
+		if (!threads.empty()) {
+			stop();
+			wait();
+		}
+	}
 
-		if (write_owners.present(_id)) {
-			return write_owner_to_worker_queue.timed_write(message, duration);
-		} else {
-			return worker_to_read_owner_queue.timed_write(message, duration);
+	void start() {
+		if (started) {
+			std::cerr << "thread_comm::pipeline - a pipeline can only be started "
+					"once" << std::endl;
+			std::abort();
+		}
+		started = true;
+
+		for (auto & segment : segments) {
+			detail::pipeline_segment * s = segment.get();
+			s->running.store(s->parallelism);
+
+			for (int i = 0 ; i < s->parallelism ; ++i) {
+				threads.emplace_back([s] {
+					s->body();
+					if (s->running.fetch_sub(1) == 1 && s->done) {
+						s->done();
+					}
+				});
+			}
 		}
 	}
 
-	std::size_t write_msg_count() {
-		if (write_owners.present(std::this_thread::get_id())) {
-			return write_owner_to_worker_queue.msg_count();
-		} else {
-			return worker_to_read_owner_queue.msg_count();
+	// Waits until all of the messages have gone through the pipeline.
+	void wait() {
+		for (auto & t : threads) {
+			t.join();
 		}
+		threads.clear();
 	}
 
-	void become_a_non_reader() {
-		read_owners.remove(std::this_thread::get_id());
-		non_readers.add(std::this_thread::get_id());
+	void run() {
+		start();
+		wait();
 	}
 
-	void become_a_non_writer() {
-		write_owners.remove(std::this_thread::get_id());
-		non_writers.add(std::this_thread::get_id());
+	// Makes the source stop after the message it's on. The messages that
+	// are in the pipeline already still go all the way through.
+	void stop() {
+		stopping->store(true, std::memory_order_relaxed);
 	}
 
-	void become_a_read_owner() {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_read_allowance(_id);
-		read_owners.add(_id);
+	// The number of threads the pipeline runs on.
+	int thread_count() const {
+		int count = 0;
+		for (auto & segment : segments) {
+			count += segment->parallelism;
+		}
+		return count;
 	}
 
-	void become_a_write_owner() {
-		const std::thread::id _id = std::this_thread::get_id();
-		assert_write_allowance(_id);
-		write_owners.add(_id);
+	std::vector<stage_stats> statistics() const {
+		std::vector<stage_stats> result;
+
+		for (auto & counters : stages) {
+			stage_stats s;
+			s.name = counters->name;
+			s.parallelism = counters->parallelism;
+			s.fused = counters->fused;
+			s.messages_in = counters->messages_in.load(std::memory_order_relaxed);
+			s.messages_out = counters->messages_out.load(std::memory_order_relaxed);
+			s.busy_time = std::chrono::nanoseconds(
+					counters->busy_nanoseconds.load(std::memory_order_relaxed));
+			s.input = counters->input ? counters->input() : queue_stats{};
+			result.push_back(std::move(s));
+		}
+
+		return result;
 	}
-}; // channel
 
-// global overloads for channel - start
+	// Lists the threads of the pipeline, with the stages that are fused
+	// together on them, for example "source + parse: 1 thread".
+	std::string fusion_report() const {
+		std::string report;
+
+		for (auto & segment : segments) {
+			report += segment->name + ": " + std::to_string(segment->parallelism) +
+					(segment->parallelism == 1 ? " thread\n" : " threads\n");
+		}
+
+		return report;
+	}
+}; // pipeline
+
 template <typename T>
-void operator>>(std::unique_ptr<T> & message, channel<T> & c) {
-	c.write(message);
+template <typename F>
+pipeline pipeline_builder<T>::_sink(stage_spec<F> && spec) {
+	if (spec.name.empty()) {
+		spec.name = "sink";
+	}
+
+	pipeline_builder<T> last = _add<T>(std::move(spec),
+			[] (std::unique_ptr<T> &, F & f, detail::stage_counters & counters,
+			std::unique_ptr<T> & message) {
+		counters.process(f, message);
+	});
+	last._close_segment([] (std::unique_ptr<T> &) {
+		return true;
+	}, nullptr);
+
+	pipeline p;
+	p.segments = std::move(last.segments);
+	p.stages = std::move(last.stages);
+	p.stopping = std::move(last.stopping);
+	return p;
 }
 
+#if defined(THREAD_COMM_SHARED_MEMORY)
+namespace detail {
+constexpr std::uint32_t shared_ring_magic = 0x74637131;
+
+// The start of a shared_memory_queue's region. The slots come after
+// it, from the next cache line on.
+typedef struct shared_ring_header_s {
+	// Set last by the creator, so that the others know the rest of the
+	// header is ready.
+	std::atomic<std::uint32_t> magic;
+	std::uint32_t slot_size;
+	std::uint64_t capacity;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	std::uint64_t read_count;
+	std::uint64_t write_count;
+	// Waiters that die leave these too high, which only costs a signal
+	// now and then.
+	std::uint32_t readers_waiting;
+	std::uint32_t writers_waiting;
+	std::uint64_t recoveries;
+	bool closed;
+} shared_ring_header;
+} // namespace detail
+
+// shared_memory_queue is a circular_queue for processes instead of
+// threads. Its ring lives in a POSIX shared memory object, which one
+// process create()s and the others attach() to by its name (a name
+// like "/feed"), and the messages are copied into the ring and out of
+// it, so T must be trivially copyable (no pointers to the sender's
+// memory either). The ring is guarded by a robust, process-shared
+// mutex: if a process dies while it holds the mutex, the next one to
+// lock it takes over, and since a slot is only made visible after it
+// has been copied completely, the ring is still consistent then. The
+// takeovers are counted by recoveries().
+// Destroying a shared_memory_queue (or calling detach()) detaches it
+// from the region, which stays there until it's unlink()ed. A two-way
+// link between two processes takes two queues.
 template <typename T>
-void operator<<(std::unique_ptr<T> & message, channel<T> & c) {
-	message = c.read();
-}
-// global overloads for channel - end
+class shared_memory_queue {
+	static_assert(std::is_trivially_copyable_v<T>,
+			"shared_memory_queue needs a trivially copyable T");
+	static_assert(alignof(T) <= detail::cache_line_size,
+			"shared_memory_queue can't align T in its region");
+
+private:
+	detail::shared_ring_header * header;
+	T * slots;
+	std::size_t length;
+
+	shared_memory_queue(void * region, const std::size_t _length) :
+		header(static_cast<detail::shared_ring_header *>(region)),
+		slots(reinterpret_cast<T *>(static_cast<char *>(region) +
+				_slots_offset())),
+		length(_length) {}
+
+	static constexpr std::size_t _slots_offset() {
+		return (sizeof(detail::shared_ring_header) + detail::cache_line_size - 1) /
+				detail::cache_line_size * detail::cache_line_size;
+	}
+
+	static void * _map(const int fd, const std::size_t length) {
+		void * region = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		return region == MAP_FAILED ? nullptr : region;
+	}
+
+	static timespec _deadline(const std::chrono::system_clock::duration & d) {
+		const auto t = std::chrono::system_clock::now().time_since_epoch() + d;
+		const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(t);
+		timespec deadline;
+		deadline.tv_sec = static_cast<time_t>(seconds.count());
+		deadline.tv_nsec = static_cast<long>(std::chrono::duration_cast<
+				std::chrono::nanoseconds>(t - seconds).count());
+		return deadline;
+	}
+
+	// Takes over the mutex of a process that died with it.
+	void _recover(const int result) {
+		if (result == EOWNERDEAD) {
+			pthread_mutex_consistent(&header->mutex);
+			++header->recoveries;
+			pthread_cond_broadcast(&header->not_empty);
+			pthread_cond_broadcast(&header->not_full);
+		} else if (result != 0 && result != ETIMEDOUT) {
+			std::cerr << "thread_comm::shared_memory_queue - the mutex is broken: "
+					<< std::strerror(result) << std::endl;
+			std::abort();
+		}
+	}
+
+	void _lock() {
+		if (!header) {
+			std::cerr << "thread_comm::shared_memory_queue - used after detach()"
+					<< std::endl;
+			std::abort();
+		}
+		_recover(pthread_mutex_lock(&header->mutex));
+	}
+
+	void _unlock() {
+		pthread_mutex_unlock(&header->mutex);
+	}
+
+	bool _is_full() const {
+		return header->write_count - header->read_count >= header->capacity;
+	}
+
+	bool _is_empty() const {
+		return header->write_count == header->read_count;
+	}
+
+	// Waits until ready() or until the queue is closed. Returns false
+	// if it didn't get to wait that long, with wait being false or with
+	// the deadline passing.
+	template <typename F>
+	bool _wait(pthread_cond_t * cond, std::uint32_t & waiting, F ready,
+			const bool wait, const timespec * deadline) {
+		while (!ready() && !header->closed) {
+			if (!wait) {
+				return false;
+			}
+
+			++waiting;
+			const int result = deadline ?
+					pthread_cond_timedwait(cond, &header->mutex, deadline) :
+					pthread_cond_wait(cond, &header->mutex);
+			--waiting;
+			_recover(result);
+
+			if (result == ETIMEDOUT) {
+				return ready() || header->closed;
+			}
+		}
+		return true;
+	}
+
+	bool _write(const T & message, const bool wait, const timespec * deadline) {
+		_lock();
+		const bool written = _wait(&header->not_full, header->writers_waiting,
+				[this] { return !_is_full(); }, wait, deadline) && !header->closed;
+
+		if (written) {
+			std::memcpy(static_cast<void *>(slots + header->write_count %
+					header->capacity), &message, sizeof(T));
+			++header->write_count;
+
+			if (header->readers_waiting) {
+				pthread_cond_signal(&header->not_empty);
+			}
+		}
+
+		_unlock();
+		return written;
+	}
+
+	bool _read(T & message, const bool wait, const timespec * deadline) {
+		_lock();
+		const bool read = _wait(&header->not_empty, header->readers_waiting,
+				[this] { return !_is_empty(); }, wait, deadline) && !_is_empty();
+
+		if (read) {
+			std::memcpy(static_cast<void *>(&message), slots + header->read_count %
+					header->capacity, sizeof(T));
+			++header->read_count;
+
+			if (header->writers_waiting) {
+				pthread_cond_signal(&header->not_full);
+			}
+		}
+
+		_unlock();
+		return read;
+	}
+
+public:
+	// Creates the shared memory object name with room for size messages.
+	// Returns nullptr, with errno set, if it couldn't, for example with
+	// EEXIST if the name is taken.
+	static std::unique_ptr<shared_memory_queue<T>> create(
+			const std::string & name, int size, mode_t mode = 0600) {
+		if (size <= 0) {
+			std::cerr << "thread_comm::shared_memory_queue - size must be positive"
+					<< std::endl;
+			std::abort();
+		}
+
+		const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode);
+		if (fd < 0) {
+			return nullptr;
+		}
+
+		const std::size_t length = _slots_offset() +
+				static_cast<std::size_t>(size) * sizeof(T);
+		void * region = nullptr;
+		if (ftruncate(fd, static_cast<off_t>(length)) == 0) {
+			region = _map(fd, length);
+		}
+		const int error = errno;
+		::close(fd);
+
+		if (!region) {
+			shm_unlink(name.c_str());
+			errno = error;
+			return nullptr;
+		}
+
+		// The region comes zeroed, so only the rest needs to be set.
+		auto * h = new (region) detail::shared_ring_header();
+		h->slot_size = sizeof(T);
+		h->capacity = static_cast<std::uint64_t>(size);
+
+		pthread_mutexattr_t mutex_attributes;
+		pthread_mutexattr_init(&mutex_attributes);
+		pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&h->mutex, &mutex_attributes);
+		pthread_mutexattr_destroy(&mutex_attributes);
+
+		pthread_condattr_t cond_attributes;
+		pthread_condattr_init(&cond_attributes);
+		pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+		pthread_cond_init(&h->not_empty, &cond_attributes);
+		pthread_cond_init(&h->not_full, &cond_attributes);
+		pthread_condattr_destroy(&cond_attributes);
+
+		h->magic.store(detail::shared_ring_magic, std::memory_order_release);
+		return std::unique_ptr<shared_memory_queue<T>>(
+				new shared_memory_queue<T>(region, length));
+	}
+
+	// Attaches to a queue that another process has created. Returns
+	// nullptr, with errno set, if it couldn't: ENOENT if there is no such
+	// queue, EAGAIN if its creator isn't done with it yet, and EINVAL if
+	// it isn't a queue of T.
+	static std::unique_ptr<shared_memory_queue<T>> attach(
+			const std::string & name) {
+		const int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0) {
+			return nullptr;
+		}
+
+		struct stat status;
+		if (fstat(fd, &status) != 0 ||
+				static_cast<std::size_t>(status.st_size) < _slots_offset()) {
+			::close(fd);
+			errno = EAGAIN;
+			return nullptr;
+		}
+
+		const std::size_t length = static_cast<std::size_t>(status.st_size);
+		void * region = _map(fd, length);
+		const int error = errno;
+		::close(fd);
+
+		if (!region) {
+			errno = error;
+			return nullptr;
+		}
+
+		auto * h = static_cast<detail::shared_ring_header *>(region);
+		const std::uint32_t magic = h->magic.load(std::memory_order_acquire);
+		if (magic != detail::shared_ring_magic || h->slot_size != sizeof(T) ||
+				_slots_offset() + h->capacity * sizeof(T) > length) {
+			munmap(region, length);
+			errno = magic == 0 ? EAGAIN : EINVAL;
+			return nullptr;
+		}
+
+		return std::unique_ptr<shared_memory_queue<T>>(
+				new shared_memory_queue<T>(region, length));
+	}
+
+	// Removes the name. The processes that are attached keep using the
+	// region until they detach.
+	static bool unlink(const std::string & name) {
+		return shm_unlink(name.c_str()) == 0;
+	}
+
+	~shared_memory_queue() {
+		detach();
+	}
+
+	// Unmaps the region, which stays there for the other processes (and
+	// until it's unlink()ed). The queue can't be used after this, but
+	// detaching it again does nothing. Handy before exec or in a child
+	// that shouldn't keep the parent's mapping.
+	void detach() {
+		if (header) {
+			munmap(header, length);
+			header = nullptr;
+			slots = nullptr;
+			length = 0;
+		}
+	}
+
+	bool is_attached() const {
+		return header != nullptr;
+	}
+
+	shared_memory_queue(const shared_memory_queue<T> &) = delete;
+	shared_memory_queue<T>& operator=(const shared_memory_queue<T> &) = delete;
+
+	// Blocks while the queue is full. Returns false if it is closed.
+	bool write(const T & message) {
+		return _write(message, true, nullptr);
+	}
+
+	bool timed_write(const T & message,
+			const std::chrono::system_clock::duration & timeout) {
+		const timespec deadline = _deadline(timeout);
+		return _write(message, true, &deadline);
+	}
+
+	bool try_writing(const T & message) {
+		return _write(message, false, nullptr);
+	}
+
+	// Blocks while the queue is empty. Returns false if it is closed and
+	// drained.
+	bool read(T & message) {
+		return _read(message, true, nullptr);
+	}
+
+	bool timed_read(T & message,
+			const std::chrono::system_clock::duration & timeout) {
+		const timespec deadline = _deadline(timeout);
+		return _read(message, true, &deadline);
+	}
+
+	bool try_reading(T & message) {
+		return _read(message, false, nullptr);
+	}
+
+	// Closes the queue for all of the processes.
+	void close() {
+		_lock();
+		header->closed = true;
+		pthread_cond_broadcast(&header->not_empty);
+		pthread_cond_broadcast(&header->not_full);
+		_unlock();
+	}
+
+	bool is_closed() {
+		_lock();
+		const bool closed = header->closed;
+		_unlock();
+		return closed;
+	}
+
+	std::size_t msg_count() {
+		_lock();
+		const std::size_t count = static_cast<std::size_t>(header->write_count -
+				header->read_count);
+		_unlock();
+		return count;
+	}
+
+	std::size_t size() const {
+		return header ? static_cast<std::size_t>(header->capacity) : 0;
+	}
+
+	// The number of times a process took over the mutex from one that
+	// died with it.
+	std::uint64_t recoveries() {
+		_lock();
+		const std::uint64_t count = header->recoveries;
+		_unlock();
+		return count;
+	}
+}; // shared_memory_queue
+#endif
+
+// selector waits on any number of read and write cases over
+// circular queues, channels and channel endpoints (of any message
+// type), and fires exactly one of them, similar to golang's select
+// statement:
+//
+//   thread_comm::selector sel;
+//   sel.on_read(results, [](std::unique_ptr<int> r) { ... });
+//   sel.on_read(control, cmd);
+//   sel.on_write(requests, req);
+//   sel.on_timeout(std::chrono::milliseconds(10), [] { ... });
+//   std::size_t fired = sel.wait();
+//
+// wait() returns the index of the case that fired, in the order the
+// cases were added. When more than one case is ready, the cases are
+// tried round-robin starting after the last one that fired, so that
+// a busy queue can't starve the others. An on_default case makes
+// wait() non-blocking (it fires when nothing else is ready), and an
+// on_timeout case fires when nothing became ready in time.
+// Channel cases are resolved with the roles of the thread that adds
+// them, so a selector should be used by the thread that built it.
+// A write case that fired has moved its message into the queue; when
+// reusing a selector, the message should be refilled before waiting
+// again.
+// Cases on a closed queue fire right away, like golang's cases on a
+// closed channel: a read case fires with a null message once the queue
+// is drained, and a write case fires leaving its message untouched.
+// is_closed() tells these apart from the regular ones.
+class selector {
+private:
+	class select_case {
+	public:
+		virtual ~select_case() {}
+		virtual bool try_fire() = 0;
+		virtual void subscribe(detail::select_waiter * waiter) = 0;
+		virtual void unsubscribe(detail::select_waiter * waiter) = 0;
+	};
+
+	template <typename T, typename Handler>
+	class read_case : public select_case {
+	private:
+		circular_queue<T> & queue;
+		Handler handler;
+
+	public:
+		read_case(circular_queue<T> & _queue, Handler _handler) :
+			queue(_queue),
+			handler(std::move(_handler))
+		{}
+
+		bool try_fire() override {
+			std::unique_ptr<T> m;
+			if (!queue._select_read(m)) {
+				return false;
+			}
+			handler(std::move(m));
+			return true;
+		}
+
+		void subscribe(detail::select_waiter * waiter) override {
+			queue.add_observer(waiter);
+		}
+
+		void unsubscribe(detail::select_waiter * waiter) override {
+			queue.remove_observer(waiter);
+		}
+	};
+
+	template <typename T, typename Handler>
+	class write_case : public select_case {
+	private:
+		circular_queue<T> & queue;
+		std::unique_ptr<T> & message;
+		Handler handler;
+
+	public:
+		write_case(circular_queue<T> & _queue, std::unique_ptr<T> & _message,
+				Handler _handler) :
+			queue(_queue),
+			message(_message),
+			handler(std::move(_handler))
+		{}
+
+		bool try_fire() override {
+			if (!queue._select_write(message)) {
+				return false;
+			}
+			handler();
+			return true;
+		}
+
+		void subscribe(detail::select_waiter * waiter) override {
+			queue.add_observer(waiter);
+		}
+
+		void unsubscribe(detail::select_waiter * waiter) override {
+			queue.remove_observer(waiter);
+		}
+	};
+
+	static constexpr std::size_t no_case = static_cast<std::size_t>(-1);
+
+	std::vector<std::unique_ptr<select_case>> cases;
+	// Maps the position of a case in the cases vector to the index
+	// reported by wait(). The default and timeout cases don't live in
+	// the vector.
+	std::vector<std::size_t> case_indices;
+	std::size_t next_index;
+	std::size_t start;
+
+	std::size_t default_index;
+	std::function<void()> default_handler;
+
+	std::size_t timeout_index;
+	std::chrono::system_clock::duration timeout;
+	std::function<void()> timeout_handler;
+
+	detail::select_waiter waiter;
+
+	template <typename Case, typename... Args>
+	selector & add_case(Args &&... args) {
+		cases.push_back(std::make_unique<Case>(std::forward<Args>(args)...));
+		case_indices.push_back(next_index++);
+		return *this;
+	}
+
+	std::size_t poll() {
+		const std::size_t n = cases.size();
+
+		for (std::size_t i = 0 ; i < n ; ++i) {
+			const std::size_t c = (start + i) % n;
+			if (cases[c]->try_fire()) {
+				start = c + 1;
+				return case_indices[c];
+			}
+		}
+
+		return no_case;
+	}
+
+	void subscribe_all() {
+		for (auto & c : cases) {
+			c->subscribe(&waiter);
+		}
+	}
+
+	void unsubscribe_all() {
+		for (auto & c : cases) {
+			c->unsubscribe(&waiter);
+		}
+	}
+
+public:
+	selector() :
+		next_index(0),
+		start(0),
+		default_index(no_case),
+		timeout_index(no_case),
+		timeout(0)
+	{}
+
+	selector(const selector &) = delete;
+	selector & operator=(const selector &) = delete;
+
+	// Reads a message from the queue and passes it to handler, which
+	// is called with an std::unique_ptr<T>.
+	template <typename T, typename Handler>
+	selector & on_read(circular_queue<T> & queue, Handler handler) {
+		return add_case<read_case<T, Handler>>(queue, std::move(handler));
+	}
+
+	// Reads a message from the queue into message.
+	template <typename T>
+	selector & on_read(circular_queue<T> & queue, std::unique_ptr<T> & message) {
+		return on_read(queue, [&message] (std::unique_ptr<T> m) {
+			message = std::move(m);
+		});
+	}
+
+	template <typename T, typename Handler>
+	selector & on_read(channel_endpoint<T> & e, Handler handler) {
+		return on_read(e.reading_queue(), std::move(handler));
+	}
+
+	template <typename T>
+	selector & on_read(channel_endpoint<T> & e, std::unique_ptr<T> & message) {
+		return on_read(e.reading_queue(), message);
+	}
+
+	template <typename T, typename Handler>
+	selector & on_read(channel<T> & c, Handler handler) {
+		return on_read(c.reading_queue(), std::move(handler));
+	}
+
+	template <typename T>
+	selector & on_read(channel<T> & c, std::unique_ptr<T> & message) {
+		return on_read(c.reading_queue(), message);
+	}
+
+	// Writes message into the queue and then calls handler.
+	template <typename T, typename Handler>
+	selector & on_write(circular_queue<T> & queue, std::unique_ptr<T> & message,
+			Handler handler) {
+		return add_case<write_case<T, Handler>>(queue, message,
+				std::move(handler));
+	}
+
+	template <typename T>
+	selector & on_write(circular_queue<T> & queue,
+			std::unique_ptr<T> & message) {
+		return on_write(queue, message, [] {});
+	}
+
+	template <typename T, typename Handler>
+	selector & on_write(channel_endpoint<T> & e, std::unique_ptr<T> & message,
+			Handler handler) {
+		return on_write(e.writing_queue(), message, std::move(handler));
+	}
+
+	template <typename T>
+	selector & on_write(channel_endpoint<T> & e,
+			std::unique_ptr<T> & message) {
+		return on_write(e.writing_queue(), message);
+	}
+
+	template <typename T, typename Handler>
+	selector & on_write(channel<T> & c, std::unique_ptr<T> & message,
+			Handler handler) {
+		return on_write(c.writing_queue(), message, std::move(handler));
+	}
+
+	template <typename T>
+	selector & on_write(channel<T> & c, std::unique_ptr<T> & message) {
+		return on_write(c.writing_queue(), message);
+	}
+
+	selector & on_default(std::function<void()> handler = [] {}) {
+		default_index = next_index++;
+		default_handler = std::move(handler);
+		return *this;
+	}
+
+	selector & on_timeout(const std::chrono::system_clock::duration duration,
+			std::function<void()> handler = [] {}) {
+		timeout_index = next_index++;
+		timeout = duration;
+		timeout_handler = std::move(handler);
+		return *this;
+	}
+
+	// Blocks until one of the cases fires, and returns its index.
+	std::size_t wait() {
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+		while (true) {
+			std::size_t fired = poll();
+			if (fired != no_case) {
+				return fired;
+			}
+
+			if (default_index != no_case) {
+				default_handler();
+				return default_index;
+			}
+
+			// Subscribing before checking the cases again makes sure
+			// that a change happening in between isn't missed.
+			waiter.reset();
+			subscribe_all();
+
+			fired = poll();
+			bool timed_out = false;
+
+			if (fired == no_case) {
+				if (timeout_index != no_case) {
+					timed_out = !waiter.wait_until(deadline);
+				} else {
+					waiter.wait();
+				}
+			}
+
+			unsubscribe_all();
+
+			if (fired != no_case) {
+				return fired;
+			}
+
+			if (timed_out) {
+				// Giving the cases a last chance, as something may
+				// have become ready right at the deadline.
+				fired = poll();
+				if (fired != no_case) {
+					return fired;
+				}
+
+				timeout_handler();
+				return timeout_index;
+			}
+		}
+	}
+}; // selector
 } // namespace thread_comm
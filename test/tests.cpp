@@ -5,6 +5,8 @@
 #include <chrono>
 #include <vector>
 #include <algorithm>
+#include <poll.h>
+#include <sys/wait.h>
 
 const int __base_sleep_msecs = 10;
 // Giving ourselves some buffer, as timings can vary (especially with valgrind).
@@ -861,6 +863,2504 @@ TEST(TestThreadComm, Channel_OneProducer_MultipleWorkers_OneCollector) {
 	producer.join();
 }
 
+// SPSC_Queue tests start here.
+TEST(TestThreadComm, SPSCQueue_BasicFunctionality) {
+	thread_comm::spsc_queue<char> q_main2thr;
+
+	std::thread t([&q_main2thr](){
+		std::unique_ptr<char> buf;
+		EXPECT_EQ(buf, nullptr);
+
+		buf << q_main2thr;
+		EXPECT_EQ(*buf, 'A');
+
+		q_main2thr >> buf;
+		EXPECT_EQ(*buf, 'B');
+	});
+
+	auto mbuf = std::make_unique<char>('A');
+	q_main2thr << mbuf;
+	EXPECT_EQ(mbuf, nullptr);
+
+	mbuf = std::make_unique<char>('B');
+	mbuf >> q_main2thr;
+
+	t.join();
+}
+
+TEST(TestThreadComm, SPSCQueue_AbortForSizeZero) {
+	EXPECT_EXIT(thread_comm::spsc_queue<char> q(0),
+			testing::KilledBySignal(SIGABRT), "");
+}
+
+TEST(TestThreadComm, SPSCQueue_TryOperationsDontBlock) {
+	thread_comm::spsc_queue<char> q(2);
+
+	EXPECT_EQ(q.try_reading(), nullptr);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(q.try_writing(mbuf));
+	mbuf = std::make_unique<char>('B');
+	EXPECT_TRUE(q.try_writing(mbuf));
+	EXPECT_EQ(q.msg_count(), (std::size_t)2);
+
+	mbuf = std::make_unique<char>('C');
+	EXPECT_FALSE(q.try_writing(mbuf));
+	// A failed write must leave the message with the caller.
+	EXPECT_EQ(*mbuf, 'C');
+
+	EXPECT_EQ(*q.try_reading(), 'A');
+	EXPECT_EQ(*q.try_reading(), 'B');
+	EXPECT_EQ(q.try_reading(), nullptr);
+	EXPECT_EQ(q.msg_count(), (std::size_t)0);
+}
+
+TEST(TestThreadComm, SPSCQueue_TimedOperations) {
+	thread_comm::spsc_queue<char> q(1);
+
+	bool timed_out = false;
+	auto t1 = std::chrono::system_clock::now();
+	auto buf = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(5));
+	EXPECT_TRUE(timed_out);
+	EXPECT_EQ(buf, nullptr);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(q.timed_write(mbuf, std::chrono::milliseconds(5)));
+
+	mbuf = std::make_unique<char>('B');
+	EXPECT_FALSE(q.timed_write(mbuf, std::chrono::milliseconds(5)));
+
+	std::thread t([&q] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		EXPECT_EQ(*q.read(), 'A');
+	});
+
+	EXPECT_TRUE(q.timed_write(mbuf, std::chrono::milliseconds(500)));
+	t.join();
+
+	buf = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	EXPECT_FALSE(timed_out);
+	EXPECT_EQ(*buf, 'B');
+}
+
+TEST(TestThreadComm, SPSCQueue_ManyMessagesKeepTheirOrder) {
+	const int number_of_messages = 100000;
+	thread_comm::spsc_queue<int> q(64);
+
+	std::thread t([&q] () {
+		for (int i = 0 ; i < number_of_messages ; ++i) {
+			auto msg = std::make_unique<int>(i);
+			q << msg;
+		}
+	});
+
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		std::unique_ptr<int> msg;
+		msg << q;
+		ASSERT_EQ(*msg, i);
+	}
+
+	t.join();
+}
+
+// MPMC_Queue tests start here.
+TEST(TestThreadComm, MPMCQueue_AbortForSizeZero) {
+	EXPECT_EXIT(thread_comm::mpmc_queue<char> q(0),
+			testing::KilledBySignal(SIGABRT), "");
+}
+
+TEST(TestThreadComm, MPMCQueue_Size_1) {
+	thread_comm::mpmc_queue<char> q(1);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(q.try_writing(mbuf));
+
+	mbuf = std::make_unique<char>('B');
+	EXPECT_FALSE(q.try_writing(mbuf));
+	EXPECT_EQ(*mbuf, 'B');
+	EXPECT_EQ(q.msg_count(), (std::size_t)1);
+
+	EXPECT_EQ(*q.try_reading(), 'A');
+	EXPECT_EQ(q.try_reading(), nullptr);
+
+	EXPECT_TRUE(q.try_writing(mbuf));
+	EXPECT_EQ(*q.try_reading(), 'B');
+	EXPECT_EQ(q.msg_count(), (std::size_t)0);
+}
+
+TEST(TestThreadComm, MPMCQueue_TimedOperations) {
+	thread_comm::mpmc_queue<char> q(1);
+
+	bool timed_out = false;
+	auto t1 = std::chrono::system_clock::now();
+	auto buf = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(5));
+	EXPECT_TRUE(timed_out);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(q.timed_write(mbuf, std::chrono::milliseconds(5)));
+
+	mbuf = std::make_unique<char>('B');
+	EXPECT_FALSE(q.timed_write(mbuf, std::chrono::milliseconds(5)));
+
+	std::thread t([&q] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		EXPECT_EQ(*q.read(), 'A');
+	});
+
+	EXPECT_TRUE(q.timed_write(mbuf, std::chrono::milliseconds(500)));
+	t.join();
+
+	buf = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	EXPECT_FALSE(timed_out);
+	EXPECT_EQ(*buf, 'B');
+}
+
+TEST(TestThreadComm, MPMCQueue_MultipleProducersAndConsumers) {
+	const int number_of_threads = 4;
+	const int messages_per_producer = 20000;
+	thread_comm::mpmc_queue<int> q(16);
+
+	std::vector<std::thread> producers;
+	std::vector<std::thread> consumers;
+	std::vector<long long> sums(number_of_threads, 0);
+
+	for (int i = 0 ; i < number_of_threads ; ++i) {
+		consumers.emplace_back([&q, &sums, i] () {
+			for (int j = 0 ; j < messages_per_producer ; ++j) {
+				std::unique_ptr<int> msg;
+				msg << q;
+				sums[i] += *msg;
+			}
+		});
+	}
+
+	for (int i = 0 ; i < number_of_threads ; ++i) {
+		producers.emplace_back([&q] () {
+			for (int j = 0 ; j < messages_per_producer ; ++j) {
+				auto msg = std::make_unique<int>(j);
+				q << msg;
+			}
+		});
+	}
+
+	for (auto & t : producers) {
+		t.join();
+	}
+
+	for (auto & t : consumers) {
+		t.join();
+	}
+
+	long long total = 0;
+	for (auto sum : sums) {
+		total += sum;
+	}
+
+	const long long expected = (long long)number_of_threads *
+			messages_per_producer * (messages_per_producer - 1) / 2;
+	EXPECT_EQ(total, expected);
+	EXPECT_EQ(q.msg_count(), (std::size_t)0);
+}
+
+TEST(TestThreadComm, MPMCQueue_BlockedProducersWakeUp) {
+	// A tiny queue keeps the producers parked most of the time, and the
+	// consumers pause between bursts, so the queue drains while they
+	// are parked. A lost wakeup leaves a producer asleep for good.
+	const int number_of_producers = 6;
+	const int messages_per_producer = 3000;
+	thread_comm::mpmc_queue<int> q(2);
+	std::atomic<int> received{0};
+
+	std::vector<std::thread> threads;
+	for (int i = 0 ; i < number_of_producers ; ++i) {
+		threads.emplace_back([&q] () {
+			for (int j = 0 ; j < messages_per_producer ; ++j) {
+				auto msg = std::make_unique<int>(j);
+				EXPECT_TRUE(q.write(msg));
+			}
+		});
+	}
+
+	for (int i = 0 ; i < 2 ; ++i) {
+		threads.emplace_back([&q, &received] () {
+			bool timed_out;
+			int n = 0;
+			while (received < number_of_producers * messages_per_producer) {
+				if (q.timed_read(std::chrono::milliseconds(1), timed_out) != nullptr) {
+					++received;
+					if (++n % 500 == 0) {
+						std::this_thread::sleep_for(std::chrono::microseconds(200));
+					}
+				}
+			}
+		});
+	}
+
+	for (auto & t : threads) {
+		t.join();
+	}
+
+	EXPECT_EQ(received.load(), number_of_producers * messages_per_producer);
+	EXPECT_EQ(q.msg_count(), (std::size_t)0);
+}
+
+TEST(TestThreadComm, MPMCQueue_SizeRoundsUpToPowerOfTwo) {
+	thread_comm::mpmc_queue<int> q(3);
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		EXPECT_TRUE(q.try_writing(msg));
+	}
+	auto msg = std::make_unique<int>(4);
+	EXPECT_FALSE(q.try_writing(msg));
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		EXPECT_EQ(*q.try_reading(), i);
+	}
+}
+
+TEST(TestThreadComm, MPMCChannel_BasicFunctionality) {
+	thread_comm::mpmc_channel<char> c(2);
+
+	std::thread t([&c] () {
+		std::unique_ptr<char> buf;
+		buf << c;
+		EXPECT_EQ(*buf, 'A');
+		*buf = 'B';
+		c << buf;
+	});
+
+	auto mbuf = std::make_unique<char>('A');
+	c << mbuf;
+	mbuf << c;
+	EXPECT_EQ(*mbuf, 'B');
+
+	t.join();
+}
+
+// Value_Queue tests start here.
+TEST(TestThreadComm, ValueQueue_BasicFunctionality) {
+	thread_comm::value_queue<std::string> q(2);
+
+	std::thread t([&q] () {
+		auto m = q.read();
+		ASSERT_TRUE(m.has_value());
+		EXPECT_EQ(*m, "AAA");
+
+		m = q.read();
+		ASSERT_TRUE(m.has_value());
+		EXPECT_EQ(*m, "BB");
+	});
+
+	q.write(std::string("AAA"));
+	q.emplace_write(2, 'B');
+
+	t.join();
+	EXPECT_EQ(q.msg_count(), (std::size_t)0);
+}
+
+TEST(TestThreadComm, ValueQueue_TryAndTimedOperations) {
+	thread_comm::value_queue<int> q(1);
+
+	EXPECT_FALSE(q.try_reading().has_value());
+
+	bool timed_out = false;
+	auto t1 = std::chrono::system_clock::now();
+	auto m = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(5));
+	EXPECT_TRUE(timed_out);
+	EXPECT_FALSE(m.has_value());
+
+	EXPECT_TRUE(q.try_writing(1));
+	EXPECT_FALSE(q.try_writing(2));
+	EXPECT_FALSE(q.timed_write(2, std::chrono::milliseconds(5)));
+	EXPECT_EQ(q.msg_count(), (std::size_t)1);
+
+	m = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	EXPECT_FALSE(timed_out);
+	EXPECT_EQ(*m, 1);
+	EXPECT_FALSE(q.try_reading().has_value());
+}
+
+TEST(TestThreadComm, ValueQueue_WritesFromLvalues) {
+	thread_comm::value_queue<int> q(1);
+	const int first = 1;
+	int second = 2;
+
+	EXPECT_TRUE(q.try_writing(first));
+	EXPECT_FALSE(q.try_writing(second));
+	EXPECT_FALSE(q.timed_write(second, std::chrono::milliseconds(1)));
+	EXPECT_EQ(*q.read(), 1);
+	EXPECT_TRUE(q.timed_write(second, std::chrono::milliseconds(1)));
+	EXPECT_EQ(*q.read(), 2);
+}
+
+TEST(TestThreadComm, ValueQueue_Close) {
+	thread_comm::value_queue<int> q(2);
+
+	std::thread t([&q] () {
+		EXPECT_EQ(*q.read(), 1);
+		EXPECT_EQ(*q.read(), 2);
+
+		// Blocks until the queue is closed.
+		EXPECT_FALSE(q.read().has_value());
+	});
+
+	EXPECT_TRUE(q.write(1));
+	EXPECT_TRUE(q.write(2));
+	std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+	q.close();
+	t.join();
+
+	EXPECT_TRUE(q.is_closed());
+	EXPECT_FALSE(q.write(3));
+	EXPECT_FALSE(q.try_writing(3));
+}
+
+TEST(TestThreadComm, ValueQueue_DrainsAfterClose) {
+	thread_comm::value_queue<int> q(2);
+	q.write(1);
+	q.close();
+
+	bool timed_out = true;
+	auto m = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	EXPECT_FALSE(timed_out);
+	EXPECT_EQ(*m, 1);
+
+	m = q.timed_read(std::chrono::milliseconds(5), timed_out);
+	EXPECT_FALSE(timed_out);
+	EXPECT_FALSE(m.has_value());
+}
+
+TEST(TestThreadComm, ValueQueue_DestroysPendingMessages) {
+	auto tracker = std::make_shared<int>(0);
+
+	{
+		thread_comm::value_queue<std::shared_ptr<int>> q(4);
+		q.write(tracker);
+		q.write(tracker);
+		q.write(tracker);
+		q.read();
+		EXPECT_EQ(tracker.use_count(), 3);
+	}
+
+	EXPECT_EQ(tracker.use_count(), 1);
+}
+
+// Bulk operation tests start here.
+TEST(TestThreadComm, CircularQueue_BulkOperations) {
+	thread_comm::circular_queue<int> cq(4);
+
+	std::vector<std::unique_ptr<int>> in;
+	for (int i = 0 ; i < 6 ; ++i) {
+		in.push_back(std::make_unique<int>(i));
+	}
+
+	// Only four of them fit.
+	EXPECT_EQ(cq.try_write_bulk(in.begin(), in.end()), (std::size_t)4);
+	EXPECT_EQ(cq.msg_count(), (std::size_t)4);
+	EXPECT_EQ(in[3], nullptr);
+	EXPECT_EQ(*in[4], 4);
+	EXPECT_EQ(cq.try_write_bulk(in.begin() + 4, in.end()), (std::size_t)0);
+
+	std::vector<std::unique_ptr<int>> out;
+	EXPECT_EQ(cq.read_bulk(std::back_inserter(out), 3), (std::size_t)3);
+	EXPECT_EQ(cq.write_bulk(in.begin() + 4, in.end()), (std::size_t)2);
+	EXPECT_EQ(cq.try_read_bulk(std::back_inserter(out), 10), (std::size_t)3);
+	EXPECT_EQ(cq.try_read_bulk(std::back_inserter(out), 10), (std::size_t)0);
+
+	ASSERT_EQ(out.size(), (std::size_t)6);
+	for (int i = 0 ; i < 6 ; ++i) {
+		EXPECT_EQ(*out[i], i);
+	}
+}
+
+TEST(TestThreadComm, CircularQueue_ReadBulkBlocksUntilAMessageArrives) {
+	thread_comm::circular_queue<int> cq(8);
+
+	std::thread t([&cq] () {
+		std::vector<std::unique_ptr<int>> out;
+
+		auto t1 = std::chrono::system_clock::now();
+		std::size_t n = cq.read_bulk(std::back_inserter(out), 8);
+		auto t2 = std::chrono::system_clock::now();
+
+		EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(check_msecs));
+		EXPECT_GE(n, (std::size_t)1);
+		EXPECT_EQ(*out[0], 0);
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+
+	std::vector<std::unique_ptr<int>> in;
+	for (int i = 0 ; i < 3 ; ++i) {
+		in.push_back(std::make_unique<int>(i));
+	}
+	EXPECT_EQ(cq.write_bulk(in.begin(), in.end()), (std::size_t)3);
+
+	t.join();
+}
+
+TEST(TestThreadComm, Channel_BulkOperations) {
+	thread_comm::channel<int> c(16);
+
+	std::thread t([&c] () {
+		std::vector<std::unique_ptr<int>> batch;
+		std::size_t received = 0;
+
+		while (received < 10) {
+			received += c.read_bulk(std::back_inserter(batch), 10 - received);
+		}
+
+		for (auto & m : batch) {
+			*m *= 2;
+		}
+
+		std::size_t sent = 0;
+		while (sent < batch.size()) {
+			sent += c.write_bulk(batch.begin() + sent, batch.end());
+		}
+	});
+
+	std::vector<std::unique_ptr<int>> in;
+	for (int i = 0 ; i < 10 ; ++i) {
+		in.push_back(std::make_unique<int>(i));
+	}
+	EXPECT_EQ(c.write_bulk(in.begin(), in.end()), (std::size_t)10);
+
+	std::vector<std::unique_ptr<int>> out;
+	while (out.size() < 10) {
+		c.read_bulk(std::back_inserter(out), 10);
+	}
+
+	t.join();
+
+	EXPECT_EQ(c.try_read_bulk(std::back_inserter(out), 10), (std::size_t)0);
+	for (int i = 0 ; i < 10 ; ++i) {
+		EXPECT_EQ(*out[i], 2*i);
+	}
+}
+
+// Selector tests start here.
+TEST(TestThreadComm, Selector_ReadsFromWhicheverQueueIsReady) {
+	thread_comm::circular_queue<int> ints;
+	thread_comm::circular_queue<std::string> strings;
+
+	std::unique_ptr<std::string> str;
+	int received_int = 0;
+
+	thread_comm::selector sel;
+	sel.on_read(ints, [&received_int] (std::unique_ptr<int> m) {
+		received_int = *m;
+	});
+	sel.on_read(strings, str);
+
+	std::thread t([&strings] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		auto m = std::make_unique<std::string>("A");
+		strings << m;
+	});
+
+	auto t1 = std::chrono::system_clock::now();
+	EXPECT_EQ(sel.wait(), (std::size_t)1);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(check_msecs));
+	EXPECT_EQ(*str, "A");
+
+	t.join();
+
+	auto m = std::make_unique<int>(7);
+	ints << m;
+	EXPECT_EQ(sel.wait(), (std::size_t)0);
+	EXPECT_EQ(received_int, 7);
+}
+
+TEST(TestThreadComm, Selector_DefaultCaseDoesntBlock) {
+	thread_comm::circular_queue<int> cq;
+	std::unique_ptr<int> msg;
+	bool defaulted = false;
+
+	thread_comm::selector sel;
+	sel.on_read(cq, msg).on_default([&defaulted] { defaulted = true; });
+
+	auto t1 = std::chrono::system_clock::now();
+	EXPECT_EQ(sel.wait(), (std::size_t)1);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 <= std::chrono::milliseconds(unblocked_msecs));
+	EXPECT_TRUE(defaulted);
+
+	auto m = std::make_unique<int>(1);
+	cq << m;
+	EXPECT_EQ(sel.wait(), (std::size_t)0);
+	EXPECT_EQ(*msg, 1);
+}
+
+TEST(TestThreadComm, Selector_TimeoutAndWriteCases) {
+	thread_comm::circular_queue<int> cq(1);
+	auto first = std::make_unique<int>(1);
+	cq << first;
+
+	auto msg = std::make_unique<int>(2);
+	bool written = false;
+	bool timed_out = false;
+
+	thread_comm::selector sel;
+	sel.on_write(cq, msg, [&written] { written = true; })
+		.on_timeout(std::chrono::milliseconds(5), [&timed_out] {
+			timed_out = true;
+		});
+
+	auto t1 = std::chrono::system_clock::now();
+	EXPECT_EQ(sel.wait(), (std::size_t)1);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(5));
+	EXPECT_TRUE(timed_out);
+	EXPECT_FALSE(written);
+	EXPECT_EQ(*msg, 2);
+
+	std::thread t([&cq] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		EXPECT_EQ(*cq.read(), 1);
+	});
+
+	timed_out = false;
+	thread_comm::selector sel2;
+	sel2.on_write(cq, msg, [&written] { written = true; })
+		.on_timeout(std::chrono::milliseconds(500), [&timed_out] {
+			timed_out = true;
+		});
+
+	EXPECT_EQ(sel2.wait(), (std::size_t)0);
+	EXPECT_TRUE(written);
+	EXPECT_FALSE(timed_out);
+	EXPECT_EQ(msg, nullptr);
+
+	t.join();
+	EXPECT_EQ(*cq.read(), 2);
+}
+
+TEST(TestThreadComm, Selector_ChannelCasesFollowRoles) {
+	thread_comm::channel<int> c1;
+	thread_comm::channel<int> c2;
+
+	std::thread t([&c1, &c2] () {
+		// A worker reads what the owner has written.
+		std::unique_ptr<int> m;
+		thread_comm::selector sel;
+		sel.on_read(c1, m).on_read(c2, m);
+
+		EXPECT_EQ(sel.wait(), (std::size_t)1);
+		EXPECT_EQ(*m, 2);
+		c2 << m;
+	});
+
+	auto m = std::make_unique<int>(2);
+	c2 << m;
+
+	std::unique_ptr<int> result;
+	thread_comm::selector sel;
+	sel.on_read(c1, result).on_read(c2, result);
+	EXPECT_EQ(sel.wait(), (std::size_t)1);
+	EXPECT_EQ(*result, 2);
+
+	t.join();
+}
+
+// Close tests start here.
+TEST(TestThreadComm, CircularQueue_CloseWakesUpBlockedReaders) {
+	thread_comm::circular_queue<char> cq;
+
+	std::thread t([&cq] () {
+		std::unique_ptr<char> buf;
+
+		auto t1 = std::chrono::system_clock::now();
+		EXPECT_FALSE(cq.read(buf));
+		auto t2 = std::chrono::system_clock::now();
+
+		EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(check_msecs));
+		EXPECT_EQ(buf, nullptr);
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+	cq.close();
+
+	t.join();
+	EXPECT_TRUE(cq.is_closed());
+}
+
+TEST(TestThreadComm, CircularQueue_ReadsDrainAClosedQueue) {
+	thread_comm::circular_queue<char> cq(4);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(cq.write(mbuf));
+	// Null messages can still be told apart from a closed queue.
+	std::unique_ptr<char> null_msg;
+	EXPECT_TRUE(cq.write(null_msg));
+
+	cq.close();
+
+	mbuf = std::make_unique<char>('B');
+	EXPECT_FALSE(cq.write(mbuf));
+	EXPECT_FALSE(cq.try_writing(mbuf));
+	EXPECT_FALSE(cq.timed_write(mbuf, std::chrono::milliseconds(5)));
+	EXPECT_EQ(*mbuf, 'B');
+
+	std::unique_ptr<char> buf;
+	EXPECT_TRUE(cq.read(buf));
+	EXPECT_EQ(*buf, 'A');
+	EXPECT_TRUE(cq.read(buf));
+	EXPECT_EQ(buf, nullptr);
+	EXPECT_FALSE(cq.read(buf));
+
+	bool timed_out = true;
+	EXPECT_EQ(cq.timed_read(std::chrono::milliseconds(5), timed_out), nullptr);
+	EXPECT_FALSE(timed_out);
+
+	std::vector<std::unique_ptr<char>> out;
+	EXPECT_EQ(cq.read_bulk(std::back_inserter(out), 4), (std::size_t)0);
+}
+
+TEST(TestThreadComm, CircularQueue_CloseWakesUpBlockedWriters) {
+	thread_comm::circular_queue<char> cq(1);
+	auto mbuf = std::make_unique<char>('A');
+	cq << mbuf;
+
+	std::thread t([&cq] () {
+		auto buf = std::make_unique<char>('B');
+		EXPECT_FALSE(cq.write(buf));
+		EXPECT_EQ(*buf, 'B');
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+	cq.close();
+	t.join();
+
+	EXPECT_EQ(*cq.read(), 'A');
+}
+
+TEST(TestThreadComm, MPMCQueue_Close) {
+	thread_comm::mpmc_queue<char> q(2);
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(q.write(mbuf));
+
+	std::thread t([&q] () {
+		std::unique_ptr<char> buf;
+		EXPECT_TRUE(q.read(buf));
+		EXPECT_EQ(*buf, 'A');
+		// Blocks until the queue gets closed.
+		EXPECT_FALSE(q.read(buf));
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+	q.close();
+	t.join();
+
+	mbuf = std::make_unique<char>('B');
+	EXPECT_FALSE(q.write(mbuf));
+	EXPECT_EQ(*mbuf, 'B');
+}
+
+TEST(TestThreadComm, Channel_CloseShutsDownAPipeline) {
+	const int number_of_workers = 4;
+	const int number_of_messages = 1000;
+
+	thread_comm::channel<int> c(16);
+	std::vector<std::thread> workers;
+
+	for (int i = 0 ; i < number_of_workers ; ++i) {
+		workers.emplace_back([&c] () {
+			std::unique_ptr<int> msg;
+			while (c.read(msg)) {
+				c << msg;
+			}
+			EXPECT_TRUE(c.is_closed());
+		});
+	}
+
+	std::thread collector([&c, number_of_messages] () {
+		c.become_a_read_owner();
+		c.become_a_non_writer();
+
+		int received = 0;
+		std::unique_ptr<int> msg;
+		while (c.read(msg)) {
+			++received;
+		}
+
+		EXPECT_EQ(received, number_of_messages);
+	});
+
+	c.become_a_non_reader();
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		EXPECT_TRUE(c.write(msg));
+	}
+
+	c.close_to_workers();
+	for (auto & w : workers) {
+		w.join();
+	}
+
+	c.close_to_owners();
+	collector.join();
+
+	auto msg = std::make_unique<int>(0);
+	EXPECT_FALSE(c.write(msg));
+}
+
+TEST(TestThreadComm, Selector_ClosedQueueCasesFire) {
+	thread_comm::circular_queue<int> cq;
+	thread_comm::circular_queue<int> other;
+	std::unique_ptr<int> msg = std::make_unique<int>(1);
+
+	thread_comm::selector sel;
+	sel.on_read(other, msg).on_read(cq, msg);
+
+	std::thread t([&cq] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		cq.close();
+	});
+
+	EXPECT_EQ(sel.wait(), (std::size_t)1);
+	EXPECT_EQ(msg, nullptr);
+	EXPECT_TRUE(cq.is_closed());
+
+	t.join();
+}
+
+// Channel endpoint tests start here.
+TEST(TestThreadComm, ChannelEndpoint_BasicFunctionality) {
+	thread_comm::channel<char> c;
+	auto owner = c.owner_end();
+
+	std::thread t([&c] () {
+		auto worker = c.worker_end();
+		std::unique_ptr<char> buf;
+
+		buf << worker;
+		EXPECT_EQ(*buf, 'A');
+		*buf = 'B';
+		worker << buf;
+	});
+
+	auto mbuf = std::make_unique<char>('A');
+	owner << mbuf;
+	mbuf << owner;
+	EXPECT_EQ(*mbuf, 'B');
+
+	t.join();
+}
+
+TEST(TestThreadComm, ChannelEndpoint_InteroperatesWithRoles) {
+	thread_comm::channel<int> c(4);
+
+	// An endpoint taken by a thread works the same way as that thread's
+	// role would, regardless of which thread created it.
+	auto worker = c.worker_end();
+
+	auto msg = std::make_unique<int>(1);
+	c << msg;
+	EXPECT_EQ(worker.read_msg_count(), (std::size_t)1);
+	EXPECT_EQ(*worker.read(), 1);
+	EXPECT_EQ(worker.try_reading(), nullptr);
+
+	msg = std::make_unique<int>(2);
+	EXPECT_TRUE(worker.try_writing(msg));
+	EXPECT_EQ(*c.read(), 2);
+
+	worker.close();
+	EXPECT_TRUE(c.is_closed());
+	EXPECT_FALSE(c.read(msg));
+
+	c.close_to_workers();
+	EXPECT_TRUE(worker.is_closed());
+}
+
+TEST(TestThreadComm, ChannelEndpoint_WorksWithSelector) {
+	thread_comm::channel<int> c;
+	auto worker = c.worker_end();
+	std::unique_ptr<int> msg;
+
+	thread_comm::selector sel;
+	sel.on_read(worker, msg).on_default();
+	EXPECT_EQ(sel.wait(), (std::size_t)1);
+
+	auto m = std::make_unique<int>(3);
+	c << m;
+	EXPECT_EQ(sel.wait(), (std::size_t)0);
+	EXPECT_EQ(*msg, 3);
+}
+
+// Wait strategy tests start here.
+TEST(TestThreadComm, CircularQueue_WaitStrategies) {
+	const thread_comm::wait_strategy strategies[] = {
+		thread_comm::wait_strategy::block,
+		thread_comm::wait_strategy::spin,
+		thread_comm::wait_strategy::spin_then_yield,
+		thread_comm::wait_strategy::adaptive
+	};
+
+	for (auto strategy : strategies) {
+		// Keeping this small, as a spinning reader can waste a whole
+		// time slice when the machine has a single core.
+		const int number_of_messages = 500;
+		thread_comm::circular_queue<int> cq(64, strategy);
+
+		std::thread t([&cq] () {
+			for (int i = 0 ; i < number_of_messages ; ++i) {
+				auto msg = std::make_unique<int>(i);
+				cq << msg;
+			}
+			cq.close();
+		});
+
+		int expected = 0;
+		std::unique_ptr<int> msg;
+		while (cq.read(msg)) {
+			ASSERT_EQ(*msg, expected++);
+		}
+		EXPECT_EQ(expected, number_of_messages);
+
+		t.join();
+	}
+}
+
+TEST(TestThreadComm, CircularQueue_SpinningTimedOperationsTimeOut) {
+	thread_comm::circular_queue<char> cq(1, thread_comm::wait_strategy::spin);
+
+	bool timed_out = false;
+	auto t1 = std::chrono::system_clock::now();
+	auto buf = cq.timed_read(std::chrono::milliseconds(5), timed_out);
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(5));
+	EXPECT_TRUE(timed_out);
+	EXPECT_EQ(buf, nullptr);
+	EXPECT_EQ(cq.try_reading(), nullptr);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(cq.try_writing(mbuf));
+	mbuf = std::make_unique<char>('B');
+	EXPECT_FALSE(cq.try_writing(mbuf));
+
+	t1 = std::chrono::system_clock::now();
+	EXPECT_FALSE(cq.timed_write(mbuf, std::chrono::milliseconds(5)));
+	t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(5));
+	EXPECT_EQ(*mbuf, 'B');
+}
+
+TEST(TestThreadComm, Channel_WaitStrategy) {
+	thread_comm::channel<int> c(2, 0, thread_comm::wait_strategy::adaptive);
+
+	std::thread t([&c] () {
+		std::unique_ptr<int> msg;
+		while (c.read(msg)) {
+			++*msg;
+			c << msg;
+		}
+	});
+
+	for (int i = 0 ; i < 1000 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c << msg;
+		msg << c;
+		ASSERT_EQ(*msg, i + 1);
+	}
+
+	c.close_to_workers();
+	t.join();
+}
+
+// Readiness fd tests start here.
+static bool fd_is_readable(const int fd, const int timeout_msecs = 0) {
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, timeout_msecs) == 1 && (pfd.revents & POLLIN);
+}
+
+TEST(TestThreadComm, CircularQueue_ReadinessFds) {
+	thread_comm::circular_queue<char> cq(2);
+
+	const int rfd = cq.read_ready_fd();
+	const int wfd = cq.write_ready_fd();
+	ASSERT_GE(rfd, 0);
+	ASSERT_GE(wfd, 0);
+	EXPECT_EQ(cq.read_ready_fd(), rfd);
+
+	EXPECT_FALSE(fd_is_readable(rfd));
+	EXPECT_TRUE(fd_is_readable(wfd));
+
+	auto mbuf = std::make_unique<char>('A');
+	cq << mbuf;
+	EXPECT_TRUE(fd_is_readable(rfd));
+	EXPECT_TRUE(fd_is_readable(wfd));
+
+	mbuf = std::make_unique<char>('B');
+	cq << mbuf;
+	EXPECT_TRUE(fd_is_readable(rfd));
+	EXPECT_FALSE(fd_is_readable(wfd));
+
+	EXPECT_EQ(*cq.read(), 'A');
+	EXPECT_TRUE(fd_is_readable(rfd));
+	EXPECT_TRUE(fd_is_readable(wfd));
+
+	EXPECT_EQ(*cq.read(), 'B');
+	EXPECT_FALSE(fd_is_readable(rfd));
+
+	cq.close();
+	EXPECT_TRUE(fd_is_readable(rfd));
+}
+
+TEST(TestThreadComm, Channel_ReadinessFdWakesUpAPollingThread) {
+	thread_comm::channel<int> c;
+	const int fd = c.read_ready_fd();
+	ASSERT_GE(fd, 0);
+
+	std::thread t([&c] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		auto worker = c.worker_end();
+		auto msg = std::make_unique<int>(5);
+		worker << msg;
+	});
+
+	EXPECT_TRUE(fd_is_readable(fd, 1000));
+	EXPECT_EQ(*c.try_reading(), 5);
+	EXPECT_FALSE(fd_is_readable(fd));
+
+	t.join();
+}
+
+// Segmented_Queue tests start here.
+TEST(TestThreadComm, SegmentedQueue_GrowsAndShrinks) {
+	thread_comm::segmented_queue<int> q(0, 4);
+
+	// An unbounded queue never blocks its writers.
+	for (int i = 0 ; i < 100 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		EXPECT_TRUE(q.try_writing(msg));
+	}
+	EXPECT_EQ(q.msg_count(), (std::size_t)100);
+	EXPECT_EQ(q.segment_count(), (std::size_t)25);
+
+	for (int i = 0 ; i < 100 ; ++i) {
+		ASSERT_EQ(*q.read(), i);
+	}
+	EXPECT_EQ(q.try_reading(), nullptr);
+
+	// Once it's down to a quarter, the queue keeps a single spare
+	// segment.
+	EXPECT_EQ(q.segment_count(), (std::size_t)2);
+
+	for (int i = 0 ; i < 200 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		q << msg;
+		ASSERT_EQ(*q.read(), i);
+	}
+	EXPECT_LE(q.segment_count(), (std::size_t)2);
+
+	for (int i = 0 ; i < 20 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		q << msg;
+	}
+	while (q.try_reading() != nullptr) {}
+	q.shrink_to_fit();
+	EXPECT_EQ(q.segment_count(), (std::size_t)1);
+}
+
+TEST(TestThreadComm, SegmentedQueue_SoftLimit) {
+	thread_comm::segmented_queue<char> q(2, 1);
+
+	auto mbuf = std::make_unique<char>('A');
+	EXPECT_TRUE(q.try_writing(mbuf));
+	mbuf = std::make_unique<char>('B');
+	EXPECT_TRUE(q.try_writing(mbuf));
+	mbuf = std::make_unique<char>('C');
+	EXPECT_FALSE(q.try_writing(mbuf));
+	EXPECT_FALSE(q.timed_write(mbuf, std::chrono::milliseconds(5)));
+
+	std::thread t([&q] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		EXPECT_EQ(*q.read(), 'A');
+	});
+
+	auto t1 = std::chrono::system_clock::now();
+	EXPECT_TRUE(q.write(mbuf));
+	auto t2 = std::chrono::system_clock::now();
+	EXPECT_TRUE(t2 - t1 >= std::chrono::milliseconds(check_msecs));
+	t.join();
+
+	q.close();
+	std::unique_ptr<char> buf;
+	EXPECT_TRUE(q.read(buf));
+	EXPECT_EQ(*buf, 'B');
+	EXPECT_TRUE(q.read(buf));
+	EXPECT_EQ(*buf, 'C');
+	EXPECT_FALSE(q.read(buf));
+}
+
+TEST(TestThreadComm, SegmentedChannel_BasicFunctionality) {
+	thread_comm::segmented_channel<int> c(0);
+
+	std::thread t([&c] () {
+		std::unique_ptr<int> msg;
+		while (c.read(msg)) {
+			c << msg;
+		}
+	});
+
+	for (int i = 0 ; i < 1000 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c << msg;
+	}
+
+	for (int i = 0 ; i < 1000 ; ++i) {
+		ASSERT_EQ(*c.read(), i);
+	}
+
+	c.close_to_workers();
+	t.join();
+}
+
+// Object_Pool tests start here.
+TEST(TestThreadComm, ObjectPool_ReusesRecycledObjects) {
+	thread_comm::object_pool<std::string> pool(
+			[] { return std::make_unique<std::string>(); },
+			[] (std::string & s) { s.clear(); });
+
+	auto a = pool.acquire();
+	*a = "some payload";
+	std::string * raw = a.get();
+
+	pool.recycle(a);
+	EXPECT_EQ(a, nullptr);
+
+	auto b = pool.acquire();
+	EXPECT_EQ(b.get(), raw);
+	EXPECT_TRUE(b->empty());
+
+	auto st = pool.statistics();
+	EXPECT_EQ(st.misses, (std::uint64_t)1);
+	EXPECT_EQ(st.hits, (std::uint64_t)1);
+	EXPECT_EQ(st.recycled, (std::uint64_t)1);
+	EXPECT_EQ(st.released, (std::uint64_t)0);
+}
+
+TEST(TestThreadComm, ObjectPool_ReturnPathAcrossAChannel) {
+	const int number_of_messages = 1000;
+	thread_comm::object_pool<int> pool;
+	thread_comm::circular_queue<int> cq(8);
+
+	std::thread consumer([&pool, &cq] () {
+		std::unique_ptr<int> msg;
+		while (cq.read(msg)) {
+			pool.recycle(msg);
+		}
+	});
+
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		auto msg = pool.acquire();
+		*msg = i;
+		cq << msg;
+	}
+
+	cq.close();
+	consumer.join();
+
+	// The consumer's cache hands its objects over to the free list in
+	// batches, where the producer picks them up again.
+	auto st = pool.statistics();
+	EXPECT_EQ(st.hits + st.misses, (std::uint64_t)number_of_messages);
+	EXPECT_EQ(st.recycled, (std::uint64_t)number_of_messages);
+	EXPECT_GT(st.hits, st.misses);
+}
+
+TEST(TestThreadComm, ObjectPool_FreeListIsBounded) {
+	thread_comm::object_pool<int> pool(
+			[] { return std::make_unique<int>(0); }, nullptr, 4, 4);
+
+	std::vector<std::unique_ptr<int>> objects;
+	for (int i = 0 ; i < 20 ; ++i) {
+		objects.push_back(pool.acquire());
+	}
+
+	for (auto & o : objects) {
+		pool.recycle(o);
+	}
+
+	auto st = pool.statistics();
+	EXPECT_EQ(st.misses, (std::uint64_t)20);
+	EXPECT_EQ(st.recycled, (std::uint64_t)20);
+	// At most 4 objects fit in the cache and 4 in the free list.
+	EXPECT_GE(st.released, (std::uint64_t)12);
+}
+
+TEST(TestThreadComm, ObjectPool_ExitingThreadsGiveTheirCachesBack) {
+	const int number_of_threads = 10;
+	thread_comm::object_pool<int> pool(
+			[] { return std::make_unique<int>(0); }, nullptr, 8);
+
+	// Every thread keeps what it recycles in its own cache, as it never
+	// fills up.
+	for (int i = 0 ; i < number_of_threads ; ++i) {
+		std::thread t([&pool] () {
+			std::vector<std::unique_ptr<int>> objects;
+			for (int j = 0 ; j < 4 ; ++j) {
+				objects.push_back(pool.acquire());
+			}
+			for (auto & o : objects) {
+				pool.recycle(o);
+			}
+		});
+		t.join();
+	}
+
+	auto st = pool.statistics();
+	EXPECT_EQ(st.misses, (std::uint64_t)4);
+	EXPECT_EQ(st.hits, (std::uint64_t)(number_of_threads - 1) * 4);
+	EXPECT_EQ(st.recycled, (std::uint64_t)number_of_threads * 4);
+
+	// The objects the last thread left behind come from the free list.
+	for (int i = 0 ; i < 4 ; ++i) {
+		pool.acquire();
+	}
+	EXPECT_EQ(pool.statistics().misses, (std::uint64_t)4);
+}
+
+// Metrics tests start here.
+
+#if defined(THREAD_COMM_METRICS)
+TEST(TestThreadComm, Metrics_CountsMessagesAndTryFailures) {
+	thread_comm::circular_queue<int> cq(3);
+
+	std::unique_ptr<int> msg;
+	EXPECT_FALSE(cq.try_reading(msg));
+
+	for (int i = 0 ; i < 3 ; ++i) {
+		msg = std::make_unique<int>(i);
+		cq.write(msg);
+	}
+
+	msg = std::make_unique<int>(3);
+	EXPECT_FALSE(cq.try_writing(msg));
+
+	cq.read(msg);
+	cq.read(msg);
+
+	auto st = cq.statistics();
+	EXPECT_EQ(st.messages_in, (std::uint64_t)3);
+	EXPECT_EQ(st.messages_out, (std::uint64_t)2);
+	EXPECT_EQ(st.failed_try_reads, (std::uint64_t)1);
+	EXPECT_EQ(st.failed_try_writes, (std::uint64_t)1);
+	EXPECT_EQ(st.high_water_mark, (std::size_t)3);
+	EXPECT_EQ(st.blocked_reads, (std::uint64_t)0);
+	EXPECT_EQ(st.blocked_writes, (std::uint64_t)0);
+}
+
+TEST(TestThreadComm, Metrics_BlockedAndTimedOutReads) {
+	thread_comm::circular_queue<int> cq;
+
+	bool timed_out = false;
+	cq.timed_read(std::chrono::milliseconds(1), timed_out);
+	EXPECT_TRUE(timed_out);
+
+	std::thread t([&cq] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+		auto msg = std::make_unique<int>(1);
+		cq.write(msg);
+	});
+
+	auto msg = cq.read();
+	t.join();
+
+	auto st = cq.statistics();
+	EXPECT_EQ(st.timed_out_reads, (std::uint64_t)1);
+	EXPECT_EQ(st.blocked_reads, (std::uint64_t)2);
+	EXPECT_GE(st.read_wait_time, std::chrono::milliseconds(check_msecs));
+	EXPECT_EQ(st.messages_out, (std::uint64_t)1);
+}
+
+TEST(TestThreadComm, Metrics_ChannelDirections) {
+	thread_comm::channel<int> c(4);
+
+	std::thread t([&c] () {
+		std::unique_ptr<int> msg;
+		while (c.read(msg)) {
+			c.write(msg);
+		}
+	});
+
+	for (int i = 0 ; i < 3 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c.write(msg);
+		c.read(msg);
+	}
+
+	c.close_to_workers();
+	t.join();
+
+	auto st = c.statistics();
+	EXPECT_EQ(st.to_workers.messages_in, (std::uint64_t)3);
+	EXPECT_EQ(st.to_workers.messages_out, (std::uint64_t)3);
+	EXPECT_EQ(st.to_owners.messages_in, (std::uint64_t)3);
+	EXPECT_EQ(st.to_owners.messages_out, (std::uint64_t)3);
+}
+#else
+TEST(TestThreadComm, Metrics_OffByDefault) {
+	thread_comm::circular_queue<int> cq(2);
+
+	auto msg = std::make_unique<int>(1);
+	cq.write(msg);
+	cq.read(msg);
+	EXPECT_FALSE(cq.try_reading(msg));
+
+	auto st = cq.statistics();
+	EXPECT_EQ(st.messages_in, (std::uint64_t)0);
+	EXPECT_EQ(st.messages_out, (std::uint64_t)0);
+	EXPECT_EQ(st.failed_try_reads, (std::uint64_t)0);
+	EXPECT_EQ(st.high_water_mark, (std::size_t)0);
+}
+#endif
+
+// Priority_Circular_Queue tests start here.
+
+TEST(TestThreadComm, PriorityQueue_UrgentMessagesSkipTheBacklog) {
+	thread_comm::priority_circular_queue<int> q(8, 3);
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		q.write(msg);
+	}
+
+	auto control = std::make_unique<int>(100);
+	q.write(control, 0);
+	auto mid = std::make_unique<int>(50);
+	q.write(mid, 1);
+
+	EXPECT_EQ(q.msg_count(), (std::size_t)6);
+	EXPECT_EQ(q.msg_count(2), (std::size_t)4);
+
+	EXPECT_EQ(*q.read(), 100);
+	EXPECT_EQ(*q.read(), 50);
+	for (int i = 0 ; i < 4 ; ++i) {
+		EXPECT_EQ(*q.read(), i);
+	}
+}
+
+TEST(TestThreadComm, PriorityQueue_FullLevelDoesNotBlockOthers) {
+	thread_comm::priority_circular_queue<int> q(2);
+
+	for (int i = 0 ; i < 2 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		EXPECT_TRUE(q.try_writing(msg));
+	}
+
+	auto msg = std::make_unique<int>(2);
+	EXPECT_FALSE(q.try_writing(msg));
+	EXPECT_TRUE(q.try_writing(msg, 0));
+
+	EXPECT_EQ(*q.read(), 2);
+}
+
+TEST(TestThreadComm, PriorityQueue_AgingPreventsStarvation) {
+	thread_comm::priority_circular_queue<int> q(16, 2, 2);
+
+	auto bulk = std::make_unique<int>(-1);
+	q.write(bulk, 1);
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		q.write(msg, 0);
+	}
+
+	// The bulk message has been passed over twice by the third read.
+	EXPECT_EQ(*q.read(), 0);
+	EXPECT_EQ(*q.read(), -1);
+	EXPECT_EQ(*q.read(), 1);
+}
+
+TEST(TestThreadComm, PriorityQueue_AbortForInvalidLevel) {
+	thread_comm::priority_circular_queue<int> q(1, 2);
+	auto msg = std::make_unique<int>(0);
+
+	EXPECT_EXIT(q.write(msg, 2), testing::KilledBySignal(SIGABRT), "");
+	EXPECT_EXIT(thread_comm::priority_circular_queue<int> q2(1, 0),
+			testing::KilledBySignal(SIGABRT), "");
+}
+
+TEST(TestThreadComm, PriorityQueue_PriorityChannel) {
+	thread_comm::priority_channel<int> c(8);
+
+	for (int i = 0 ; i < 3 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c.write(msg);
+	}
+
+	auto control = std::make_unique<int>(100);
+	c.write(control, 0);
+
+	std::vector<int> seen;
+	std::thread t([&c, &seen] () {
+		std::unique_ptr<int> msg;
+		while (c.read(msg)) {
+			seen.push_back(*msg);
+		}
+	});
+
+	c.close_to_workers();
+	t.join();
+
+	EXPECT_EQ(seen, std::vector<int>({100, 0, 1, 2}));
+}
+
+// Broadcast_Ring tests start here.
+
+TEST(TestThreadComm, BroadcastRing_EverySubscriberSeesEveryMessage) {
+	const int number_of_messages = 1000;
+	const int number_of_subscribers = 3;
+	thread_comm::broadcast_ring<int> ring(16);
+
+	std::vector<thread_comm::broadcast_ring<int>::subscriber> subscribers;
+	for (int i = 0 ; i < number_of_subscribers ; ++i) {
+		subscribers.push_back(ring.subscribe());
+	}
+
+	std::vector<long> sums(number_of_subscribers, 0);
+	std::vector<std::thread> threads;
+	for (int i = 0 ; i < number_of_subscribers ; ++i) {
+		threads.emplace_back([&subscribers, &sums, i] () {
+			int expected = 0;
+			while (subscribers[i].consume([&] (const int & m) {
+				EXPECT_EQ(m, expected++);
+				sums[i] += m;
+			})) {
+			}
+		});
+	}
+
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		EXPECT_TRUE(ring.publish(i));
+	}
+
+	ring.close();
+	for (auto & t : threads) {
+		t.join();
+	}
+
+	for (auto sum : sums) {
+		EXPECT_EQ(sum, (long)number_of_messages * (number_of_messages - 1) / 2);
+	}
+}
+
+TEST(TestThreadComm, BroadcastRing_JoinAndLeaveAtRuntime) {
+	thread_comm::broadcast_ring<int> ring(4);
+
+	EXPECT_TRUE(ring.publish(0));
+
+	auto slow = ring.subscribe();
+	EXPECT_EQ(ring.subscriber_count(), (std::size_t)1);
+
+	for (int i = 1 ; i <= 4 ; ++i) {
+		EXPECT_TRUE(ring.publish(i));
+	}
+
+	// The slow subscriber is a whole ring behind, and it only sees the
+	// messages published after it joined.
+	EXPECT_FALSE(ring.try_publishing(5));
+	EXPECT_EQ(*slow.try_reading(), 1);
+	EXPECT_EQ(slow.backlog(), (std::size_t)3);
+	EXPECT_TRUE(ring.try_publishing(5));
+
+	slow.leave();
+	EXPECT_EQ(ring.subscriber_count(), (std::size_t)0);
+	for (int i = 6 ; i < 20 ; ++i) {
+		EXPECT_TRUE(ring.try_publishing(i));
+	}
+}
+
+TEST(TestThreadComm, BroadcastRing_LapPolicy) {
+	thread_comm::broadcast_ring<int> ring(4, thread_comm::broadcast_policy::lap);
+	auto slow = ring.subscribe();
+
+	for (int i = 0 ; i < 10 ; ++i) {
+		EXPECT_TRUE(ring.publish(i));
+	}
+
+	EXPECT_EQ(slow.lost(), (std::uint64_t)6);
+	for (int i = 6 ; i < 10 ; ++i) {
+		EXPECT_EQ(*slow.try_reading(), i);
+	}
+	EXPECT_FALSE(slow.try_reading().has_value());
+}
+
+TEST(TestThreadComm, BroadcastRing_DropPolicy) {
+	thread_comm::broadcast_ring<int> ring(4, thread_comm::broadcast_policy::drop);
+	auto slow = ring.subscribe();
+	auto fast = ring.subscribe();
+
+	for (int i = 0 ; i < 8 ; ++i) {
+		EXPECT_TRUE(ring.publish(i));
+		EXPECT_EQ(*fast.read(), i);
+	}
+
+	EXPECT_TRUE(slow.is_dropped());
+	EXPECT_FALSE(slow.read().has_value());
+	EXPECT_FALSE(fast.is_dropped());
+
+	bool timed_out = false;
+	EXPECT_FALSE(fast.timed_read(std::chrono::milliseconds(check_msecs),
+			timed_out).has_value());
+	EXPECT_TRUE(timed_out);
+}
+
+TEST(TestThreadComm, BroadcastRing_SubscribeWhilePublisherIsBlocked) {
+	thread_comm::broadcast_ring<int> ring(2);
+	auto slow = ring.subscribe();
+
+	std::thread publisher([&ring] () {
+		for (int i = 0 ; i < 3 ; ++i) {
+			EXPECT_TRUE(ring.publish(i));
+		}
+	});
+
+	// The third message waits for slow, and a new subscriber can still
+	// join in the meantime.
+	std::this_thread::sleep_for(std::chrono::milliseconds(sleep_msecs));
+	auto late = ring.subscribe();
+	EXPECT_EQ(ring.subscriber_count(), (std::size_t)2);
+
+	EXPECT_EQ(*slow.read(), 0);
+	publisher.join();
+
+	EXPECT_EQ(*late.read(), 2);
+	EXPECT_EQ(*slow.read(), 1);
+	EXPECT_EQ(*slow.read(), 2);
+}
+
+// Work_Stealing_Pool tests start here.
+
+TEST(TestThreadComm, WorkStealingPool_ChaseLevDeque) {
+	thread_comm::detail::chase_lev_deque deque(2);
+	std::vector<std::unique_ptr<thread_comm::detail::task>> tasks;
+
+	for (int i = 0 ; i < 5 ; ++i) {
+		tasks.push_back(std::make_unique<thread_comm::detail::callable_task<
+				std::function<void()>>>([] {}));
+		deque.push(tasks.back().get());
+	}
+
+	// The owner pops the newest task, the thieves steal the oldest.
+	EXPECT_EQ(deque.pop(), tasks[4].get());
+	EXPECT_EQ(deque.steal(), tasks[0].get());
+	EXPECT_EQ(deque.steal(), tasks[1].get());
+	EXPECT_EQ(deque.pop(), tasks[3].get());
+	EXPECT_EQ(deque.pop(), tasks[2].get());
+	EXPECT_EQ(deque.pop(), nullptr);
+	EXPECT_EQ(deque.steal(), nullptr);
+	EXPECT_TRUE(deque.empty());
+}
+
+TEST(TestThreadComm, WorkStealingPool_SubmitReturnsFutures) {
+	thread_comm::work_stealing_pool pool(4);
+
+	std::vector<std::future<int>> futures;
+	for (int i = 0 ; i < 100 ; ++i) {
+		futures.push_back(pool.submit([i] { return i * i; }));
+	}
+
+	for (int i = 0 ; i < 100 ; ++i) {
+		EXPECT_EQ(futures[i].get(), i * i);
+	}
+
+	auto failing = pool.submit([] () -> int {
+		throw std::runtime_error("failed");
+	});
+	EXPECT_THROW(failing.get(), std::runtime_error);
+}
+
+// Every task posts two more down to a depth, from inside the pool, and
+// shutdown() waits for the whole tree.
+static void spawn(thread_comm::work_stealing_pool & pool,
+		std::atomic<int> & count, const int depth) {
+	++count;
+	if (depth == 0) {
+		return;
+	}
+
+	for (int i = 0 ; i < 2 ; ++i) {
+		EXPECT_TRUE(pool.post([&pool, &count, depth] {
+			spawn(pool, count, depth - 1);
+		}));
+	}
+}
+
+TEST(TestThreadComm, WorkStealingPool_TasksPostingTasks) {
+	std::atomic<int> count(0);
+	thread_comm::work_stealing_pool pool(3);
+
+	pool.post([&pool, &count] {
+		EXPECT_TRUE(pool.in_pool());
+		spawn(pool, count, 10);
+	});
+
+	pool.shutdown();
+	EXPECT_EQ(count.load(), (1 << 11) - 1);
+	EXPECT_FALSE(pool.in_pool());
+}
+
+TEST(TestThreadComm, WorkStealingPool_ShutdownDrainsAndRejects) {
+	const int number_of_tasks = 100;
+	std::atomic<int> count(0);
+	thread_comm::work_stealing_pool pool(1);
+
+	pool.post([] { std::this_thread::sleep_for(
+			std::chrono::milliseconds(sleep_msecs)); });
+	for (int i = 0 ; i < number_of_tasks ; ++i) {
+		pool.post([&count] { ++count; });
+	}
+
+	pool.shutdown();
+	EXPECT_EQ(count.load(), number_of_tasks);
+
+	EXPECT_FALSE(pool.post([&count] { ++count; }));
+	auto rejected = pool.submit([] { return 1; });
+	EXPECT_THROW(rejected.get(), std::future_error);
+}
+
+// Coroutine tests start here.
+
+#if defined(THREAD_COMM_COROUTINES)
+// A coroutine that starts right away and that nobody waits for.
+struct detached_coroutine {
+	struct promise_type {
+		detached_coroutine get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+static detached_coroutine sum_messages(thread_comm::circular_queue<int> & cq,
+		thread_comm::work_stealing_pool & pool, std::promise<int> & result) {
+	int sum = 0;
+	std::unique_ptr<int> msg;
+
+	while (co_await cq.async_read(msg, pool) == thread_comm::async_status::ok) {
+		sum += *msg;
+	}
+
+	result.set_value(sum);
+}
+
+TEST(TestThreadComm, Coroutine_AsyncRead) {
+	const int number_of_messages = 1000;
+	thread_comm::circular_queue<int> cq(4);
+	thread_comm::work_stealing_pool pool(2);
+	std::promise<int> result;
+
+	sum_messages(cq, pool, result);
+
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		cq.write(msg);
+	}
+	cq.close();
+
+	EXPECT_EQ(result.get_future().get(),
+			number_of_messages * (number_of_messages - 1) / 2);
+}
+
+static detached_coroutine write_messages(thread_comm::circular_queue<int> & cq,
+		thread_comm::work_stealing_pool & pool,
+		std::promise<thread_comm::async_status> & result) {
+	thread_comm::async_status status = thread_comm::async_status::ok;
+
+	for (int i = 0 ; status == thread_comm::async_status::ok ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		status = co_await cq.async_write(msg, pool);
+
+		// A failed write leaves the message with the caller.
+		EXPECT_EQ(msg == nullptr, status == thread_comm::async_status::ok);
+	}
+
+	result.set_value(status);
+}
+
+TEST(TestThreadComm, Coroutine_AsyncWriteWaitsForRoom) {
+	const int number_of_messages = 100;
+	thread_comm::circular_queue<int> cq(2);
+	thread_comm::work_stealing_pool pool(1);
+	std::promise<thread_comm::async_status> result;
+
+	write_messages(cq, pool, result);
+
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		EXPECT_EQ(*cq.read(), i);
+	}
+
+	// The writer fills the queue up again, and stays suspended until
+	// the queue is closed.
+	while (cq.msg_count() < 2) {
+		std::this_thread::yield();
+	}
+	cq.close();
+
+	EXPECT_EQ(result.get_future().get(), thread_comm::async_status::closed);
+}
+
+static detached_coroutine timed_read(thread_comm::circular_queue<int> & cq,
+		thread_comm::work_stealing_pool & pool,
+		std::promise<std::vector<thread_comm::async_status>> & result) {
+	std::vector<thread_comm::async_status> statuses;
+	std::unique_ptr<int> msg;
+
+	statuses.push_back(co_await cq.async_timed_read(msg,
+			std::chrono::milliseconds(check_msecs), pool));
+	statuses.push_back(co_await cq.async_timed_read(msg,
+			std::chrono::seconds(10), pool));
+	EXPECT_EQ(*msg, 7);
+
+	result.set_value(statuses);
+}
+
+TEST(TestThreadComm, Coroutine_AsyncTimedRead) {
+	thread_comm::circular_queue<int> cq;
+	thread_comm::work_stealing_pool pool(1);
+	std::promise<std::vector<thread_comm::async_status>> result;
+
+	auto start = std::chrono::steady_clock::now();
+	timed_read(cq, pool, result);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(2 * sleep_msecs));
+	auto msg = std::make_unique<int>(7);
+	cq.write(msg);
+
+	auto statuses = result.get_future().get();
+	EXPECT_EQ(statuses, std::vector<thread_comm::async_status>({
+			thread_comm::async_status::timed_out,
+			thread_comm::async_status::ok}));
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+}
+
+static detached_coroutine echo(thread_comm::channel<int>::endpoint worker,
+		thread_comm::work_stealing_pool & pool) {
+	std::unique_ptr<int> msg;
+
+	while (co_await worker.async_read(msg, pool) ==
+			thread_comm::async_status::ok) {
+		*msg *= 2;
+		co_await worker.async_write(msg, pool);
+	}
+}
+
+TEST(TestThreadComm, Coroutine_ChannelEndpoint) {
+	thread_comm::channel<int> c(1);
+	thread_comm::work_stealing_pool pool(2);
+
+	// Many more coroutines than threads.
+	for (int i = 0 ; i < 50 ; ++i) {
+		echo(c.worker_end(), pool);
+	}
+
+	for (int i = 0 ; i < 200 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c.write(msg);
+		c.read(msg);
+		EXPECT_EQ(*msg, 2 * i);
+	}
+
+	c.close_to_workers();
+	pool.shutdown();
+}
+
+// Resumes the coroutines on the thread that hands them their messages.
+struct inline_executor {
+	template <typename F>
+	void post(F f) {
+		f();
+	}
+};
+
+static detached_coroutine forward(thread_comm::circular_queue<int> & in,
+		thread_comm::circular_queue<int> & out, inline_executor & ex) {
+	std::unique_ptr<int> msg;
+
+	while (co_await in.async_read(msg, ex) == thread_comm::async_status::ok) {
+		// Runs on the writer's thread, so this would deadlock if the
+		// writer still held the lock of in.
+		*msg += 1;
+		co_await in.async_timed_write(msg, std::chrono::seconds(10), ex);
+		co_await in.async_read(msg, ex);
+		out.write(msg);
+	}
+	out.close();
+}
+
+TEST(TestThreadComm, Coroutine_InlineExecutor) {
+	thread_comm::circular_queue<int> in(2);
+	thread_comm::circular_queue<int> out(8);
+	inline_executor ex;
+
+	forward(in, out, ex);
+
+	for (int i = 0 ; i < 5 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		in.write(msg);
+	}
+	in.close();
+
+	for (int i = 0 ; i < 5 ; ++i) {
+		EXPECT_EQ(*out.read(), i + 1);
+	}
+	EXPECT_EQ(out.read(), nullptr);
+}
+
+static detached_coroutine read_with_timeout(
+		thread_comm::circular_queue<int> & cq, inline_executor & ex,
+		std::atomic<int> & received) {
+	std::unique_ptr<int> msg;
+
+	while (co_await cq.async_timed_read(msg, std::chrono::hours(1), ex) ==
+			thread_comm::async_status::ok) {
+		++received;
+	}
+}
+
+TEST(TestThreadComm, Coroutine_CompletedOperationsCancelTheirTimers) {
+	auto & timers = thread_comm::detail::timer_service::instance();
+	const std::size_t before = timers.pending();
+
+	thread_comm::circular_queue<int> cq(4);
+	inline_executor ex;
+	std::atomic<int> received{0};
+
+	read_with_timeout(cq, ex, received);
+	EXPECT_EQ(timers.pending(), before + 1);
+
+	for (int i = 0 ; i < 100 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		cq.write(msg);
+	}
+
+	// Only the read that is waiting now has a timer.
+	EXPECT_EQ(received.load(), 100);
+	EXPECT_EQ(timers.pending(), before + 1);
+
+	cq.close();
+	EXPECT_EQ(timers.pending(), before);
+}
+#endif
+
+// Sharded_Queue tests start here.
+
+TEST(TestThreadComm, ShardedQueue_BasicFunctionality) {
+	thread_comm::sharded_queue<int> q(8, 4);
+	EXPECT_EQ(q.shard_count(), (std::size_t)4);
+
+	for (int i = 0 ; i < 8 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		EXPECT_TRUE(q.try_writing(msg));
+	}
+
+	auto msg = std::make_unique<int>(8);
+	EXPECT_FALSE(q.try_writing(msg));
+	EXPECT_EQ(q.msg_count(), (std::size_t)8);
+
+	// A single thread spills over into the other shards, and reads them
+	// all back.
+	std::vector<int> seen;
+	while (q.try_reading(msg)) {
+		seen.push_back(*msg);
+	}
+	std::sort(seen.begin(), seen.end());
+	EXPECT_EQ(seen, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7}));
+
+	bool timed_out = false;
+	EXPECT_EQ(q.timed_read(std::chrono::milliseconds(check_msecs), timed_out),
+			nullptr);
+	EXPECT_TRUE(timed_out);
+}
+
+TEST(TestThreadComm, ShardedQueue_ManyProducersAndConsumers) {
+	const int number_of_threads = 4;
+	const int messages_per_producer = 2000;
+	for (auto policy : {thread_comm::sharding::by_thread,
+			thread_comm::sharding::round_robin}) {
+		thread_comm::sharded_queue<int> q(16, 4, policy);
+		std::atomic<long> sum(0);
+
+		std::vector<std::thread> consumers;
+		for (int i = 0 ; i < number_of_threads ; ++i) {
+			consumers.emplace_back([&q, &sum] () {
+				std::unique_ptr<int> msg;
+				while (q.read(msg)) {
+					sum += *msg;
+				}
+			});
+		}
+
+		std::vector<std::thread> producers;
+		for (int i = 0 ; i < number_of_threads ; ++i) {
+			producers.emplace_back([&q, messages_per_producer] () {
+				for (int j = 0 ; j < messages_per_producer ; ++j) {
+					auto msg = std::make_unique<int>(j);
+					EXPECT_TRUE(q.write(msg));
+				}
+			});
+		}
+
+		for (auto & t : producers) {
+			t.join();
+		}
+		q.close();
+		for (auto & t : consumers) {
+			t.join();
+		}
+
+		EXPECT_EQ(sum.load(), (long)number_of_threads *
+				messages_per_producer * (messages_per_producer - 1) / 2);
+		EXPECT_EQ(q.msg_count(), (std::size_t)0);
+	}
+}
+
+TEST(TestThreadComm, ShardedQueue_ShardedChannel) {
+	const int number_of_messages = 1000;
+	thread_comm::sharded_channel<int> c(32);
+
+	std::vector<std::thread> workers;
+	for (int i = 0 ; i < 3 ; ++i) {
+		workers.emplace_back([&c] () {
+			auto worker = c.worker_end();
+			std::unique_ptr<int> msg;
+			while (worker.read(msg)) {
+				*msg += 1;
+				worker.write(msg);
+			}
+		});
+	}
+
+	long sum = 0;
+	std::thread collector([&c, &sum] () {
+		c.become_a_read_owner();
+		c.become_a_non_writer();
+		std::unique_ptr<int> msg;
+		while (c.read(msg)) {
+			sum += *msg;
+		}
+	});
+
+	c.become_a_non_reader();
+	for (int i = 0 ; i < number_of_messages ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c.write(msg);
+	}
+
+	c.close_to_workers();
+	for (auto & t : workers) {
+		t.join();
+	}
+	c.close_to_owners();
+	collector.join();
+
+	EXPECT_EQ(sum, (long)number_of_messages * (number_of_messages + 1) / 2);
+}
+
+// Partitioned_Channel tests start here.
+
+typedef struct keyed_s {
+	int key;
+	int seq;
+} keyed;
+
+static std::size_t key_of(const keyed & k) {
+	return static_cast<std::size_t>(k.key);
+}
+
+TEST(TestThreadComm, PartitionedChannel_KeepsPerKeyOrder) {
+	const int number_of_keys = 16;
+	const int messages_per_key = 200;
+	const int number_of_workers = 4;
+	thread_comm::partitioned_channel<keyed> c(key_of, 8, 4);
+
+	std::vector<thread_comm::partitioned_channel<keyed>::worker> workers;
+	for (int i = 0 ; i < number_of_workers ; ++i) {
+		workers.push_back(c.join());
+	}
+
+	std::vector<std::thread> threads;
+	for (int i = 0 ; i < number_of_workers ; ++i) {
+		threads.emplace_back([&workers, i, number_of_keys] () {
+			std::vector<int> last(number_of_keys, -1);
+			std::unique_ptr<keyed> msg;
+			while (workers[i].read(msg)) {
+				EXPECT_EQ(msg->seq, last[msg->key] + 1);
+				last[msg->key] = msg->seq;
+				workers[i].write(msg);
+			}
+		});
+	}
+
+	long received = 0;
+	std::thread collector([&c, &received] () {
+		std::unique_ptr<keyed> msg;
+		while (c.read(msg)) {
+			++received;
+		}
+	});
+
+	for (int seq = 0 ; seq < messages_per_key ; ++seq) {
+		for (int key = 0 ; key < number_of_keys ; ++key) {
+			auto msg = std::make_unique<keyed>(keyed{key, seq});
+			EXPECT_TRUE(c.write(msg));
+		}
+	}
+
+	c.close_to_workers();
+	for (auto & t : threads) {
+		t.join();
+	}
+	c.close_to_owners();
+	collector.join();
+
+	EXPECT_EQ(received, (long)number_of_keys * messages_per_key);
+}
+
+TEST(TestThreadComm, PartitionedChannel_RebalancesOnJoinAndLeave) {
+	thread_comm::partitioned_channel<keyed> c(key_of, 8);
+
+	// The messages written while there are no workers wait for one.
+	auto msg = std::make_unique<keyed>(keyed{3, 0});
+	c.write(msg);
+
+	auto first = c.join();
+	EXPECT_EQ(first.partition_count(), (std::size_t)8);
+
+	{
+		auto second = c.join();
+		auto third = c.join();
+		EXPECT_EQ(c.worker_count(), (std::size_t)3);
+		EXPECT_EQ(first.partition_count() + second.partition_count() +
+				third.partition_count(), (std::size_t)8);
+		EXPECT_LE(first.partition_count(), (std::size_t)3);
+		EXPECT_GE(third.partition_count(), (std::size_t)2);
+	}
+
+	EXPECT_EQ(c.worker_count(), (std::size_t)1);
+	EXPECT_EQ(first.partition_count(), (std::size_t)8);
+	EXPECT_TRUE(first.try_reading(msg));
+	EXPECT_EQ(msg->key, 3);
+}
+
+TEST(TestThreadComm, PartitionedChannel_HandoffAtReadBoundary) {
+	thread_comm::partitioned_channel<keyed> c(key_of, 2);
+	auto a = c.join();
+
+	for (int seq = 0 ; seq < 2 ; ++seq) {
+		auto msg = std::make_unique<keyed>(keyed{1, seq});
+		c.write(msg);
+	}
+
+	std::unique_ptr<keyed> msg;
+	EXPECT_TRUE(a.try_reading(msg));
+	EXPECT_EQ(msg->seq, 0);
+
+	// Partition 1 moves to b, but a is still handling its message.
+	auto b = c.join();
+	EXPECT_EQ(b.partition_count(), (std::size_t)1);
+	EXPECT_FALSE(b.try_reading(msg));
+
+	// a's next read hands it over.
+	EXPECT_FALSE(a.try_reading(msg));
+	EXPECT_TRUE(b.try_reading(msg));
+	EXPECT_EQ(msg->seq, 1);
+}
+
+TEST(TestThreadComm, PartitionedChannel_TimedReadAfterClose) {
+	thread_comm::partitioned_channel<keyed> c(key_of, 2);
+	auto w = c.join();
+
+	auto msg = std::make_unique<keyed>(keyed{1, 0});
+	c.write(msg);
+
+	std::thread closer([&c] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		c.close_to_workers();
+	});
+
+	bool timed_out = true;
+	msg = w.timed_read(std::chrono::seconds(5), timed_out);
+	ASSERT_TRUE(msg);
+	EXPECT_EQ(msg->seq, 0);
+
+	// Closed and drained is the end, not a timeout.
+	msg = w.timed_read(std::chrono::seconds(5), timed_out);
+	EXPECT_FALSE(msg);
+	EXPECT_FALSE(timed_out);
+	closer.join();
+
+	msg = w.timed_read(std::chrono::milliseconds(1), timed_out);
+	EXPECT_FALSE(msg);
+	EXPECT_FALSE(timed_out);
+}
+
+// Ordered_Channel tests start here.
+
+TEST(TestThreadComm, OrderedChannel_ResultsInOrder) {
+	thread_comm::ordered_channel<int> c(8);
+	const int number_of_messages = 400;
+	std::vector<std::thread> threads;
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		threads.emplace_back([&c, i] {
+			auto w = c.worker_end();
+			std::unique_ptr<int> msg;
+			while (w.read(msg)) {
+				if ((*msg + i) % 3 == 0) {
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+				*msg *= 2;
+				w.write(msg);
+			}
+		});
+	}
+
+	std::thread producer([&c] {
+		for (int i = 0 ; i < number_of_messages ; ++i) {
+			auto msg = std::make_unique<int>(i);
+			c.write(msg);
+		}
+		c.close_to_workers();
+	});
+
+	std::unique_ptr<int> msg;
+	int expected = 0;
+	std::thread closer([&] {
+		producer.join();
+		for (auto & t : threads) {
+			t.join();
+		}
+		c.close_to_owners();
+	});
+	while (c.read(msg)) {
+		EXPECT_EQ(*msg, expected * 2);
+		++expected;
+	}
+	closer.join();
+
+	EXPECT_EQ(expected, number_of_messages);
+}
+
+TEST(TestThreadComm, OrderedChannel_WindowBackpressure) {
+	thread_comm::ordered_channel<int> c(2);
+	auto w = c.worker_end();
+
+	for (int i = 0 ; i < 2 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		EXPECT_TRUE(c.try_writing(msg));
+	}
+	auto msg = std::make_unique<int>(2);
+	EXPECT_FALSE(c.try_writing(msg));
+
+	// The second result can't get past the first one.
+	std::unique_ptr<int> first, second;
+	EXPECT_TRUE(w.read(first));
+	auto other = c.worker_end();
+	EXPECT_TRUE(other.read(second));
+	other.write(second);
+	EXPECT_FALSE(c.try_reading(msg));
+	EXPECT_EQ(c.msg_count(), (std::size_t)1);
+
+	w.write(first);
+	EXPECT_TRUE(c.try_reading(msg));
+	EXPECT_EQ(*msg, 0);
+	EXPECT_TRUE(c.try_writing(msg));
+}
+
+TEST(TestThreadComm, OrderedChannel_SkippedMessages) {
+	thread_comm::ordered_channel<int> c(4);
+	auto w = c.worker_end();
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c.write(msg);
+	}
+	c.close_to_workers();
+
+	std::unique_ptr<int> msg;
+	while (w.read(msg)) {
+		if (*msg % 2) {
+			w.write(msg);
+		}
+	}
+	c.close_to_owners();
+
+	EXPECT_TRUE(c.read(msg));
+	EXPECT_EQ(*msg, 1);
+	EXPECT_TRUE(c.read(msg));
+	EXPECT_EQ(*msg, 3);
+	EXPECT_FALSE(c.read(msg));
+}
+
+TEST(TestThreadComm, OrderedChannel_LateResultAfterClose) {
+	thread_comm::ordered_channel<int> c(4);
+	auto fast = c.worker_end();
+	auto slow = c.worker_end();
+
+	for (int i = 0 ; i < 4 ; ++i) {
+		auto msg = std::make_unique<int>(i);
+		c.write(msg);
+	}
+
+	std::unique_ptr<int> msg;
+	std::unique_ptr<int> held;
+	ASSERT_TRUE(fast.read(msg));
+	fast.write(msg);
+	ASSERT_TRUE(slow.read(held));
+	for (int i = 2 ; i < 4 ; ++i) {
+		ASSERT_TRUE(fast.read(msg));
+		fast.write(msg);
+	}
+	c.close_to_owners();
+
+	// 1 is given up on, and 4 takes the slot it had.
+	for (int expected : {0, 2, 3}) {
+		EXPECT_TRUE(c.read(msg));
+		EXPECT_EQ(*msg, expected);
+	}
+	msg = std::make_unique<int>(4);
+	EXPECT_TRUE(c.write(msg));
+	ASSERT_TRUE(fast.read(msg));
+	fast.write(msg);
+	EXPECT_TRUE(c.read(msg));
+	EXPECT_EQ(*msg, 4);
+
+	slow.write(held);
+	EXPECT_FALSE(held);
+	EXPECT_FALSE(c.try_reading(msg));
+	EXPECT_EQ(c.msg_count(), (std::size_t)0);
+
+	msg = std::make_unique<int>(5);
+	EXPECT_TRUE(c.write(msg));
+	ASSERT_TRUE(fast.read(msg));
+	fast.write(msg);
+	EXPECT_TRUE(c.read(msg));
+	EXPECT_EQ(*msg, 5);
+}
+
+// Pipeline tests start here.
+
+TEST(TestThreadComm, Pipeline_SourceStagesSink) {
+	int next = 0;
+	std::atomic<long> sum{0};
+
+	auto p = thread_comm::source([&next] {
+		return next < 1000 ? std::make_unique<int>(++next) : nullptr;
+	}) | thread_comm::stage([] (std::unique_ptr<int> n) {
+		return std::make_unique<long>((long)*n * *n);
+	}, 4, 16) | thread_comm::stage([] (std::unique_ptr<long> n) {
+		return *n % 2 ? nullptr : std::move(n);
+	}, 2).named("evens") | thread_comm::sink([&sum] (std::unique_ptr<long> n) {
+		sum += *n;
+	});
+
+	EXPECT_EQ(p.thread_count(), 8);
+	p.run();
+
+	long expected = 0;
+	for (long i = 2 ; i <= 1000 ; i += 2) {
+		expected += i * i;
+	}
+	EXPECT_EQ(sum.load(), expected);
+
+	auto stats = p.statistics();
+	ASSERT_EQ(stats.size(), (std::size_t)4);
+	EXPECT_EQ(stats[0].name, "source");
+	EXPECT_EQ(stats[0].messages_out, (std::uint64_t)1000);
+	EXPECT_EQ(stats[1].name, "stage 1");
+	EXPECT_EQ(stats[1].parallelism, 4);
+	EXPECT_EQ(stats[1].messages_in, (std::uint64_t)1000);
+#if defined(THREAD_COMM_METRICS)
+	EXPECT_EQ(stats[1].input.messages_out, (std::uint64_t)1000);
+#endif
+	EXPECT_EQ(stats[2].name, "evens");
+	EXPECT_EQ(stats[2].messages_out, (std::uint64_t)500);
+	EXPECT_EQ(stats[3].name, "sink");
+	EXPECT_EQ(stats[3].messages_in, (std::uint64_t)500);
+}
+
+TEST(TestThreadComm, Pipeline_Stop) {
+	std::atomic<int> received{0};
+
+	auto p = thread_comm::source([] {
+		return std::make_unique<int>(1);
+	}) | thread_comm::stage([] (std::unique_ptr<int> n) {
+		return n;
+	}, 2, 4) | thread_comm::sink([&received] (std::unique_ptr<int>) {
+		++received;
+	});
+
+	p.start();
+	while (received < 100) {
+		std::this_thread::yield();
+	}
+	p.stop();
+	p.wait();
+
+	// Whatever the source made it to the sink.
+	auto stats = p.statistics();
+	EXPECT_EQ(stats[0].messages_out, (std::uint64_t)received.load());
+}
+
+TEST(TestThreadComm, Pipeline_FusesSerialStages) {
+	int next = 0;
+	std::vector<int> received;
+
+	auto p = thread_comm::source([&next] {
+		return next < 100 ? std::make_unique<int>(next++) : nullptr;
+	}) | thread_comm::stage([] (std::unique_ptr<int> n) {
+		*n += 1;
+		return n;
+	}) | thread_comm::stage([] (std::unique_ptr<int> n) {
+		return *n % 10 ? std::move(n) : nullptr;
+	}) | thread_comm::sink([&received] (std::unique_ptr<int> n) {
+		received.push_back(*n);
+	});
+
+	EXPECT_EQ(p.thread_count(), 1);
+	EXPECT_EQ(p.fusion_report(), "source + stage 1 + stage 2 + sink: 1 thread\n");
+	p.run();
+
+	// Everything ran on one thread, in order.
+	ASSERT_EQ(received.size(), (std::size_t)90);
+	EXPECT_EQ(received.front(), 1);
+	EXPECT_EQ(received.back(), 99);
+	EXPECT_TRUE(std::is_sorted(received.begin(), received.end()));
+
+	auto stats = p.statistics();
+	EXPECT_FALSE(stats[0].fused);
+	EXPECT_TRUE(stats[3].fused);
+	EXPECT_EQ(stats[3].messages_in, (std::uint64_t)90);
+}
+
+TEST(TestThreadComm, Pipeline_FusibleStages) {
+	std::atomic<int> next{0};
+	std::atomic<long> sum{0};
+
+	auto p = thread_comm::source([&next] {
+		return next < 1000 ? std::make_unique<int>(next++) : nullptr;
+	}).named("read") | thread_comm::stage([] (std::unique_ptr<int> n) {
+		return n;
+	}, 4).named("parse") | thread_comm::stage([] (std::unique_ptr<int> n) {
+		*n *= 2;
+		return n;
+	}, 4).named("double").fusible() | thread_comm::stage([] (std::unique_ptr<int> n) {
+		return n;
+	}).named("check").fusible(false) | thread_comm::sink([&sum] (std::unique_ptr<int> n) {
+		sum += *n;
+	});
+
+	EXPECT_EQ(p.thread_count(), 6);
+	EXPECT_EQ(p.fusion_report(), "read: 1 thread\nparse + double: 4 threads\n"
+			"check + sink: 1 thread\n");
+	p.run();
+
+	EXPECT_EQ(sum.load(), 999L * 1000);
+	auto stats = p.statistics();
+	EXPECT_TRUE(stats[2].fused);
+	EXPECT_EQ(stats[2].parallelism, 4);
+	EXPECT_EQ(stats[2].messages_in, (std::uint64_t)1000);
+	EXPECT_FALSE(stats[3].fused);
+}
+
+TEST(TestThreadComm, Pipeline_SerialStageNotFusedOntoParallelOne) {
+	std::atomic<int> next{0};
+	// Only the count stage's single thread touches it.
+	int counted = 0;
+
+	auto p = thread_comm::source([&next] {
+		return next < 1000 ? std::make_unique<int>(next++) : nullptr;
+	}) | thread_comm::stage([] (std::unique_ptr<int> n) {
+		return n;
+	}, 4).named("parse") | thread_comm::stage([&] (std::unique_ptr<int> n) {
+		++counted;
+		return n;
+	}).named("count").fusible() | thread_comm::sink([] (std::unique_ptr<int>) {
+	});
+
+	EXPECT_EQ(p.fusion_report(), "source: 1 thread\nparse: 4 threads\n"
+			"count + sink: 1 thread\n");
+	p.run();
+
+	EXPECT_EQ(counted, 1000);
+	EXPECT_FALSE(p.statistics()[2].fused);
+}
+
+// Shared_Memory_Queue tests start here.
+
+#if defined(THREAD_COMM_SHARED_MEMORY)
+typedef struct tick_s {
+	int sequence;
+	double price;
+} tick;
+
+static std::string shared_memory_name(const char * test) {
+	return std::string("/thread_comm_") + test + "_" + std::to_string(getpid());
+}
+
+TEST(TestThreadComm, SharedMemoryQueue_BetweenProcesses) {
+	const std::string name = shared_memory_name("between");
+	auto q = thread_comm::shared_memory_queue<tick>::create(name, 16);
+	ASSERT_TRUE(q);
+
+	const int number_of_messages = 10000;
+	const pid_t child = fork();
+	ASSERT_GE(child, 0);
+
+	if (child == 0) {
+		auto other = thread_comm::shared_memory_queue<tick>::attach(name);
+		if (!other || other->size() != 16) {
+			_exit(1);
+		}
+		for (int i = 0 ; i < number_of_messages ; ++i) {
+			other->write(tick{i, i * 0.5});
+		}
+		other->close();
+		_exit(0);
+	}
+
+	tick t;
+	int expected = 0;
+	while (q->read(t)) {
+		EXPECT_EQ(t.sequence, expected);
+		EXPECT_EQ(t.price, expected * 0.5);
+		++expected;
+	}
+
+	int status;
+	waitpid(child, &status, 0);
+	EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	EXPECT_EQ(expected, number_of_messages);
+	EXPECT_TRUE(thread_comm::shared_memory_queue<tick>::unlink(name));
+}
+
+TEST(TestThreadComm, SharedMemoryQueue_CreateAndAttach) {
+	const std::string name = shared_memory_name("attach");
+
+	EXPECT_FALSE(thread_comm::shared_memory_queue<tick>::attach(name));
+	EXPECT_EQ(errno, ENOENT);
+
+	auto q = thread_comm::shared_memory_queue<tick>::create(name, 2);
+	ASSERT_TRUE(q);
+	EXPECT_FALSE(thread_comm::shared_memory_queue<tick>::create(name, 2));
+	EXPECT_EQ(errno, EEXIST);
+	EXPECT_FALSE(thread_comm::shared_memory_queue<long>::attach(name));
+	EXPECT_EQ(errno, EINVAL);
+
+	auto other = thread_comm::shared_memory_queue<tick>::attach(name);
+	ASSERT_TRUE(other);
+	EXPECT_TRUE(q->try_writing(tick{1, 1.0}));
+	EXPECT_TRUE(q->try_writing(tick{2, 2.0}));
+	EXPECT_FALSE(q->timed_write(tick{3, 3.0}, std::chrono::milliseconds(1)));
+	EXPECT_EQ(other->msg_count(), (std::size_t)2);
+
+	tick t;
+	EXPECT_TRUE(other->try_reading(t));
+	EXPECT_EQ(t.sequence, 1);
+	other.reset();
+
+	// Detaching leaves the messages where they are.
+	EXPECT_TRUE(q->try_reading(t));
+	EXPECT_EQ(t.sequence, 2);
+	EXPECT_FALSE(q->timed_read(t, std::chrono::milliseconds(1)));
+	EXPECT_TRUE(thread_comm::shared_memory_queue<tick>::unlink(name));
+}
+
+TEST(TestThreadComm, SharedMemoryQueue_Detach) {
+	const std::string name = shared_memory_name("detach");
+	auto q = thread_comm::shared_memory_queue<tick>::create(name, 2);
+	ASSERT_TRUE(q);
+	auto other = thread_comm::shared_memory_queue<tick>::attach(name);
+	ASSERT_TRUE(other);
+	EXPECT_TRUE(other->try_writing(tick{1, 1.0}));
+
+	other->detach();
+	EXPECT_FALSE(other->is_attached());
+	EXPECT_EQ(other->size(), (std::size_t)0);
+	other->detach();
+	other.reset();
+
+	tick t;
+	EXPECT_TRUE(q->is_attached());
+	EXPECT_TRUE(q->try_reading(t));
+	EXPECT_EQ(t.sequence, 1);
+	EXPECT_TRUE(thread_comm::shared_memory_queue<tick>::unlink(name));
+}
+
+TEST(TestThreadComm, SharedMemoryQueue_RecoversFromDeadPeer) {
+	const std::string name = shared_memory_name("recover");
+	auto q = thread_comm::shared_memory_queue<tick>::create(name, 4);
+	ASSERT_TRUE(q);
+	EXPECT_TRUE(q->try_writing(tick{1, 1.0}));
+
+	int locked[2];
+	ASSERT_EQ(pipe(locked), 0);
+	const pid_t child = fork();
+	ASSERT_GE(child, 0);
+
+	if (child == 0) {
+		// Takes the mutex the way a write() would, tells the parent, and
+		// waits there to be killed.
+		const int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0) {
+			_exit(1);
+		}
+		void * region = mmap(nullptr, sizeof(thread_comm::detail::shared_ring_header),
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (region == MAP_FAILED) {
+			_exit(1);
+		}
+		auto * header = static_cast<thread_comm::detail::shared_ring_header *>(region);
+		pthread_mutex_lock(&header->mutex);
+		const char c = 'x';
+		if (write(locked[1], &c, 1) != 1) {
+			_exit(1);
+		}
+		for (;;) {
+			pause();
+		}
+	}
+
+	close(locked[1]);
+	char c;
+	ASSERT_EQ(read(locked[0], &c, 1), 1);
+	close(locked[0]);
+	kill(child, SIGKILL);
+
+	int status;
+	waitpid(child, &status, 0);
+	EXPECT_TRUE(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+	EXPECT_EQ(q->msg_count(), (std::size_t)1);
+	EXPECT_EQ(q->recoveries(), (std::uint64_t)1);
+
+	tick t;
+	EXPECT_TRUE(q->try_writing(tick{2, 2.0}));
+	EXPECT_TRUE(q->try_reading(t));
+	EXPECT_EQ(t.sequence, 1);
+	EXPECT_TRUE(q->try_reading(t));
+	EXPECT_EQ(t.sequence, 2);
+	EXPECT_TRUE(thread_comm::shared_memory_queue<tick>::unlink(name));
+}
+#endif
+
 int main(int argc, char ** argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();